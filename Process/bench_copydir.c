@@ -0,0 +1,920 @@
+// A benchmark of copydir_sp and copydir_mp on synthetic trees generated with fixed seeds
+// Every tree is generated once in the work directory(the same seed always gives the same tree), then every
+// configuration copies it with a cold(if the page cache can be dropped) and a warm cache, results are appended
+// to a CSV file, so runs of different commits can be compared
+// Compile: gcc -O2 -o bench_copydir bench_copydir.c
+// Use: ./bench_copydir [-s scale] [-r repeats] [-d work directory] [-b tool directory] [-o results.csv] [-l label] [-t trees]
+//      -s: scale of the trees(default 1: one million tiny files, 1 GiB huge files, ...), e.g. 0.01 for a quick run
+//      -r: runs of every configuration and cache state(default 3)
+//      -d: directory for the trees and the copies(default /tmp/bench_copydir), trees are kept for the next run
+//      -b: directory of copydir_sp and copydir_mp(default .)
+//      -o: CSV file the results are appended to(default bench_copydir.csv)
+//      -l: label of the results, e.g. a commit id(default unlabeled)
+//      -t: comma separated trees(default all): tiny, huge, deep, wide, sparse, hardlink, trap, journal
+//      The trap tree is copied onto symbolic links and FIFOs planted at the target names, every run must replace
+//      them without writing through a link(copydir_sp only in its incremental mode), otherwise the benchmark
+//      reports the run and exits with -1
+//      The journal tree is not timed: two resumes of copydir_sp and copydir_mp over a journal whose last line is torn must
+//      not take that line for a completed file, otherwise the benchmark exits with -1
+//      The read requests, merged reads and busy time of the disk holding the work directory are read from
+//      /sys/dev/block around every run(-1 on a filesystem without a block device, e.g. tmpfs), they show the seeks
+//      saved by --order on a rotational disk(or a loop device throttled with a cgroup io.max)
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <limits.h>
+#include <stdio.h>
+
+#define BENCH_SEED 0x5eed2024ULL// Seed of the first tree, tree i uses BENCH_SEED + i
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+// Options of the benchmark
+struct bench_options {
+    double scale;
+    int repeats;
+    const char* work_dir;
+    const char* tool_dir;
+    const char* csv_path;
+    const char* label;
+    const char* trees;// NULL for all trees
+};
+
+// A configuration of a copy tool
+struct bench_config {
+    const char* name;
+    const char* tool;
+    const char* args[4];
+    int resync;// Copy once before the measured run, which then finds an up to date target
+};
+
+static const struct bench_config configs[] = {
+    {"sp-sync", "copydir_sp", {"-e", "sync", NULL}, 0},
+    {"sp-uring", "copydir_sp", {"-e", "uring", NULL}, 0},
+    {"mp-sync", "copydir_mp", {"-e", "sync", NULL}, 0},
+    {"mp-uring", "copydir_mp", {"-e", "uring", NULL}, 0},
+    {"mp-nochunk", "copydir_mp", {"-t", "0", NULL}, 0},
+    {"sp-inode", "copydir_sp", {"--order=inode", NULL}, 0},
+    {"sp-extent", "copydir_sp", {"--order=extent", NULL}, 0},
+    {"mp-extent", "copydir_mp", {"--order=extent", NULL}, 0},
+    {"sp-resync", "copydir_sp", {"-u", NULL}, 1},
+    {"mp-resync", "copydir_mp", {"-u", NULL}, 1},
+};
+
+// Measurements of a run
+struct bench_result {
+    int status;// Exit status of the tool, -1 if it was killed
+    double wall;
+    struct rusage usage;// Of the tool and its workers
+    long long syscalls;// -1 if the tracepoint is not available
+    long long processes;
+    long long disk_reads;// Read requests completed by the disk, -1 if it has no statistics
+    long long disk_merges;// Reads merged with adjacent ones before they reached the disk
+    long long disk_busy_ms;// Time the disk had requests in flight
+};
+
+// Random numbers(xorshift64*), the same seed always gives the same tree
+static unsigned long long rng_next(unsigned long long* state)
+{
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Scale a count or a size, at least 1
+static long long scaled(double scale, long long value)
+{
+    long long result = (long long)(value * scale);
+    return result < 1 ? 1 : result;
+}
+
+// Write a file of size random bytes relative to dir_fd, exit if an error occurs
+static void write_random_file(int dir_fd, const char* name, off_t size, unsigned long long* rng)
+{
+    static unsigned long long buffer[WRITE_BUFFER_SIZE / sizeof(unsigned long long)];
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) { // ERROR
+        perror(name);
+        exit(-1);
+    }
+    while(size > 0) {
+        size_t len = size < WRITE_BUFFER_SIZE ? size : WRITE_BUFFER_SIZE;
+        size_t i;
+        for(i = 0; i < (len + 7) / 8; i++) {
+            buffer[i] = rng_next(rng);
+        }
+        if(write(fd, buffer, len) != (ssize_t)len) { // ERROR
+            perror(name);
+            exit(-1);
+        }
+        size -= len;
+    }
+    close(fd);
+}
+
+// Create a directory relative to dir_fd and open it, exit if an error occurs
+static int make_dir(int dir_fd, const char* name)
+{
+    if(mkdirat(dir_fd, name, 0755) == -1 && errno != EEXIST) { // ERROR
+        perror(name);
+        exit(-1);
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+    if(fd == -1) { // ERROR
+        perror(name);
+        exit(-1);
+    }
+    return fd;
+}
+
+// One million tiny files(0 to 1 KiB) in directories of 1000 files
+static void make_tiny(int root_fd, double scale, unsigned long long* rng)
+{
+    long long files = scaled(scale, 1000000);
+    long long i;
+    int dir_fd = -1;
+    char name[32];
+    for(i = 0; i < files; i++) {
+        if(i % 1000 == 0) {
+            if(dir_fd != -1) {
+                close(dir_fd);
+            }
+            snprintf(name, sizeof(name), "d%lld", i / 1000);
+            dir_fd = make_dir(root_fd, name);
+        }
+        snprintf(name, sizeof(name), "f%lld", i % 1000);
+        write_random_file(dir_fd, name, rng_next(rng) % 1025, rng);
+    }
+    close(dir_fd);
+}
+
+// A few huge files of 1 GiB
+static void make_huge(int root_fd, double scale, unsigned long long* rng)
+{
+    int i;
+    char name[32];
+    for(i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "huge%d", i);
+        write_random_file(root_fd, name, scaled(scale, 1LL << 30), rng);
+    }
+}
+
+// A deep and narrow tree: 2000 levels with 2 files of 4 KiB each, deeper than PATH_MAX
+static void make_deep(int root_fd, double scale, unsigned long long* rng)
+{
+    long long levels = scaled(scale, 2000);
+    long long i;
+    int dir_fd = dup(root_fd);
+    for(i = 0; i < levels; i++) {
+        write_random_file(dir_fd, "a", 4096, rng);
+        write_random_file(dir_fd, "b", 4096, rng);
+        int next = make_dir(dir_fd, "level");
+        close(dir_fd);
+        dir_fd = next;
+    }
+    close(dir_fd);
+}
+
+// A wide and flat tree: 200000 files of 0 to 8 KiB in one directory
+static void make_wide(int root_fd, double scale, unsigned long long* rng)
+{
+    long long files = scaled(scale, 200000);
+    long long i;
+    char name[32];
+    for(i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%lld", i);
+        write_random_file(root_fd, name, rng_next(rng) % 8193, rng);
+    }
+}
+
+// Sparse files: 16 files of 1 GiB with a 64 KiB data extent every 16 MiB
+static void make_sparse(int root_fd, double scale, unsigned long long* rng)
+{
+    static unsigned long long extent[64 * 1024 / sizeof(unsigned long long)];
+    off_t size = scaled(scale, 1LL << 30);
+    int i;
+    char name[32];
+    for(i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "sparse%d", i);
+        int fd = openat(root_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1 || ftruncate(fd, size) == -1) { // ERROR
+            perror(name);
+            exit(-1);
+        }
+        off_t offset;
+        for(offset = 0; offset < size; offset += 16 << 20) {
+            size_t j;
+            for(j = 0; j < sizeof(extent) / sizeof(extent[0]); j++) {
+                extent[j] = rng_next(rng);
+            }
+            size_t len = size - offset < (off_t)sizeof(extent) ? (size_t)(size - offset) : sizeof(extent);
+            if(pwrite(fd, extent, len, offset) != (ssize_t)len) { // ERROR
+                perror(name);
+                exit(-1);
+            }
+        }
+        close(fd);
+    }
+}
+
+// A hard-link-heavy tree: 20000 files of 0 to 16 KiB with 8 names each, spread over 100 directories
+static void make_hardlink(int root_fd, double scale, unsigned long long* rng)
+{
+    long long files = scaled(scale, 20000);
+    int dir_fds[100];
+    char name[64];
+    char link_name[64];
+    int i;
+    for(i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        dir_fds[i] = make_dir(root_fd, name);
+    }
+    long long j;
+    for(j = 0; j < files; j++) {
+        int first = rng_next(rng) % 100;
+        snprintf(name, sizeof(name), "f%lld", j);
+        write_random_file(dir_fds[first], name, rng_next(rng) % 16385, rng);
+        for(i = 1; i < 8; i++) {
+            snprintf(link_name, sizeof(link_name), "f%lld_%d", j, i);
+            if(linkat(dir_fds[first], name, dir_fds[rng_next(rng) % 100], link_name, 0) == -1) { // ERROR
+                perror(link_name);
+                exit(-1);
+            }
+        }
+    }
+    for(i = 0; i < 100; i++) {
+        close(dir_fds[i]);
+    }
+}
+
+// A tree copied onto planted targets: 2000 files of 0 to 4 KiB in 10 directories, every 10th with a second name,
+// and one file above the chunk threshold of copydir_mp
+static void make_trap(int root_fd, double scale, unsigned long long* rng)
+{
+    long long files = scaled(scale, 2000);
+    int dir_fds[10];
+    char name[64];
+    char link_name[64];
+    int i;
+    for(i = 0; i < 10; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        dir_fds[i] = make_dir(root_fd, name);
+    }
+    long long j;
+    for(j = 0; j < files; j++) {
+        int dir = j % 10;
+        snprintf(name, sizeof(name), "f%lld", j);
+        write_random_file(dir_fds[dir], name, rng_next(rng) % 4097, rng);
+        if(j % 10 == 0) {
+            snprintf(link_name, sizeof(link_name), "f%lld_1", j);
+            if(linkat(dir_fds[dir], name, dir_fds[(dir + 1) % 10], link_name, 0) == -1) { // ERROR
+                perror(link_name);
+                exit(-1);
+            }
+        }
+    }
+    write_random_file(root_fd, "large", scaled(scale, 512LL << 20), rng);
+    for(i = 0; i < 10; i++) {
+        close(dir_fds[i]);
+    }
+}
+
+// Trees of the benchmark
+struct bench_tree {
+    const char* name;
+    void (*make)(int root_fd, double scale, unsigned long long* rng);
+    int trap;// Symbolic links to a victim file and FIFOs are planted in the target before every run
+};
+
+static const struct bench_tree trees[] = {
+    {"tiny", make_tiny, 0},
+    {"huge", make_huge, 0},
+    {"deep", make_deep, 0},
+    {"wide", make_wide, 0},
+    {"sparse", make_sparse, 0},
+    {"hardlink", make_hardlink, 0},
+    {"trap", make_trap, 1},
+};
+
+// Check whether a configuration copies onto an existing target: copydir_sp needs a new one unless it updates it
+static int copies_onto_target(const struct bench_config* config)
+{
+    return strcmp(config->tool, "copydir_mp") == 0 || config->resync;
+}
+
+#define VICTIM_CONTENT "victim\n"
+
+// Plant a symbolic link to victim(a FIFO for every 100th file) at the target name of every regular file of the
+// source directory, return 0 if succeed
+static int plant_at(int source_fd, int target_fd, const char* victim, long long* count)
+{
+    int fd = dup(source_fd);
+    DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+    if(!dir) {
+        perror("plant_at()");
+        return -1;
+    }
+    int ret = 0;
+    struct dirent* entry;
+    while(ret == 0 && (entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat stat_buf;
+        if(fstatat(source_fd, entry->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW) == -1) {
+            ret = -1;
+        }
+        else if(S_ISDIR(stat_buf.st_mode)) {
+            int sub_source = openat(source_fd, entry->d_name, O_RDONLY | O_DIRECTORY);
+            int sub_target = sub_source == -1 ? -1 : make_dir(target_fd, entry->d_name);
+            ret = sub_target == -1 ? -1 : plant_at(sub_source, sub_target, victim, count);
+            if(sub_source != -1) {
+                close(sub_source);
+            }
+            if(sub_target != -1) {
+                close(sub_target);
+            }
+        }
+        else if(S_ISREG(stat_buf.st_mode)) {
+            ret = (*count)++ % 100 == 0 ? mkfifoat(target_fd, entry->d_name, 0644)
+                : symlinkat(victim, target_fd, entry->d_name);
+        }
+        if(ret == -1) {
+            perror(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+// Write the victim file and plant the traps in a new target, return 0 if succeed
+static int plant_traps(const char* source, const char* target, const char* victim)
+{
+    int fd = open(victim, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || write(fd, VICTIM_CONTENT, strlen(VICTIM_CONTENT)) != (ssize_t)strlen(VICTIM_CONTENT)) {
+        perror(victim);
+        if(fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    if(mkdir(target, 0755) == -1) {
+        perror(target);
+        return -1;
+    }
+    int source_fd = open(source, O_RDONLY | O_DIRECTORY);
+    int target_fd = open(target, O_RDONLY | O_DIRECTORY);
+    long long count = 0;
+    int ret = source_fd == -1 || target_fd == -1 ? -1 : plant_at(source_fd, target_fd, victim, &count);
+    if(source_fd != -1) {
+        close(source_fd);
+    }
+    if(target_fd != -1) {
+        close(target_fd);
+    }
+    return ret;
+}
+
+// Check that the victim is untouched and every regular file of the source has a regular target of the same size,
+// return the number of targets left planted or written through, or -1 if the victim was overwritten
+static long long check_at(int source_fd, int target_fd)
+{
+    int fd = dup(source_fd);
+    DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+    if(!dir) {
+        perror("check_at()");
+        return 1;
+    }
+    long long bad = 0;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat source_stat;
+        struct stat target_stat;
+        if(fstatat(source_fd, entry->d_name, &source_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            bad++;
+        }
+        else if(S_ISDIR(source_stat.st_mode)) {
+            int sub_source = openat(source_fd, entry->d_name, O_RDONLY | O_DIRECTORY);
+            int sub_target = openat(target_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            bad += sub_source == -1 || sub_target == -1 ? 1 : check_at(sub_source, sub_target);
+            if(sub_source != -1) {
+                close(sub_source);
+            }
+            if(sub_target != -1) {
+                close(sub_target);
+            }
+        }
+        else if(S_ISREG(source_stat.st_mode)
+            && (fstatat(target_fd, entry->d_name, &target_stat, AT_SYMLINK_NOFOLLOW) == -1
+            || !S_ISREG(target_stat.st_mode) || target_stat.st_size != source_stat.st_size)) {
+            bad++;
+        }
+    }
+    closedir(dir);
+    return bad;
+}
+
+// Check a copy of the trap tree, return 0 if every trap was replaced and the victim is untouched
+static int check_traps(const char* source, const char* target, const char* victim)
+{
+    char content[64];
+    int fd = open(victim, O_RDONLY);
+    ssize_t len = fd == -1 ? -1 : read(fd, content, sizeof(content));
+    if(fd != -1) {
+        close(fd);
+    }
+    int source_fd = open(source, O_RDONLY | O_DIRECTORY);
+    int target_fd = open(target, O_RDONLY | O_DIRECTORY);
+    long long bad = source_fd == -1 || target_fd == -1 ? 1 : check_at(source_fd, target_fd);
+    if(source_fd != -1) {
+        close(source_fd);
+    }
+    if(target_fd != -1) {
+        close(target_fd);
+    }
+    int overwritten = len != (ssize_t)strlen(VICTIM_CONTENT) || memcmp(content, VICTIM_CONTENT, len) != 0;
+    if(overwritten || bad) {
+        printf("Trap check failed: the victim file is %s, %lld targets are not regular copies\n",
+            overwritten ? "overwritten" : "untouched", bad);
+        return -1;
+    }
+    return 0;
+}
+
+// Remove an entry relative to dir_fd and everything below it, deep trees are removed relative to their parents
+static void remove_at(int dir_fd, const char* name)
+{
+    if(unlinkat(dir_fd, name, 0) == 0 || (errno != EISDIR && errno != EPERM)) {
+        return;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+    if(!dir) {
+        perror(name);
+        return;
+    }
+    struct dirent* entry;
+    do { // Entries may be skipped by readdir() while the directory shrinks, read it again until it is empty
+        rewinddir(dir);
+        while((entry = readdir(dir)) != NULL) {
+            if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                remove_at(fd, entry->d_name);
+            }
+        }
+    } while(unlinkat(dir_fd, name, AT_REMOVEDIR) == -1 && errno == ENOTEMPTY);
+    closedir(dir);
+}
+
+// Remove a tree if it exists
+static void remove_tree(const char* path)
+{
+    remove_at(AT_FDCWD, path);
+}
+
+// Generate a tree unless it has been generated by an earlier run with the same scale, return 0 if succeed
+static int prepare_tree(const struct bench_options* opts, int index, const char* source)
+{
+    char marker[PATH_MAX + 32];
+    snprintf(marker, sizeof(marker), "%s.%g.done", source, opts->scale);
+    if(access(marker, F_OK) == 0) { // Generated before, the fixed seed gives the same tree again
+        return 0;
+    }
+    remove_tree(source);
+    if(mkdir(source, 0755) == -1) {
+        perror(source);
+        return -1;
+    }
+    int root_fd = open(source, O_RDONLY | O_DIRECTORY);
+    if(root_fd == -1) {
+        perror(source);
+        return -1;
+    }
+    printf("Generating %s...\n", source);
+    fflush(stdout);
+    unsigned long long rng = BENCH_SEED + index;
+    trees[index].make(root_fd, opts->scale, &rng);
+    close(root_fd);
+    int fd = open(marker, O_WRONLY | O_CREAT, 0644);
+    if(fd != -1) {
+        close(fd);
+    }
+    return 0;
+}
+
+// Drop the page cache, dentries and inodes, return 0 if succeed(needs root)
+static int drop_caches(void)
+{
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if(fd == -1) {
+        return -1;
+    }
+    int ret = write(fd, "3", 1) == 1 ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+// Return the id of a tracepoint(e.g. raw_syscalls/sys_enter), or -1 if tracefs is not readable
+static long long tracepoint_id(const char* event)
+{
+    static const char* roots[] = {"/sys/kernel/tracing/events", "/sys/kernel/debug/tracing/events"};
+    char path[256];
+    int i;
+    for(i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s/id", roots[i], event);
+        FILE* file = fopen(path, "r");
+        if(file) {
+            long long id = -1;
+            if(fscanf(file, "%lld", &id) != 1) {
+                id = -1;
+            }
+            fclose(file);
+            return id;
+        }
+    }
+    return -1;
+}
+
+// Count a tracepoint in a process and its descendants from its next exec, return the counter or -1
+static int open_counter(long long id, pid_t pid)
+{
+    if(id < 0) {
+        return -1;
+    }
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = id;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;// Do not count the benchmark itself
+    attr.inherit = 1;// Count the workers of copydir_mp
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+// Read and close a counter, return -1 if there is no counter
+static long long read_counter(int fd)
+{
+    long long count = -1;
+    if(fd != -1) {
+        if(read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = -1;
+        }
+        close(fd);
+    }
+    return count;
+}
+
+// Read the read requests, merged reads and busy milliseconds of a block device, return -1 if they are not available
+static int read_disk_stats(dev_t dev, long long stats[3])
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/stat", major(dev), minor(dev));
+    FILE* file = fopen(path, "r");
+    if(!file) {
+        return -1;
+    }
+    // read I/Os, read merges, read sectors, read ticks, write I/Os, write merges, write sectors, write ticks,
+    // in flight, io ticks
+    long long fields[10];
+    int count = fscanf(file, "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld", &fields[0], &fields[1],
+        &fields[2], &fields[3], &fields[4], &fields[5], &fields[6], &fields[7], &fields[8], &fields[9]);
+    fclose(file);
+    if(count != 10) {
+        return -1;
+    }
+    stats[0] = fields[0];
+    stats[1] = fields[1];
+    stats[2] = fields[9];
+    return 0;
+}
+
+// Run a copy tool and measure it, return 0 if it could be started
+static int run_tool(const struct bench_options* opts, const struct bench_config* config, const char* source,
+    const char* target, struct bench_result* result)
+{
+    char tool[PATH_MAX];
+    snprintf(tool, sizeof(tool), "%s/%s", opts->tool_dir, config->tool);
+    const char* argv[8];
+    int argc = 0;
+    argv[argc++] = tool;
+    int i;
+    for(i = 0; config->args[i]; i++) {
+        argv[argc++] = config->args[i];
+    }
+    argv[argc++] = source;
+    argv[argc++] = target;
+    argv[argc] = NULL;
+    int go[2];// The child waits until its counters are attached
+    if(pipe(go) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) { // Tool process, reports go to /dev/null, errors stay visible
+        char byte;
+        close(go[1]);
+        if(read(go[0], &byte, 1) != 1) {
+            _exit(127);
+        }
+        int null_fd = open("/dev/null", O_WRONLY);
+        if(null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        execv(tool, (char* const*)argv);
+        perror(tool);
+        _exit(127);
+    }
+    else if(pid < 0) { // ERROR
+        perror("fork");
+        return -1;
+    }
+    close(go[0]);
+    int syscall_fd = open_counter(tracepoint_id("raw_syscalls/sys_enter"), pid);
+    int fork_fd = open_counter(tracepoint_id("sched/sched_process_fork"), pid);
+    struct stat source_stat;
+    long long disk_before[3], disk_after[3];
+    int have_disk = stat(source, &source_stat) == 0 && read_disk_stats(source_stat.st_dev, disk_before) == 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(write(go[1], "g", 1) != 1) {
+        perror("write");
+    }
+    close(go[1]);
+    int status;
+    while(wait4(pid, &status, 0, &result->usage) == -1 && errno == EINTR) {
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result->syscalls = read_counter(syscall_fd);
+    long long forks = read_counter(fork_fd);
+    result->processes = forks == -1 ? -1 : forks + 1;
+    if(have_disk && read_disk_stats(source_stat.st_dev, disk_after) == 0) {
+        result->disk_reads = disk_after[0] - disk_before[0];
+        result->disk_merges = disk_after[1] - disk_before[1];
+        result->disk_busy_ms = disk_after[2] - disk_before[2];
+    }
+    else {
+        result->disk_reads = result->disk_merges = result->disk_busy_ms = -1;
+    }
+    return 0;
+}
+
+// Write a small file relative to dir_fd, return 0 if succeed
+static int write_text(int dir_fd, const char* name, const char* text)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+        perror(name);
+        if(fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Resume a copy twice over a journal whose last line is torn, return 0 if the torn line is never taken for a
+// completed file
+// The journal ends in a "z/log.1" line cut from a "z/log.10" one, both sources have the same size and
+// modification time and the target z/log.1 is stale; the first resume fails at "fail"(a non-empty directory in
+// the target, copied before z), the second one must copy z/log.1 again
+static int check_torn_journal(const struct bench_options* opts, const char* tool)
+{
+    char source[PATH_MAX];
+    char target[PATH_MAX];
+    char journal[PATH_MAX];
+    char journal_arg[PATH_MAX + 16];
+    snprintf(source, sizeof(source), "%s/journal", opts->work_dir);
+    snprintf(target, sizeof(target), "%s/journal.copy", opts->work_dir);
+    snprintf(journal, sizeof(journal), "%s/journal.log", opts->work_dir);
+    snprintf(journal_arg, sizeof(journal_arg), "--journal=%s", journal);
+    remove_tree(source);
+    remove_tree(target);
+    int source_fd = mkdir(source, 0755) == 0 ? open(source, O_RDONLY | O_DIRECTORY) : -1;
+    int target_fd = mkdir(target, 0755) == 0 ? open(target, O_RDONLY | O_DIRECTORY) : -1;
+    if(source_fd == -1 || target_fd == -1) {
+        perror("check_torn_journal()");
+        return -1;
+    }
+    int source_z = make_dir(source_fd, "z");
+    int target_z = make_dir(target_fd, "z");
+    int fail_fd = make_dir(target_fd, "fail");
+    struct timespec times[2] = {{1700000000, 123456789}, {1700000000, 123456789}};
+    char line[128];
+    snprintf(line, sizeof(line), "- 5 %lld.%09ld z/log.1", (long long)times[1].tv_sec, times[1].tv_nsec);
+    int ret = write_text(source_fd, "fail", "fail\n") == -1 || write_text(fail_fd, "keep", "keep\n") == -1
+        || write_text(source_z, "log.1", "FRESH") == -1 || write_text(source_z, "log.10", "OTHER") == -1
+        || write_text(target_z, "log.1", "STALE") == -1 || write_text(AT_FDCWD, journal, line) == -1
+        || utimensat(source_z, "log.1", times, 0) == -1 || utimensat(source_z, "log.10", times, 0) == -1 ? -1 : 0;
+    close(fail_fd);
+    close(source_z);
+    close(source_fd);
+    struct bench_config config = {"journal", tool, {journal_arg, NULL}, 0};
+    struct bench_result result;
+    if(ret == 0 && run_tool(opts, &config, source, target, &result) == 0 && result.status == 0) {
+        printf("Journal check: the first resume of %s did not fail\n", tool);
+        ret = -1;
+    }
+    remove_at(target_fd, "fail");
+    if(ret == 0 && (run_tool(opts, &config, source, target, &result) == -1 || result.status != 0)) {
+        printf("Journal check: the second resume of %s failed\n", tool);
+        ret = -1;
+    }
+    char content[8] = "";
+    int fd = openat(target_z, "log.1", O_RDONLY);
+    if(fd == -1 || read(fd, content, sizeof(content) - 1) == -1) {
+        perror("log.1");
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+    close(target_z);
+    close(target_fd);
+    if(ret == 0 && strcmp(content, "FRESH") != 0) {
+        printf("Journal check: %s resumed z/log.1 from a torn journal line, the target holds \"%s\"\n", tool,
+            content);
+        ret = -1;
+    }
+    remove_tree(source);
+    remove_tree(target);
+    unlink(journal);
+    return ret;
+}
+
+// Append a result to the CSV file
+static void write_result(FILE* csv, const struct bench_options* opts, const char* tree, const char* config,
+    const char* cache, int run, const struct bench_result* result)
+{
+    fprintf(csv, "%s,%s,%g,%s,%s,%d,%d,%.6f,%.6f,%.6f,%lld,%lld,%ld,%ld,%ld,%ld,%ld,%lld,%lld,%lld\n", opts->label, tree,
+        opts->scale, config, cache, run, result->status, result->wall,
+        result->usage.ru_utime.tv_sec + result->usage.ru_utime.tv_usec / 1e6,
+        result->usage.ru_stime.tv_sec + result->usage.ru_stime.tv_usec / 1e6,
+        result->syscalls, result->processes, result->usage.ru_maxrss, result->usage.ru_nvcsw,
+        result->usage.ru_nivcsw, result->usage.ru_inblock, result->usage.ru_oublock, result->disk_reads,
+        result->disk_merges, result->disk_busy_ms);
+    fflush(csv);
+    printf("%-9s %-11s %-5s run %d: %8.3f s, exit %d, %lld syscalls, %lld processes, %ld KiB max RSS\n", tree,
+        config, cache, run, result->wall, result->status, result->syscalls, result->processes, result->usage.ru_maxrss);
+}
+
+// Check whether a tree is selected by -t
+static int tree_selected(const char* list, const char* name)
+{
+    if(!list) {
+        return 1;
+    }
+    size_t len = strlen(name);
+    const char* pos = list;
+    while((pos = strstr(pos, name)) != NULL) {
+        if((pos == list || pos[-1] == ',') && (pos[len] == ',' || pos[len] == '\0')) {
+            return 1;
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    struct bench_options opts = {1.0, 3, "/tmp/bench_copydir", ".", "bench_copydir.csv", "unlabeled", NULL};
+    int opt;
+    while((opt = getopt(argc, argv, "s:r:d:b:o:l:t:")) != -1) {
+        switch(opt) {
+            case 's':
+                opts.scale = atof(optarg);
+                break;
+            case 'r':
+                opts.repeats = atoi(optarg);
+                break;
+            case 'd':
+                opts.work_dir = optarg;
+                break;
+            case 'b':
+                opts.tool_dir = optarg;
+                break;
+            case 'o':
+                opts.csv_path = optarg;
+                break;
+            case 'l':
+                opts.label = optarg;
+                break;
+            case 't':
+                opts.trees = optarg;
+                break;
+            default:
+                printf("Use bench_copydir by: ./bench_copydir [-s scale] [-r repeats] [-d work directory] [-b tool directory] [-o results.csv] [-l label] [-t trees]\n");
+                return -1;// ERROR
+        }
+    }
+    if(optind != argc || opts.scale <= 0 || opts.repeats < 1) {
+        printf("Use bench_copydir by: ./bench_copydir [-s scale] [-r repeats] [-d work directory] [-b tool directory] [-o results.csv] [-l label] [-t trees]\n");
+        return -1;// ERROR
+    }
+    if(mkdir(opts.work_dir, 0755) == -1 && errno != EEXIST) { // ERROR
+        perror(opts.work_dir);
+        return -1;
+    }
+    int new_csv = access(opts.csv_path, F_OK) != 0;
+    FILE* csv = fopen(opts.csv_path, "a");
+    if(!csv) { // ERROR
+        perror(opts.csv_path);
+        return -1;
+    }
+    if(new_csv) {
+        fprintf(csv, "label,tree,scale,config,cache,run,exit_status,wall_seconds,user_seconds,system_seconds,"
+            "syscalls,processes,max_rss_kib,voluntary_switches,involuntary_switches,in_blocks,out_blocks,"
+            "disk_reads,disk_merges,disk_busy_ms\n");
+    }
+    int cold = drop_caches() == 0;
+    if(!cold) {
+        printf("The page cache can not be dropped(needs root), only warm runs are measured\n");
+    }
+    if(tracepoint_id("raw_syscalls/sys_enter") < 0) {
+        printf("Tracepoints are not readable, syscalls and processes are reported as -1\n");
+    }
+    int i, j, run, cache;
+    char source[PATH_MAX];
+    char target[PATH_MAX];
+    char victim[PATH_MAX];
+    int failed = 0;// A trap check failed
+    if(tree_selected(opts.trees, "journal")) {
+        if(check_torn_journal(&opts, "copydir_sp") == -1 || check_torn_journal(&opts, "copydir_mp") == -1) {
+            failed = 1;
+        }
+    }
+    for(i = 0; i < (int)(sizeof(trees) / sizeof(trees[0])); i++) {
+        if(!tree_selected(opts.trees, trees[i].name)) {
+            continue;
+        }
+        snprintf(source, sizeof(source), "%s/%s", opts.work_dir, trees[i].name);
+        snprintf(target, sizeof(target), "%s/%s.copy", opts.work_dir, trees[i].name);
+        snprintf(victim, sizeof(victim), "%s/%s.victim", opts.work_dir, trees[i].name);
+        if(prepare_tree(&opts, i, source) == -1) {
+            fclose(csv);
+            return -1;
+        }
+        for(j = 0; j < (int)(sizeof(configs) / sizeof(configs[0])); j++) {
+            int trap = trees[i].trap && copies_onto_target(&configs[j]);
+            for(cache = cold ? 0 : 1; cache < 2; cache++) { // 0: cold, 1: warm
+                for(run = 0; run < opts.repeats; run++) {
+                    struct bench_result result;
+                    remove_tree(target);
+                    if(trap && plant_traps(source, target, victim) == -1) {
+                        fclose(csv);
+                        return -1;
+                    }
+                    if(configs[j].resync || cache == 1) { // An unmeasured copy makes the target or the cache ready
+                        struct bench_result warmup;
+                        run_tool(&opts, &configs[j], source, target, &warmup);
+                        if(!configs[j].resync) {
+                            remove_tree(target);
+                            if(trap && plant_traps(source, target, victim) == -1) {
+                                fclose(csv);
+                                return -1;
+                            }
+                        }
+                    }
+                    if(cache == 0 && drop_caches() == -1) {
+                        perror("drop_caches");
+                    }
+                    if(run_tool(&opts, &configs[j], source, target, &result) == 0) {
+                        write_result(csv, &opts, trees[i].name, configs[j].name, cache ? "warm" : "cold", run, &result);
+                    }
+                    if(trap && check_traps(source, target, victim) == -1) {
+                        failed = 1;
+                    }
+                }
+            }
+        }
+        remove_tree(target);
+        if(trees[i].trap) {
+            unlink(victim);
+        }
+    }
+    fclose(csv);
+    return failed ? -1 : 0;
+}
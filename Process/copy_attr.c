@@ -0,0 +1,211 @@
+// Metadata preservation: owner, extended attributes(ACLs included), mode and timestamps of the sources
+// are applied to the open targets while they are copied, so no second pass over the tree is needed
+// POSIX ACLs are the system.posix_acl_* extended attributes, so they are copied with the others
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "copy_attr.h"
+
+// Grow a buffer of this process to at least size bytes, return NULL if there is no memory
+static char* grow_buffer(char** buffer, size_t* capacity, size_t size)
+{
+    if(size > *capacity) {
+        char* grown = realloc(*buffer, size);
+        if(!grown) {
+            return NULL;
+        }
+        *buffer = grown;
+        *capacity = size;
+    }
+    return *buffer;
+}
+
+// Check whether an extended attribute can not be kept for a reason the copy should not fail for:
+// the target filesystem has no extended attributes, or the namespace(trusted, security) needs privileges
+static int xattr_skippable(int err)
+{
+    return err == ENOTSUP || err == EOPNOTSUPP || err == EPERM || err == EACCES;
+}
+
+// A file whose extended attributes are read or written: an open file, or a path which is not followed
+// (a symbolic link can not be opened)
+struct xattr_file {
+    int fd;// -1 if path is used
+    const char* path;
+};
+
+static ssize_t xattr_list(const struct xattr_file* file, char* list, size_t size)
+{
+    return file->fd != -1 ? flistxattr(file->fd, list, size) : llistxattr(file->path, list, size);
+}
+
+static ssize_t xattr_get(const struct xattr_file* file, const char* name, void* value, size_t size)
+{
+    return file->fd != -1 ? fgetxattr(file->fd, name, value, size) : lgetxattr(file->path, name, value, size);
+}
+
+static int xattr_set(const struct xattr_file* file, const char* name, const void* value, size_t size)
+{
+    return file->fd != -1 ? fsetxattr(file->fd, name, value, size, 0) : lsetxattr(file->path, name, value, size, 0);
+}
+
+// Copy the extended attributes of source to target
+static int copy_xattrs(const struct xattr_file* source, const struct xattr_file* target)
+{
+    static char* names = NULL;// Buffers are kept for the next file, most files have no or few attributes
+    static size_t names_capacity = 0;
+    static char* value = NULL;
+    static size_t value_capacity = 0;
+    ssize_t len;
+    // A size of 0 would only query the size, so both buffers exist before the first call
+    if(!grow_buffer(&names, &names_capacity, 1024) || !grow_buffer(&value, &value_capacity, 1024)) {
+        return -1;
+    }
+    while((len = xattr_list(source, names, names_capacity)) == -1 && errno == ERANGE) {
+        ssize_t need = xattr_list(source, NULL, 0);
+        if(need == -1 || !grow_buffer(&names, &names_capacity, need + 1)) {
+            return -1;
+        }
+    }
+    if(len == -1) {
+        return errno == ENOTSUP || errno == EOPNOTSUPP ? 0 : -1;
+    }
+    char* name;
+    for(name = names; name < names + len; name += strlen(name) + 1) {
+        ssize_t size;
+        while((size = xattr_get(source, name, value, value_capacity)) == -1 && errno == ERANGE) {
+            ssize_t need = xattr_get(source, name, NULL, 0);
+            if(need == -1 || !grow_buffer(&value, &value_capacity, need + 1)) {
+                return -1;
+            }
+        }
+        if(size == -1 && (errno == ENODATA || xattr_skippable(errno))) { // Removed meanwhile or not readable
+            continue;
+        }
+        if(size == -1) {
+            return -1;
+        }
+        if(xattr_set(target, name, value, size) == -1) {
+            if(errno == ENOTSUP || errno == EOPNOTSUPP) { // The target filesystem has no extended attributes
+                return 0;
+            }
+            if(!xattr_skippable(errno)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Apply the owner and the extended attributes of a source to an open target
+int preserve_owner(int source_fd, int target_fd, const struct stat* source_stat)
+{
+    int kept = 1;
+    if(fchown(target_fd, source_stat->st_uid, source_stat->st_gid) == -1) {
+        if(errno != EPERM) {
+            return -1;
+        }
+        kept = 0;// Like cp -p: only root can give files away
+    }
+    struct xattr_file source = {source_fd, NULL};
+    struct xattr_file target = {target_fd, NULL};
+    return copy_xattrs(&source, &target) == -1 ? -1 : kept;
+}
+
+// Return the mode to apply to a target
+mode_t preserved_mode(const struct stat* source_stat, int owner_kept)
+{
+    mode_t mode = source_stat->st_mode & 07777;
+    // A set-ID bit of a file owned by the copying user would grant that user's rights instead
+    return owner_kept ? mode : mode & ~(S_ISUID | S_ISGID);
+}
+
+// Apply the access and modification times of a source to an open target
+int preserve_times(int target_fd, const struct stat* source_stat)
+{
+    struct timespec times[2];
+    times[0] = source_stat->st_atim;
+    times[1] = source_stat->st_mtim;
+    return futimens(target_fd, times);
+}
+
+// Apply the owner, the extended attributes, the mode and the timestamps of a source to an open target
+int preserve_fd(int source_fd, int target_fd, const struct stat* source_stat)
+{
+    // The owner comes first, fchown() clears set-ID bits, and the times come last, every other change updates them
+    int kept = preserve_owner(source_fd, target_fd, source_stat);
+    if(kept == -1 || fchmod(target_fd, preserved_mode(source_stat, kept)) == -1) {
+        return -1;
+    }
+    return preserve_times(target_fd, source_stat);
+}
+
+// Name a file relative to a directory file descriptor by a path, for the calls which have no *at() form
+static int fd_path(char* path, size_t size, int dir_fd, const char* name)
+{
+    int len = dir_fd == AT_FDCWD ? snprintf(path, size, "%s", name)
+        : snprintf(path, size, "/proc/self/fd/%d/%s", dir_fd, name);
+    if(len >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Apply the owner, the extended attributes and the timestamps of a symbolic link to its copy
+int preserve_symlink(int source_dir_fd, const char* source_name, int target_dir_fd, const char* target_name)
+{
+    struct stat stat_buf;
+    if(fstatat(source_dir_fd, source_name, &stat_buf, AT_SYMLINK_NOFOLLOW) == -1) {
+        return -1;
+    }
+    if(fchownat(target_dir_fd, target_name, stat_buf.st_uid, stat_buf.st_gid, AT_SYMLINK_NOFOLLOW) == -1
+        && errno != EPERM) {
+        return -1;
+    }
+    // The directory is reached through its descriptor in /proc, the link itself is not followed by l*xattr()
+    char source_path[PATH_MAX];
+    char target_path[PATH_MAX];
+    if(fd_path(source_path, sizeof(source_path), source_dir_fd, source_name) == -1
+        || fd_path(target_path, sizeof(target_path), target_dir_fd, target_name) == -1) {
+        return -1;
+    }
+    struct xattr_file source = {-1, source_path};
+    struct xattr_file target = {-1, target_path};
+    if(copy_xattrs(&source, &target) == -1) {
+        return -1;
+    }
+    struct timespec times[2];
+    times[0] = stat_buf.st_atim;
+    times[1] = stat_buf.st_mtim;
+    return utimensat(target_dir_fd, target_name, times, AT_SYMLINK_NOFOLLOW);
+}
+
+// Bring the owner and the mode of an up to date target in line with its source
+int preserve_unchanged(int target_dir_fd, const char* target_name, const struct stat* source_stat,
+    const struct stat* target_stat)
+{
+    int kept = target_stat->st_uid == source_stat->st_uid && target_stat->st_gid == source_stat->st_gid;
+    int chowned = 0;
+    if(!kept) {
+        if(fchownat(target_dir_fd, target_name, source_stat->st_uid, source_stat->st_gid, AT_SYMLINK_NOFOLLOW) == 0) {
+            kept = chowned = 1;
+        }
+        else if(errno != EPERM) {
+            return -1;
+        }
+    }
+    mode_t mode = preserved_mode(source_stat, kept);
+    if(chowned || (target_stat->st_mode & 07777) != mode) { // fchownat() has cleared the set-ID bits
+        return fchmodat(target_dir_fd, target_name, mode, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+// Metadata preservation: owner, extended attributes(ACLs included), mode and timestamps of the sources
+// are applied to the open targets while they are copied, so no second pass over the tree is needed
+// Author: Noah Lin
+#ifndef COPY_ATTR_H
+#define COPY_ATTR_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Apply the owner and the extended attributes of a source to an open target
+// Return 1 if the owner has been kept, 0 if changing the owner is not permitted(not running as root),
+// -1 if an error occurs(errno is set)
+int preserve_owner(int source_fd, int target_fd, const struct stat* source_stat);
+
+// Return the mode to apply to a target, set-user-ID and set-group-ID are dropped if the owner was not kept
+mode_t preserved_mode(const struct stat* source_stat, int owner_kept);
+
+// Apply the access and modification times of a source to an open target
+// Return 0 if succeed, otherwise return -1(errno is set)
+int preserve_times(int target_fd, const struct stat* source_stat);
+
+// Apply the owner, the extended attributes, the mode and the timestamps(last, after every write) of a source
+// to an open target
+// Return 0 if succeed, otherwise return -1(errno is set)
+int preserve_fd(int source_fd, int target_fd, const struct stat* source_stat);
+
+// Apply the owner, the extended attributes and the timestamps of a symbolic link to its copy
+// (a link has no mode of its own)
+// Return 0 if succeed, otherwise return -1(errno is set)
+int preserve_symlink(int source_dir_fd, const char* source_name, int target_dir_fd, const char* target_name);
+
+// Bring the owner and the mode of an up to date target in line with its source, the data is not touched
+// Return 0 if succeed, otherwise return -1(errno is set)
+int preserve_unchanged(int target_dir_fd, const char* target_name, const struct stat* source_stat,
+    const struct stat* target_stat);
+
+#endif
@@ -0,0 +1,576 @@
+// Copy engine shared by copydir_sp and copydir_mp
+// Data is moved inside the kernel whenever possible: copy_file_range() first, then sendfile() and splice(),
+// and only if none of them works the data is moved through a user space buffer by read()/write()
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>// FICLONE, FICLONERANGE
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+#include "copy_engine.h"
+#include "copy_sync.h"
+#include "copy_stats.h"
+#include "copy_verify.h"
+#include "copy_attr.h"
+#include "copy_journal.h"
+#include "copy_qos.h"
+
+#define KERNEL_COPY_CHUNK (1L << 30)// Maximum bytes moved by one kernel copy call
+
+struct copy_options copy_opts = {0};
+
+static int reflink_unsupported = 0;// Set once a clone failed because the filesystem does not support it
+
+// Return the name of a data path
+const char* copy_path_name(int path)
+{
+    switch(path) {
+        case COPY_PATH_NONE: return "none";
+        case COPY_PATH_REFLINK: return "reflink";
+        case COPY_PATH_COPY_FILE_RANGE: return "copy_file_range";
+        case COPY_PATH_SENDFILE: return "sendfile";
+        case COPY_PATH_SPLICE: return "splice";
+        case COPY_PATH_BUFFERED: return "buffered";
+        default: return "unknown";
+    }
+}
+
+// Check whether errno means a kernel copy call can not be used for this pair of files
+static int is_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP
+        || err == ENOTSUP || err == EBADF || err == ESPIPE;
+}
+
+// Parse a reflink mode(auto, always or never), return -1 if the mode is invalid
+int parse_reflink(const char* str)
+{
+    if(strcmp(str, "auto") == 0) {
+        return REFLINK_AUTO;
+    }
+    else if(strcmp(str, "always") == 0) {
+        return REFLINK_ALWAYS;
+    }
+    else if(strcmp(str, "never") == 0) {
+        return REFLINK_NEVER;
+    }
+    return -1;
+}
+
+// Return 1 if cloning should be tried for the next file
+int reflink_usable(void)
+{
+    if(copy_opts.reflink == REFLINK_NEVER) {
+        return 0;
+    }
+    // In the always mode every file is tried, so each one that can not be cloned is reported
+    return copy_opts.reflink == REFLINK_ALWAYS || !reflink_unsupported;
+}
+
+// Clone length bytes at offset of source_fd to the same offset of target_fd(the whole file if length is 0)
+int clone_range(int source_fd, int target_fd, off_t offset, off_t length)
+{
+    int ret;
+    if(offset == 0 && length == 0) {
+        ret = ioctl(target_fd, FICLONE, source_fd);
+    }
+    else {
+        struct file_clone_range range;
+        range.src_fd = source_fd;
+        range.src_offset = offset;
+        range.src_length = length;
+        range.dest_offset = offset;
+        ret = ioctl(target_fd, FICLONERANGE, &range);
+    }
+    if(ret == 0) {
+        return 1;
+    }
+    // The filesystem(or the pair of filesystems) can not share blocks, do not try again in the auto mode
+    if(errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == ENOSYS) {
+        reflink_unsupported = 1;
+    }
+    if(copy_opts.reflink == REFLINK_ALWAYS) {
+        return -1;
+    }
+    // EINVAL means this range can not be cloned(e.g. it is not aligned to blocks), copy it instead
+    return is_unsupported(errno) || errno == ENOTTY || errno == ETXTBSY ? 0 : -1;
+}
+
+// The helpers below return 1 if the end of the source file is reached, 0 if the data path can not be used
+// (the next one should be tried from the current offsets), -1 if an error occurs
+// *copied is set to the number of bytes moved by the helper
+
+// Copy by copy_file_range()
+static int try_copy_file_range(int source_fd, int target_fd, off_t size_hint, off_t* copied)
+{
+    *copied = 0;
+    while(1) {
+        ssize_t n = copy_file_range(source_fd, NULL, target_fd, NULL, qos_chunk(KERNEL_COPY_CHUNK), 0);
+        if(n > 0) {
+            *copied += n;
+            qos_charge(n, 1);
+            continue;
+        }
+        if(n == 0) {
+            // Some pseudo filesystems report 0 although they have data, let the next path check it
+            if(*copied == 0 && size_hint > 0) {
+                return 0;
+            }
+            return 1;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        return is_unsupported(errno) ? 0 : -1;
+    }
+}
+
+// Copy by sendfile()
+static int try_sendfile(int source_fd, int target_fd, off_t size_hint, off_t* copied)
+{
+    *copied = 0;
+    while(1) {
+        ssize_t n = sendfile(target_fd, source_fd, NULL, qos_chunk(KERNEL_COPY_CHUNK));
+        if(n > 0) {
+            *copied += n;
+            qos_charge(n, 1);
+            continue;
+        }
+        if(n == 0) {
+            if(*copied == 0 && size_hint > 0) {
+                return 0;
+            }
+            return 1;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        return is_unsupported(errno) ? 0 : -1;
+    }
+}
+
+// Copy by splice() through a pipe
+static int try_splice(int source_fd, int target_fd, off_t* copied)
+{
+    *copied = 0;
+    int pipe_fd[2];
+    if(pipe2(pipe_fd, O_CLOEXEC) == -1) {
+        return 0;
+    }
+    int ret = 1;
+    while(1) {
+        ssize_t in = splice(source_fd, NULL, pipe_fd[1], NULL, qos_chunk(KERNEL_COPY_CHUNK), SPLICE_F_MOVE);
+        if(in == 0) { // End of the source file
+            break;
+        }
+        if(in == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            ret = is_unsupported(errno) ? 0 : -1;
+            break;
+        }
+        // Drain the pipe into the target file
+        ssize_t moved = in;
+        while(in > 0) {
+            ssize_t out = splice(pipe_fd[0], NULL, target_fd, NULL, in, SPLICE_F_MOVE);
+            if(out == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                // Data is already taken from the source file, so the copy can not fall back any more
+                ret = -1;
+                break;
+            }
+            in -= out;
+            *copied += out;
+        }
+        if(ret == -1) {
+            break;
+        }
+        qos_charge(moved, 1);
+    }
+    int saved_errno = errno;
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    errno = saved_errno;
+    return ret;
+}
+
+// Copy by read()/write() through a user space buffer
+static int copy_buffered(int source_fd, int target_fd, off_t* copied)
+{
+    static char* buffer = NULL;// Buffer of copying, allocated once per process
+    *copied = 0;
+    if(!buffer && !(buffer = malloc(COPY_BUFFER_SIZE))) {
+        return -1;
+    }
+    ssize_t read_bytes;
+    // Keep reading and copying the source file until reaching the end
+    while((read_bytes = read(source_fd, buffer, COPY_BUFFER_SIZE)) != 0) { // read_bytes is the number of bytes actually read
+        if(read_bytes == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ssize_t done = 0;
+        while(done < read_bytes) { // Tackle with short writes
+            ssize_t write_bytes = write(target_fd, buffer + done, read_bytes - done);
+            if(write_bytes == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += write_bytes;
+        }
+        *copied += read_bytes;
+        qos_charge(read_bytes, 1);
+    }
+    return 1;
+}
+
+// Copy all data from the current offset of source_fd to the current offset of target_fd
+// Return the data path which finished the copy, or -1 if an error occurs(errno is set)
+int copy_fd(int source_fd, int target_fd, off_t size_hint)
+{
+    off_t copied;
+    off_t total = 0;
+    int ret;
+    // Every data path uses the file offsets, so the next one continues where the previous one stopped
+    if((ret = try_copy_file_range(source_fd, target_fd, size_hint, &copied)) != 0) {
+        total += copied;
+        return ret == 1 ? (total ? COPY_PATH_COPY_FILE_RANGE : COPY_PATH_NONE) : -1;
+    }
+    total += copied;
+    if((ret = try_sendfile(source_fd, target_fd, size_hint - total, &copied)) != 0) {
+        total += copied;
+        return ret == 1 ? (total ? COPY_PATH_SENDFILE : COPY_PATH_NONE) : -1;
+    }
+    total += copied;
+    if((ret = try_splice(source_fd, target_fd, &copied)) != 0) {
+        total += copied;
+        return ret == 1 ? (total ? COPY_PATH_SPLICE : COPY_PATH_NONE) : -1;
+    }
+    total += copied;
+    if(copy_buffered(source_fd, target_fd, &copied) == -1) {
+        return -1;
+    }
+    total += copied;
+    return total ? COPY_PATH_BUFFERED : COPY_PATH_NONE;
+}
+
+// Copy length bytes at offset of source_fd to the same offset of target_fd by explicit offsets
+// Return the data path which finished the copy, or -1 if an error occurs(errno is set)
+static int copy_extent(int source_fd, int target_fd, off_t offset, off_t length)
+{
+    static char* buffer = NULL;// Buffer of the pread()/pwrite() fallback, allocated once per process
+    off_t in = offset;
+    off_t out = offset;
+    off_t end = offset + length;
+    // Explicit offsets let several workers copy different ranges of the same file at the same time
+    while(in < end) {
+        ssize_t n = copy_file_range(source_fd, &in, target_fd, &out, qos_chunk(end - in), 0);
+        if(n == 0) { // The source file is shorter than expected
+            return COPY_PATH_COPY_FILE_RANGE;
+        }
+        if(n > 0) {
+            qos_charge(n, 1);
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(!is_unsupported(errno)) {
+                return -1;
+            }
+            break;// Copy the rest by pread()/pwrite()
+        }
+    }
+    if(in == end) {
+        return COPY_PATH_COPY_FILE_RANGE;
+    }
+    if(!buffer && !(buffer = malloc(COPY_BUFFER_SIZE))) {
+        return -1;
+    }
+    while(in < end) {
+        size_t want = end - in < COPY_BUFFER_SIZE ? end - in : COPY_BUFFER_SIZE;
+        ssize_t read_bytes = pread(source_fd, buffer, want, in);
+        if(read_bytes == 0) {
+            break;
+        }
+        if(read_bytes == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ssize_t done = 0;
+        while(done < read_bytes) { // Tackle with short writes
+            ssize_t write_bytes = pwrite(target_fd, buffer + done, read_bytes - done, in + done);
+            if(write_bytes == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += write_bytes;
+        }
+        in += read_bytes;
+        qos_charge(read_bytes, 1);
+    }
+    return COPY_PATH_BUFFERED;
+}
+
+// Check whether a file has holes(fewer blocks are allocated than its size needs)
+int file_is_sparse(const struct stat* stat_buf)
+{
+    return S_ISREG(stat_buf->st_mode) && (off_t)stat_buf->st_blocks * 512 < stat_buf->st_size;
+}
+
+// Copy only the data extents of a range found by SEEK_DATA/SEEK_HOLE, the holes are not written
+// so they stay holes in the target file, *data_bytes is set to the number of bytes actually read
+// Return the data path of the last extent, or -1 if an error occurs(errno is set)
+static int copy_data_extents(int source_fd, int target_fd, off_t offset, off_t length, off_t* data_bytes)
+{
+    off_t end = offset + length;
+    off_t pos = offset;
+    int path = COPY_PATH_NONE;
+    *data_bytes = 0;
+    while(pos < end) {
+        off_t data = lseek(source_fd, pos, SEEK_DATA);
+        off_t hole;
+        if(data == -1 && errno == ENXIO) { // Only a hole is left
+            break;
+        }
+        else if(data == -1 && pos == offset && (errno == EINVAL || errno == EOPNOTSUPP)) {
+            data = offset;// The filesystem can not report holes, copy the whole range
+            hole = end;
+        }
+        else if(data == -1) {
+            return -1;
+        }
+        else if(data >= end) {
+            break;
+        }
+        else if((hole = lseek(source_fd, data, SEEK_HOLE)) == -1) {
+            return -1;
+        }
+        if(hole > end) {
+            hole = end;
+        }
+        if((path = copy_extent(source_fd, target_fd, data, hole - data)) == -1) {
+            return -1;
+        }
+        *data_bytes += hole - data;
+        pos = hole;
+    }
+    return path;
+}
+
+// Copy length bytes at offset of source_fd to the same offset of target_fd without touching the file offsets
+// Return the data path which finished the copy, or -1 if an error occurs(errno is set)
+int copy_range(int source_fd, int target_fd, off_t offset, off_t length, off_t* data_bytes)
+{
+    off_t data = length;
+    int path;
+    struct stat stat_buf;
+    if(reflink_usable()) {
+        int cloned = clone_range(source_fd, target_fd, offset, length);
+        if(cloned != 0) {
+            if(data_bytes) {
+                *data_bytes = 0;// Nothing is read
+            }
+            return cloned == 1 ? COPY_PATH_REFLINK : -1;
+        }
+    }
+    if(fstat(source_fd, &stat_buf) == 0 && file_is_sparse(&stat_buf)) {
+        path = copy_data_extents(source_fd, target_fd, offset, length, &data);
+    }
+    else {
+        path = copy_extent(source_fd, target_fd, offset, length);
+    }
+    if(data_bytes) {
+        *data_bytes = data;
+    }
+    return path;
+}
+
+// Parse a size with an optional K, M or G suffix, return -1 if the size is invalid
+off_t parse_size(const char* str)
+{
+    char* end;
+    long long size = strtoll(str, &end, 10);
+    if(end == str || size < 0) {
+        return -1;
+    }
+    switch(*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// Remove name in dirfd if it exists and is not a regular file
+int remove_special_at(int dirfd, const char* name)
+{
+    struct stat stat_buf;
+    if(fstatat(dirfd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if(S_ISREG(stat_buf.st_mode)) {
+        return 0;
+    }
+    return unlinkat(dirfd, name, S_ISDIR(stat_buf.st_mode) ? AT_REMOVEDIR : 0);
+}
+
+// Open a target file, a new target costs one openat(), an existing one is checked before it is opened
+int open_target_at(int dirfd, const char* name, int flags, mode_t mode)
+{
+    int fd = openat(dirfd, name, flags | O_EXCL | O_NOFOLLOW, mode);
+    if(fd != -1 || errno != EEXIST) {
+        return fd;
+    }
+    if(remove_special_at(dirfd, name) == -1) {
+        return -1;
+    }
+    fd = openat(dirfd, name, flags | O_NOFOLLOW, mode);
+    if(fd == -1 && errno == ELOOP) { // Replaced by a symbolic link meanwhile
+        if(unlinkat(dirfd, name, 0) == -1) {
+            return -1;
+        }
+        fd = openat(dirfd, name, flags | O_EXCL | O_NOFOLLOW, mode);
+    }
+    return fd;
+}
+
+// Copy a regular file given relative to two directory file descriptors, exit if an error occurs
+// label is the path shown in reports and error messages(NULL to show the file names)
+// In a verify mode the data is hashed while it is copied and the hash is recorded under label
+// In the journal mode the data is written under a temporary name, which is renamed when the file is complete
+void copy_file_at(int source_dirfd, const char* source_file, int target_dirfd, const char* target_file, const char* label)
+{
+    unsigned long long start = stats_now();
+    int source_fd = openat(source_dirfd, source_file, O_RDONLY);
+    if(source_fd == -1) { // ERROR
+        printf("Can not open a source file!\n");
+        perror(label ? label : source_file);
+        exit(-1);
+    }
+    struct stat stat_buf;
+    int have_stat = fstat(source_fd, &stat_buf) == 0;
+    char temp[PATH_MAX];
+    const char* written_file = have_stat && journal_use_temp(&stat_buf) ? journal_temp_name(target_file, temp)
+        : target_file;// A first name other names are linked to is written in place
+    int target_fd = open_target_at(target_dirfd, written_file,
+        (copy_opts.verify == VERIFY_READBACK ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+    if(target_fd == -1) { //ERROR
+        printf("Can not open a target file!\n");
+        perror(label ? label : target_file);
+        close(source_fd);
+        exit(-1);
+    }
+    unsigned long long mark = stats_phase(PHASE_OPEN, start);
+    if(copy_opts.order) { // Files are read in layout order, a larger read ahead window keeps the disk streaming
+        posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    off_t size_hint = have_stat ? stat_buf.st_size : 0;
+    int sparse = have_stat && file_is_sparse(&stat_buf);
+    off_t data_bytes = 0;
+    int path = -1;
+    int cloned = 0;
+    uint32_t crc = 0;
+    if(reflink_usable()) { // Share the blocks of the source instead of copying them
+        cloned = clone_range(source_fd, target_fd, 0, 0);
+    }
+    if(cloned == 1) {
+        path = copy_opts.verify && hash_range(source_fd, 0, size_hint, &crc) == -1 ? -1 : COPY_PATH_REFLINK;
+    }
+    else if(cloned == 0 && copy_opts.verify) { // Hash the data on its way through the buffer, holes are kept
+        path = copy_range_hashed(source_fd, target_fd, 0, size_hint, &crc, &data_bytes);
+        if(path != -1 && sparse && ftruncate(target_fd, size_hint) == -1) {
+            path = -1;
+        }
+    }
+    else if(cloned == 0 && sparse) { // Copy the data extents and recreate the holes by setting the size
+        path = copy_data_extents(source_fd, target_fd, 0, size_hint, &data_bytes);
+        if(path != -1 && ftruncate(target_fd, size_hint) == -1) {
+            path = -1;
+        }
+    }
+    else if(cloned == 0) {
+        path = copy_fd(source_fd, target_fd, size_hint);
+    }
+    else { // ERROR
+        printf("Can not clone a file!\n");
+        perror(label ? label : source_file);
+        close(source_fd);
+        close(target_fd);
+        exit(-1);
+    }
+    if(path != -1 && copy_opts.incremental && have_stat && keep_mtime(target_fd, &stat_buf) == -1) {
+        path = -1;
+    }
+    if(path == -1) { // ERROR
+        printf("An error occurs when copying a file!\n");
+        perror(label ? label : source_file);// ERROR information
+        close(source_fd);
+        close(target_fd);
+        exit(-1);
+    }
+    if(copy_opts.verify == VERIFY_READBACK) {
+        verify_range(target_fd, 0, size_hint, crc, label ? label : target_file);
+    }
+    if(copy_opts.verify && have_stat) {
+        manifest_record(label, size_hint, &stat_buf.st_mtim, crc);
+    }
+    // After the read-back, reading the target could change its access time
+    if(copy_opts.preserve && have_stat && preserve_fd(source_fd, target_fd, &stat_buf) == -1) { // ERROR
+        printf("Can not preserve the attributes of a file!\n");
+        perror(label ? label : target_file);
+        close(source_fd);
+        close(target_fd);
+        exit(-1);
+    }
+    if(written_file != target_file) { // The file is complete, replace the target in one step
+        journal_commit(target_dirfd, written_file, target_file, label);
+    }
+    if(copy_opts.journal && have_stat) {
+        journal_record(target_dirfd, label, size_hint, &stat_buf.st_mtim, copy_opts.verify ? &crc : NULL);
+    }
+    mark = stats_phase(PHASE_DATA, mark);
+    if(copy_opts.verbose) { // Report the data path this file took
+        if(label) {
+            printf("%s [%s]", label, copy_path_name(path));
+        }
+        else {
+            printf("%s -> %s [%s]", source_file, target_file, copy_path_name(path));
+        }
+        if(sparse && cloned == 0) { // Report the bytes read of a sparse file
+            printf(" [sparse: %lld of %lld bytes read]", (long long)data_bytes, (long long)size_hint);
+        }
+        if(copy_opts.verify) {
+            printf(" [crc32c: %08x]", crc);
+        }
+        printf("\n");
+    }
+    close(source_fd);
+    close(target_fd);
+    stats_phase(PHASE_CLOSE, mark);
+    stats_file(size_hint, sparse && cloned == 0 ? data_bytes : size_hint, start);
+}
+
+// Copy a regular file, exit if an error occurs
+void copy_file(const char* source_file, const char* target_file)
+{
+    copy_file_at(AT_FDCWD, source_file, AT_FDCWD, target_file, NULL);
+}
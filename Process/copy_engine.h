@@ -0,0 +1,98 @@
+// Copy engine shared by copydir_sp and copydir_mp
+// Author: Noah Lin
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define COPY_BUFFER_SIZE (128 * 1024)// Buffer of the buffered fallback path
+
+// Data paths of the copy engine, in the order they are tried
+enum copy_path {
+    COPY_PATH_NONE = 0,// Nothing has been copied(empty file)
+    COPY_PATH_REFLINK,// FICLONE/FICLONERANGE, the target shares the blocks of the source(copy-on-write)
+    COPY_PATH_COPY_FILE_RANGE,// copy_file_range(), copied inside the kernel(may be offloaded by the filesystem)
+    COPY_PATH_SENDFILE,// sendfile(), copied inside the kernel through the page cache
+    COPY_PATH_SPLICE,// splice() through a pipe, copied inside the kernel
+    COPY_PATH_BUFFERED,// read()/write() through a user space buffer
+    COPY_PATH_COUNT
+};
+
+// Reflink modes
+enum reflink_mode {
+    REFLINK_AUTO = 0,// Clone if the filesystem supports it, otherwise copy the data
+    REFLINK_ALWAYS,// Clone or fail
+    REFLINK_NEVER// Always copy the data
+};
+
+// Verification modes
+enum verify_mode {
+    VERIFY_NONE = 0,
+    VERIFY_HASH,// Hash the data while it is copied(for the manifest)
+    VERIFY_READBACK// Also read every target back and compare its hash
+};
+
+// Options of the copy engine
+struct copy_options {
+    int verbose;// Print the data path of every copied file if not 0
+    int reflink;// One of reflink_mode
+    int incremental;// Keep the modification time of every source on its target, so a later run can compare them
+    int checksum;// Compare the content of existing targets instead of trusting their size and modification time
+    int verify;// One of verify_mode
+    int preserve;// Apply the owner, extended attributes, mode and timestamps of every source to its target
+    int order;// One of order_mode(copy_order.h), order of the regular files of a directory
+    int journal;// Write files under a temporary name and record them in the journal(copy_journal.h) once renamed
+};
+
+extern struct copy_options copy_opts;
+
+// Return the name of a data path
+const char* copy_path_name(int path);
+
+// Parse a reflink mode(auto, always or never), return -1 if the mode is invalid
+int parse_reflink(const char* str);
+
+// Return 1 if cloning should be tried for the next file, return 0 if the mode is never
+// or the filesystem has been found not to support it
+int reflink_usable(void);
+
+// Clone length bytes at offset of source_fd to the same offset of target_fd(the whole file if length is 0)
+// Return 1 if succeed, return 0 if cloning is not supported and the data should be copied,
+// return -1 if an error occurs or cloning is not supported in the always mode(errno is set)
+int clone_range(int source_fd, int target_fd, off_t offset, off_t length);
+
+// Copy all data from the current offset of source_fd to the current offset of target_fd
+// Return the data path which finished the copy, or -1 if an error occurs(errno is set)
+int copy_fd(int source_fd, int target_fd, off_t size_hint);
+
+// Copy length bytes at offset of source_fd to the same offset of target_fd without touching the file offsets
+// The range is cloned if reflink_usable() is true, only the data extents are copied if the source file is sparse
+// *data_bytes(if not NULL) is set to the number of bytes actually read
+// Return the data path which finished the copy, or -1 if an error occurs(errno is set)
+int copy_range(int source_fd, int target_fd, off_t offset, off_t length, off_t* data_bytes);
+
+// Check whether a file has holes(fewer blocks are allocated than its size needs)
+int file_is_sparse(const struct stat* stat_buf);
+
+// Parse a size with an optional K, M or G suffix, return -1 if the size is invalid
+off_t parse_size(const char* str);
+
+// Remove name in dirfd if it exists and is not a regular file(a symbolic link, a directory, a FIFO...)
+// Return 0 if succeed, otherwise return -1(errno is set)
+int remove_special_at(int dirfd, const char* name);
+
+// Open a target file in dirfd with flags(which contain O_CREAT), never through a symbolic link:
+// an existing target which is not a regular file is replaced, an existing regular file is opened
+// Return the file descriptor if succeed, otherwise return -1(errno is set)
+int open_target_at(int dirfd, const char* name, int flags, mode_t mode);
+
+// Copy a regular file given relative to two directory file descriptors, exit if an error occurs
+// Holes of a sparse file are kept: only the data extents are read and written
+// label is the path shown in reports and error messages(NULL to show the file names)
+void copy_file_at(int source_dirfd, const char* source_file, int target_dirfd, const char* target_file, const char* label);
+
+// Copy a regular file, exit if an error occurs
+void copy_file(const char* source_file, const char* target_file);
+
+#endif
@@ -0,0 +1,310 @@
+// Resumable copy: an append-only journal of the completed files, a restarted run skips them without looking
+// at the target tree, and files are written under a temporary name which is renamed once they are complete
+// Every line of the journal is "crc size mtime path"(crc is "-" if the file was not hashed), like a manifest line
+// Entries are kept in memory and appended at a checkpoint after syncfs(), so an entry on the disk always
+// describes data on the disk, a line torn by a crash has no newline: it is ignored and cut off by the next run
+// Worker processes share the journal descriptor(O_APPEND), every checkpoint appends its entries by one write()
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include "copy_engine.h"
+#include "copy_journal.h"
+#include "copy_verify.h"
+
+// A file completed by an earlier run
+struct journal_entry {
+    const char* path;
+    off_t size;
+    struct timespec mtime;// Modification time of the source when it was copied
+    uint32_t crc;
+    int hashed;// crc is the hash of the file
+    struct journal_entry* next;
+};
+
+static struct journal_entry** done = NULL;// Completed files of earlier runs, read only after journal_open()
+static const char* journal_path = NULL;
+static int journal_fd = -1;
+static char* pending = NULL;// Entries recorded by this process since its last checkpoint
+static size_t pending_len = 0;
+static size_t pending_capacity = 0;
+static int sync_fd = -1;// Descriptor of the target filesystem of this process, flushed before the entries
+static struct timespec last_checkpoint;
+
+// Hash of a path(FNV-1a)
+static unsigned long hash_path(const char* path)
+{
+    unsigned long h = 0xcbf29ce484222325UL;
+    while(*path) {
+        h = (h ^ (unsigned char)*path++) * 0x100000001b3UL;
+    }
+    return h ^ (h >> 29);
+}
+
+// Parse a complete line of the journal and add its file, a later line of the same path replaces an earlier one
+static void load_line(char* line)
+{
+    unsigned int crc = 0;
+    long long size;
+    long long sec;
+    long nsec;
+    int consumed = 0;
+    if(line[0] == '#') {
+        return;
+    }
+    int hashed = line[0] != '-';
+    int parsed = hashed ? sscanf(line, "%8x %lld %lld.%9ld %n", &crc, &size, &sec, &nsec, &consumed) == 4
+        : sscanf(line, "- %lld %lld.%9ld %n", &size, &sec, &nsec, &consumed) == 3;
+    if(!parsed || consumed == 0) {
+        return;// Damaged line, the file is copied again
+    }
+    char* in = line + consumed;
+    char* out = in;
+    while(*in && *in != '\n') {
+        if(*in == '\\' && in[1] == 'n') {
+            *out++ = '\n';
+            in += 2;
+        }
+        else if(*in == '\\' && in[1] == '\\') {
+            *out++ = '\\';
+            in += 2;
+        }
+        else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+    const char* path = line + consumed;
+    unsigned long bucket = hash_path(path) % JOURNAL_BUCKETS;
+    struct journal_entry* entry;
+    for(entry = done[bucket]; entry && strcmp(entry->path, path) != 0; entry = entry->next) {
+    }
+    if(!entry) {
+        size_t len = strlen(path);
+        entry = malloc(sizeof(struct journal_entry) + len + 1);
+        if(!entry) { // ERROR
+            perror("journal_open()");
+            exit(-1);
+        }
+        entry->path = memcpy(entry + 1, path, len + 1);
+        entry->next = done[bucket];
+        done[bucket] = entry;
+    }
+    entry->size = size;
+    entry->mtime.tv_sec = sec;
+    entry->mtime.tv_nsec = nsec;
+    entry->crc = crc;
+    entry->hashed = hashed;
+}
+
+// Load the completed files of an earlier run and open the journal for appending
+int journal_open(const char* file)
+{
+    done = calloc(JOURNAL_BUCKETS, sizeof(struct journal_entry*));
+    if(!done) {
+        return -1;
+    }
+    FILE* stream = fopen(file, "r");
+    if(!stream && errno != ENOENT) {
+        return -1;
+    }
+    off_t complete = 0;// Length of the complete lines
+    if(stream) {
+        char* line = NULL;
+        size_t capacity = 0;
+        ssize_t len;
+        while((len = getline(&line, &capacity, stream)) != -1) {
+            if(line[len - 1] == '\n') { // The last line may be torn by a crash
+                load_line(line);
+                complete += len;
+            }
+        }
+        free(line);
+        int failed = ferror(stream);
+        fclose(stream);
+        if(failed) {
+            return -1;
+        }
+    }
+    journal_fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(journal_fd == -1) {
+        return -1;
+    }
+    // Cut off a line torn by a crash, a newline after it would make a later run load it as complete
+    if(ftruncate(journal_fd, complete) == -1) {
+        return -1;
+    }
+    const char* header = "# copydir journal 1: crc32c size mtime path\n";
+    if(write(journal_fd, header, strlen(header)) == -1) {
+        return -1;
+    }
+    journal_path = file;
+    clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+    return 0;
+}
+
+// Check whether a file has been completed by an earlier run and its source has not changed since
+int journal_skip(int source_dirfd, const char* source_file, const struct stat* source_stat, const char* path)
+{
+    if(!done || !path) {
+        return 0;
+    }
+    struct journal_entry* entry;
+    for(entry = done[hash_path(path) % JOURNAL_BUCKETS]; entry; entry = entry->next) {
+        if(strcmp(entry->path, path) == 0) {
+            break;
+        }
+    }
+    if(!entry || entry->size != source_stat->st_size || entry->mtime.tv_sec != source_stat->st_mtim.tv_sec
+        || entry->mtime.tv_nsec != source_stat->st_mtim.tv_nsec) {
+        return 0;
+    }
+    if(copy_opts.verify && entry->hashed) {
+        manifest_record(path, entry->size, &entry->mtime, entry->crc);
+    }
+    else if(copy_opts.verify) { // Copied by a run which did not hash, hash the source now
+        verify_unchanged(source_dirfd, source_file, source_stat, path);
+    }
+    return 1;
+}
+
+// Append len bytes to the pending entries of this process
+static void pending_append(const char* data, size_t len)
+{
+    if(pending_len + len > pending_capacity) {
+        size_t capacity = pending_capacity ? pending_capacity : JOURNAL_BUFFER;
+        while(capacity < pending_len + len) {
+            capacity *= 2;
+        }
+        char* grown = realloc(pending, capacity);
+        if(!grown) { // ERROR
+            perror("journal_record()");
+            exit(-1);
+        }
+        pending = grown;
+        pending_capacity = capacity;
+    }
+    memcpy(pending + pending_len, data, len);
+    pending_len += len;
+}
+
+// Record a completed file, it reaches the journal at the next checkpoint of this process
+void journal_record(int target_dirfd, const char* path, off_t size, const struct timespec* mtime, const uint32_t* crc)
+{
+    if(journal_fd == -1 || !path) {
+        return;
+    }
+    if(sync_fd == -1 && (sync_fd = dup(target_dirfd)) == -1) { // ERROR
+        perror("journal_record()");
+        exit(-1);
+    }
+    char head[64];
+    int len;
+    if(crc) {
+        len = snprintf(head, sizeof(head), "%08x %lld %lld.%09ld ", *crc, (long long)size, (long long)mtime->tv_sec,
+            mtime->tv_nsec);
+    }
+    else {
+        len = snprintf(head, sizeof(head), "- %lld %lld.%09ld ", (long long)size, (long long)mtime->tv_sec,
+            mtime->tv_nsec);
+    }
+    pending_append(head, len);
+    const char* p;
+    for(p = path; *p; p++) {
+        if(*p == '\n') {
+            pending_append("\\n", 2);
+        }
+        else if(*p == '\\') {
+            pending_append("\\\\", 2);
+        }
+        else {
+            pending_append(p, 1);
+        }
+    }
+    pending_append("\n", 1);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if((pending_len >= JOURNAL_BUFFER || now.tv_sec - last_checkpoint.tv_sec >= JOURNAL_INTERVAL)
+        && journal_checkpoint() == -1) { // ERROR
+        printf("Can not write the journal!\n");
+        perror(journal_path);
+        exit(-1);
+    }
+}
+
+// Flush the target filesystem, then append and flush the entries recorded by this process since the last checkpoint
+int journal_checkpoint(void)
+{
+    if(journal_fd == -1 || pending_len == 0) {
+        return 0;
+    }
+    // The data and the renames of the recorded files go first, then the entries describing them
+    if(syncfs(sync_fd) == -1) {
+        return -1;
+    }
+    size_t off = 0;
+    while(off < pending_len) {
+        ssize_t ret = write(journal_fd, pending + off, pending_len - off);
+        if(ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if(ret == -1) {
+            return -1;
+        }
+        off += ret;
+    }
+    if(fdatasync(journal_fd) == -1) {
+        return -1;
+    }
+    pending_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+    return 0;
+}
+
+// Finish the journal of a run
+int journal_close(int complete)
+{
+    if(journal_fd == -1) {
+        return 0;
+    }
+    int ret = complete ? unlink(journal_path) : journal_checkpoint();
+    close(journal_fd);
+    journal_fd = -1;
+    return ret;
+}
+
+// Return the temporary name of a target: ".name" JOURNAL_SUFFIX, or a hash of a name too long for it
+const char* journal_temp_name(const char* target_file, char* buffer)
+{
+    const char* slash = strrchr(target_file, '/');
+    const char* name = slash ? slash + 1 : target_file;
+    int dir_len = name - target_file;
+    if(strlen(name) + 1 + strlen(JOURNAL_SUFFIX) <= NAME_MAX) {
+        snprintf(buffer, PATH_MAX, "%.*s.%s%s", dir_len, target_file, name, JOURNAL_SUFFIX);
+    }
+    else {
+        snprintf(buffer, PATH_MAX, "%.*s.%016lx%s", dir_len, target_file, hash_path(name), JOURNAL_SUFFIX);
+    }
+    return buffer;
+}
+
+// Check whether a target is written under its temporary name
+int journal_use_temp(const struct stat* source_stat)
+{
+    return copy_opts.journal && source_stat->st_nlink < 2;
+}
+
+// Move a complete temporary target to its name
+void journal_commit(int target_dirfd, const char* temp_file, const char* target_file, const char* label)
+{
+    if(renameat(target_dirfd, temp_file, target_dirfd, target_file) == -1) { // ERROR
+        printf("Can not rename a target file!\n");
+        perror(label ? label : target_file);
+        exit(-1);
+    }
+}
@@ -0,0 +1,51 @@
+// Resumable copy: an append-only journal of the completed files, a restarted run skips them without looking
+// at the target tree, and files are written under a temporary name which is renamed once they are complete
+// Author: Noah Lin
+#ifndef COPY_JOURNAL_H
+#define COPY_JOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define JOURNAL_BUCKETS (1UL << 18)// Hash buckets of the completed files of earlier runs, chains grow beyond it
+#define JOURNAL_INTERVAL 5// Seconds between two checkpoints of a process
+#define JOURNAL_BUFFER (64 * 1024)// Bytes of completed entries which force a checkpoint before the interval
+#define JOURNAL_SUFFIX ".copydir-part"// Suffix of the temporary name of a file being written
+
+// Load the completed files of an earlier run from file(a missing file starts a new journal) and open it
+// for appending, files completed by this run are appended at every checkpoint
+// Return 0 if succeed, otherwise return -1(errno is set)
+int journal_open(const char* file);
+
+// Check whether a file has been completed by an earlier run and its source has not changed since
+// In a verify mode its hash is recorded into the manifest(from the journal, or by hashing the source)
+// Return 1 if the file can be skipped, otherwise return 0
+int journal_skip(int source_dirfd, const char* source_file, const struct stat* source_stat, const char* path);
+
+// Record a completed file(nothing if no journal is open or path is NULL), crc is NULL if it was not hashed
+// The entry reaches the journal at the next checkpoint of this process, after the data of the file
+// target_dirfd is any descriptor of the target filesystem, it is flushed by the checkpoints
+void journal_record(int target_dirfd, const char* path, off_t size, const struct timespec* mtime, const uint32_t* crc);
+
+// Flush the target filesystem, then append the entries recorded by this process since the last checkpoint
+// and flush the journal, so no entry can survive a crash which its data does not survive
+// Return 0 if succeed, otherwise return -1(errno is set)
+int journal_checkpoint(void);
+
+// Finish the journal of a run: a complete run removes it, otherwise the pending entries are checkpointed
+// Return 0 if succeed, otherwise return -1(errno is set)
+int journal_close(int complete);
+
+// Return the temporary name of a target(a name in the same directory, buffer holds at least PATH_MAX bytes)
+const char* journal_temp_name(const char* target_file, char* buffer);
+
+// Check whether a target is written under its temporary name: in the journal mode, unless other names are
+// linked to it(a rename would replace the inode they share)
+int journal_use_temp(const struct stat* source_stat);
+
+// Move a complete temporary target to its name, exit if an error occurs(label is the path shown in error messages)
+void journal_commit(int target_dirfd, const char* temp_file, const char* target_file, const char* label);
+
+#endif
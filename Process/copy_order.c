@@ -0,0 +1,134 @@
+// Physical layout ordering: the regular files of a directory are copied in the order of their inodes or of their
+// first physical blocks, so a rotational disk reads them in one sweep instead of seeking back and forth
+// getdents64() returns names in hash order on ext4 and XFS, which is unrelated to where the data lies
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>// FS_IOC_FIEMAP
+#include <linux/fiemap.h>
+#include <stdio.h>
+#include "copy_engine.h"
+#include "copy_order.h"
+
+static int fiemap_unsupported = 0;// Set once FIEMAP failed because the filesystem does not support it
+
+// Parse an order(readdir, inode or extent), return -1 if the order is invalid
+int parse_order(const char* str)
+{
+    if(strcmp(str, "readdir") == 0) {
+        return ORDER_READDIR;
+    }
+    else if(strcmp(str, "inode") == 0) {
+        return ORDER_INODE;
+    }
+    else if(strcmp(str, "extent") == 0) {
+        return ORDER_EXTENT;
+    }
+    return -1;
+}
+
+// Return the physical address of the first extent of a file, 0 if it has no data on the disk,
+// or inode if the filesystem can not map extents
+static unsigned long long extent_key(int dir_fd, const char* name, unsigned long long inode)
+{
+    if(fiemap_unsupported) {
+        return inode;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if(fd == -1) {
+        return inode;// The copy reports the error
+    }
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;// Only the first extent is needed
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    unsigned long long key = 0;
+    if(ioctl(fd, FS_IOC_FIEMAP, &request.map) == -1) {
+        if(errno == EOPNOTSUPP || errno == ENOTTY) { // Same filesystem for the whole tree in the usual case
+            fiemap_unsupported = 1;
+        }
+        key = inode;
+    }
+    else if(request.map.fm_mapped_extents == 1) {
+        key = request.extent.fe_physical;// 0 for delayed allocation, such data is still in the page cache
+    }
+    close(fd);
+    return key;
+}
+
+// Add a regular file to a batch
+void order_batch_add(struct order_batch* batch, int dir_fd, const struct linux_dirent64* entry)
+{
+    if(batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 256;
+        struct order_entry* entries = realloc(batch->entries, sizeof(struct order_entry) * capacity);
+        if(!entries) { // ERROR
+            perror("realloc");
+            exit(-1);
+        }
+        batch->entries = entries;
+        batch->capacity = capacity;
+    }
+    struct order_entry* item = &batch->entries[batch->count++];
+    item->name = batch->names.len;
+    item->key = copy_opts.order == ORDER_EXTENT ? extent_key(dir_fd, entry->d_name, entry->d_ino) : entry->d_ino;
+    name_list_add(&batch->names, entry->d_name);
+}
+
+// Order entries by key
+static int compare_keys(const void* a, const void* b)
+{
+    unsigned long long x = ((const struct order_entry*)a)->key;
+    unsigned long long y = ((const struct order_entry*)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+// Sort a batch by key
+void order_batch_sort(struct order_batch* batch)
+{
+    qsort(batch->entries, batch->count, sizeof(struct order_entry), compare_keys);
+}
+
+// Return the name of the i-th file of a batch
+const char* order_batch_name(const struct order_batch* batch, size_t i)
+{
+    return batch->names.data + batch->entries[i].name;
+}
+
+// Empty a batch for the next files
+void order_batch_clear(struct order_batch* batch)
+{
+    batch->count = 0;
+    batch->names.len = 0;
+}
+
+// Free the memory of a batch
+void order_batch_free(struct order_batch* batch)
+{
+    free(batch->entries);
+    free(batch->names.data);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Start reading the beginning of a file into the page cache without waiting for it
+void prefetch_file(int dir_fd, const char* name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if(fd == -1) {
+        return;
+    }
+    // readahead() only queues the reads, the pages stay cached after the descriptor is closed
+    if(readahead(fd, 0, PREFETCH_SIZE) == -1) {
+        posix_fadvise(fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+    }
+    close(fd);
+}
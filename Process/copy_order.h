@@ -0,0 +1,55 @@
+// Physical layout ordering: the regular files of a directory are copied in the order of their inodes or of their
+// first physical blocks, so a rotational disk reads them in one sweep instead of seeking back and forth
+// Author: Noah Lin
+#ifndef COPY_ORDER_H
+#define COPY_ORDER_H
+
+#include <stddef.h>
+#include "dir_reader.h"
+
+#define ORDER_BATCH 4096// Files sorted at once, a larger directory is copied in sorted batches
+#define PREFETCH_SIZE (2L << 20)// Bytes of the next file read ahead while the current one is copied
+
+// Orders of the regular files of a directory
+enum order_mode {
+    ORDER_READDIR = 0,// As returned by getdents64()(hash order on most filesystems)
+    ORDER_INODE,// By inode number, inodes are allocated near their data on ext4 and XFS
+    ORDER_EXTENT// By the physical address of the first extent(FIEMAP), falls back to inodes without FIEMAP
+};
+
+// A file of a batch
+struct order_entry {
+    unsigned long long key;
+    size_t name;// Offset of the name in the names of the batch
+};
+
+// Regular files of a directory collected before they are copied
+struct order_batch {
+    struct order_entry* entries;
+    size_t count;
+    size_t capacity;
+    struct path_buf names;
+};
+
+// Parse an order(readdir, inode or extent), return -1 if the order is invalid
+int parse_order(const char* str);
+
+// Add a regular file to a batch, its key is taken by copy_opts.order(a FIEMAP key opens the file relative to dir_fd)
+void order_batch_add(struct order_batch* batch, int dir_fd, const struct linux_dirent64* entry);
+
+// Sort a batch by key
+void order_batch_sort(struct order_batch* batch);
+
+// Return the name of the i-th file of a batch
+const char* order_batch_name(const struct order_batch* batch, size_t i);
+
+// Empty a batch for the next files, its memory is kept
+void order_batch_clear(struct order_batch* batch);
+
+// Free the memory of a batch
+void order_batch_free(struct order_batch* batch);
+
+// Start reading the beginning of a file into the page cache without waiting for it
+void prefetch_file(int dir_fd, const char* name);
+
+#endif
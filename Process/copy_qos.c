@@ -0,0 +1,214 @@
+// I/O QoS of a background copy: a token bucket limiting the bytes and the data requests per second of all
+// workers together, adjustable while the copy runs, and the I/O priority and nice value of the copy
+// A request is charged after it is done and may take tokens in advance, the bucket goes negative and the
+// request waits until it is paid back, so concurrent workers queue up behind each other at the given rates
+// The idle class only takes effect with an I/O scheduler which supports priorities(BFQ)
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include "copy_engine.h"
+#include "copy_qos.h"
+#include "copy_stats.h"
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+struct qos_bucket* copy_qos = NULL;
+
+static const char* control_path = NULL;// Control file, NULL if the rates are fixed
+
+// Return a monotonic time in nanoseconds
+static unsigned long long monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Create a limiter of byte_rate bytes and op_rate data requests per second
+struct qos_bucket* qos_create(qos_alloc alloc, void* alloc_arg, long long byte_rate, long long op_rate)
+{
+    struct qos_bucket* bucket = alloc(sizeof(struct qos_bucket), alloc_arg);
+    if(!bucket) {
+        return NULL;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&bucket->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    bucket->byte_rate = byte_rate;
+    bucket->op_rate = op_rate;
+    bucket->last_ns = monotonic_ns();
+    return bucket;
+}
+
+// Load the rates of a control file if it changed since it was loaded(or force is not 0), the bucket is locked
+static int load_control(struct qos_bucket* bucket, int force)
+{
+    struct stat stat_buf;
+    if(stat(control_path, &stat_buf) == -1) {
+        return -1;
+    }
+    if(!force && stat_buf.st_mtim.tv_sec == bucket->control_mtime.tv_sec
+        && stat_buf.st_mtim.tv_nsec == bucket->control_mtime.tv_nsec) {
+        return 0;
+    }
+    FILE* stream = fopen(control_path, "r");
+    if(!stream) {
+        return -1;
+    }
+    bucket->control_mtime = stat_buf.st_mtim;
+    char line[128];
+    while(fgets(line, sizeof(line), stream)) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        char* value = strchr(line, '=');
+        off_t rate = value ? parse_size(value + 1) : -1;
+        if(rate == -1) { // Comment or invalid line, the current rate is kept
+            continue;
+        }
+        if(strncmp(line, "bwlimit=", 8) == 0) {
+            bucket->byte_rate = rate;
+        }
+        else if(strncmp(line, "iops=", 5) == 0) {
+            bucket->op_rate = rate;
+        }
+    }
+    fclose(stream);
+    return 0;
+}
+
+// Ask the next request to load the control file
+static void hangup_handler(int sig)
+{
+    (void)sig;
+    if(copy_qos) {
+        copy_qos->reload = 1;
+    }
+}
+
+// Load the rates of copy_qos from a control file now, then again whenever the file changes or SIGHUP arrives
+int qos_set_control(const char* file)
+{
+    control_path = file;
+    if(load_control(copy_qos, 1) == -1) {
+        return -1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = hangup_handler;
+    action.sa_flags = SA_RESTART;// The parent of the workers keeps waiting for them
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGHUP, &action, NULL);
+}
+
+// Add the tokens of the time since the last refill, at most QOS_BURST_MS of every rate
+static void refill(struct qos_bucket* bucket, unsigned long long now)
+{
+    double seconds = (now - bucket->last_ns) / 1e9;
+    double burst = QOS_BURST_MS / 1000.0;
+    bucket->last_ns = now;
+    bucket->bytes += seconds * bucket->byte_rate;
+    if(bucket->bytes > bucket->byte_rate * burst) {
+        bucket->bytes = bucket->byte_rate * burst;
+    }
+    bucket->ops += seconds * bucket->op_rate;
+    if(bucket->ops > bucket->op_rate * burst) {
+        bucket->ops = bucket->op_rate * burst;
+    }
+}
+
+// Take the tokens of a data request which has been done, and wait until the limiter has them
+void qos_charge(off_t bytes, int ops)
+{
+    struct qos_bucket* bucket = copy_qos;
+    if(!bucket || (!bucket->byte_rate && !bucket->op_rate && !control_path)) {
+        return;
+    }
+    pthread_mutex_lock(&bucket->lock);
+    unsigned long long now = monotonic_ns();
+    if(control_path && (bucket->reload || now - bucket->checked_ns >= QOS_POLL_MS * 1000000ULL)) {
+        int force = bucket->reload;
+        bucket->reload = 0;
+        bucket->checked_ns = now;
+        load_control(bucket, force);// A control file removed or unreadable meanwhile keeps the current rates
+    }
+    refill(bucket, now);
+    double wait = 0;// Seconds until the tokens taken are paid back
+    if(bucket->byte_rate) {
+        bucket->bytes -= bytes;
+        if(bucket->bytes < 0) {
+            wait = -bucket->bytes / bucket->byte_rate;
+        }
+    }
+    if(bucket->op_rate) {
+        bucket->ops -= ops;
+        if(bucket->ops < 0 && -bucket->ops / bucket->op_rate > wait) {
+            wait = -bucket->ops / bucket->op_rate;
+        }
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    if(wait <= 0) {
+        return;
+    }
+    unsigned long long start = stats_now();
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    long long ns = (long long)(wait * 1e9) + until.tv_nsec;
+    until.tv_sec += ns / 1000000000LL;
+    until.tv_nsec = ns % 1000000000LL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) { // SIGHUP does not cut the wait
+    }
+    stats_throttled(start);
+}
+
+// Return the size of the next data request of at most length bytes
+size_t qos_chunk(size_t length)
+{
+    if(copy_qos && length > QOS_CHUNK) { // A large request would be paid back by one long wait
+        return QOS_CHUNK;
+    }
+    return length;
+}
+
+// Parse an I/O priority: idle, be[:level] or rt[:level]
+int parse_ioprio(const char* str)
+{
+    int class;
+    const char* level = str + 2;
+    if(strcmp(str, "idle") == 0) {
+        return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    }
+    else if(strncmp(str, "be", 2) == 0) {
+        class = IOPRIO_CLASS_BE;
+    }
+    else if(strncmp(str, "rt", 2) == 0) {
+        class = IOPRIO_CLASS_RT;
+    }
+    else {
+        return -1;
+    }
+    if(*level == '\0') {
+        return (class << IOPRIO_CLASS_SHIFT) | 4;// The default level
+    }
+    if(level[0] != ':' || level[1] < '0' || level[1] > '7' || level[2] != '\0') {
+        return -1;
+    }
+    return (class << IOPRIO_CLASS_SHIFT) | (level[1] - '0');
+}
+
+// Set the I/O priority of this process and of the processes it forks later
+int qos_set_ioprio(int ioprio)
+{
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+}
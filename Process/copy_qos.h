@@ -0,0 +1,57 @@
+// I/O QoS of a background copy: a token bucket limiting the bytes and the data requests per second of all
+// workers together, adjustable while the copy runs, and the I/O priority and nice value of the copy
+// Author: Noah Lin
+#ifndef COPY_QOS_H
+#define COPY_QOS_H
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#define QOS_BURST_MS 100// An idle limiter saves up tokens for at most this many milliseconds of its rates
+#define QOS_CHUNK (1L << 20)// Largest data request while a limit is set, so every request is paced
+#define QOS_POLL_MS 1000// Interval of checking the control file for changes
+
+// Allocate zeroed memory for the limiter(use shared memory to share it by processes forked later)
+typedef void* (*qos_alloc)(size_t size, void* arg);
+
+// Token bucket shared by all workers
+struct qos_bucket {
+    pthread_mutex_t lock;// Process-shared
+    long long byte_rate;// Bytes per second, 0 for no limit
+    long long op_rate;// Data requests per second, 0 for no limit
+    double bytes;// Tokens, negative while requests wait for the ones they have taken in advance
+    double ops;
+    unsigned long long last_ns;// Time of the last refill
+    unsigned long long checked_ns;// Time of the last check of the control file
+    struct timespec control_mtime;// Modification time of the control file when it was loaded
+    volatile sig_atomic_t reload;// Set by SIGHUP, the control file is loaded by the next request
+};
+
+extern struct qos_bucket* copy_qos;// Limiter of this run, NULL if the copy is not limited
+
+// Create a limiter of byte_rate bytes and op_rate data requests per second(0 for no limit)
+struct qos_bucket* qos_create(qos_alloc alloc, void* alloc_arg, long long byte_rate, long long op_rate);
+
+// Load the rates of copy_qos from a control file now, then again whenever the file changes or SIGHUP arrives
+// Every line of the file is "bwlimit=rate"(K, M or G suffix) or "iops=rate", 0 removes a limit
+// Return 0 if succeed, otherwise return -1(errno is set)
+int qos_set_control(const char* file);
+
+// Take the tokens of a data request of bytes bytes which has been done, and wait until the limiter
+// has them(the next request starts when the rates allow it)
+void qos_charge(off_t bytes, int ops);
+
+// Return the size of the next data request of at most length bytes
+size_t qos_chunk(size_t length);
+
+// Parse an I/O priority: idle, be[:level] or rt[:level](level 0 to 7, 0 is the highest), return -1 if invalid
+int parse_ioprio(const char* str);
+
+// Set the I/O priority of this process and of the processes it forks later
+// Return 0 if succeed, otherwise return -1(errno is set)
+int qos_set_ioprio(int ioprio);
+
+#endif
@@ -0,0 +1,194 @@
+// Instrumentation of the copy tools: counters, time per phase, latency histograms and a JSON report
+// Author: Noah Lin
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+#include "copy_stats.h"
+
+struct copy_stats* copy_stats = NULL;
+
+static unsigned long long run_start = 0;// Start of the run
+static unsigned long long last_progress = 0;// Last time the progress was printed
+
+static const char* counter_names[STATS_COUNTERS] = {"files", "dirs", "symlinks", "hardlinks", "unchanged", "resumed"};
+static const char* phase_names[PHASE_COUNT] = {"readdir", "open", "data", "close"};
+static const char* size_class_names[STATS_SIZE_CLASSES] = {"<4K", "<64K", "<1M", "<16M", "<256M", ">=256M"};
+
+// Return a monotonic time in nanoseconds
+static unsigned long long monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Return a monotonic time in nanoseconds, or 0 if statistics are not collected
+unsigned long long stats_now(void)
+{
+    return copy_stats ? monotonic_ns() : 0;
+}
+
+// Increase a counter
+void stats_count(int counter)
+{
+    if(copy_stats) {
+        copy_stats->counters[counter]++;
+    }
+}
+
+// Add the time since start to a phase and return the current time
+unsigned long long stats_phase(int phase, unsigned long long start)
+{
+    if(!copy_stats) {
+        return 0;
+    }
+    unsigned long long now = monotonic_ns();
+    copy_stats->phase_ns[phase] += now - start;
+    return now;
+}
+
+// Return the size class of a file
+static int size_class(off_t size)
+{
+    int class = 0;
+    off_t limit = 4096;
+    while(class < STATS_SIZE_CLASSES - 1 && size >= limit) {
+        class++;
+        limit *= 16;
+    }
+    return class;
+}
+
+// Record a file of size bytes of which bytes were written
+void stats_file(off_t size, off_t bytes, unsigned long long start)
+{
+    if(!copy_stats) {
+        return;
+    }
+    copy_stats->counters[STATS_FILES]++;
+    copy_stats->bytes += bytes;
+    if(start) {
+        unsigned long long us = (monotonic_ns() - start) / 1000;
+        int bucket = 0;
+        while(bucket < STATS_LATENCY_BUCKETS - 1 && us >= (1ULL << bucket)) {
+            bucket++;
+        }
+        copy_stats->latency[size_class(size)][bucket]++;
+    }
+}
+
+// Record bytes written without a file
+void stats_bytes(off_t bytes)
+{
+    if(copy_stats) {
+        copy_stats->bytes += bytes;
+    }
+}
+
+// Add the time since start to the time spent waiting for the I/O limiter
+void stats_throttled(unsigned long long start)
+{
+    if(copy_stats) {
+        copy_stats->throttled_ns += monotonic_ns() - start;
+    }
+}
+
+// Start collecting statistics into stats and remember the start time of the run
+void stats_start(struct copy_stats* stats)
+{
+    copy_stats = stats;
+    run_start = monotonic_ns();
+    last_progress = run_start;
+}
+
+// Print the live progress of the run to stderr
+void stats_progress(const struct copy_stats* total, int final)
+{
+    unsigned long long now = monotonic_ns();
+    if(!final && now - last_progress < STATS_INTERVAL_MS * 1000000ULL) {
+        return;
+    }
+    last_progress = now;
+    double seconds = (now - run_start) / 1e9;
+    double mib = total->bytes / 1048576.0;
+    // A terminal shows one line updated in place, a log gets a line per interval
+    fprintf(stderr, "%s%lu files, %lu dirs, %lu unchanged, %.1f MiB, %.1f MiB/s, %.1f s%s",
+        isatty(STDERR_FILENO) ? "\r" : "", total->counters[STATS_FILES], total->counters[STATS_DIRS],
+        total->counters[STATS_UNCHANGED], mib, seconds > 0 ? mib / seconds : 0.0, seconds,
+        final || !isatty(STDERR_FILENO) ? "\n" : "");
+}
+
+// Sum the statistics of count workers into total
+void stats_sum(struct copy_stats* total, const struct copy_stats* workers, int count)
+{
+    memset(total, 0, sizeof(struct copy_stats));
+    int i, j, k;
+    for(i = 0; i < count; i++) {
+        for(j = 0; j < STATS_COUNTERS; j++) {
+            total->counters[j] += workers[i].counters[j];
+        }
+        total->bytes += workers[i].bytes;
+        for(j = 0; j < PHASE_COUNT; j++) {
+            total->phase_ns[j] += workers[i].phase_ns[j];
+        }
+        for(j = 0; j < STATS_SIZE_CLASSES; j++) {
+            for(k = 0; k < STATS_LATENCY_BUCKETS; k++) {
+                total->latency[j][k] += workers[i].latency[j][k];
+            }
+        }
+        total->items += workers[i].items;
+        total->busy_ns += workers[i].busy_ns;
+        total->throttled_ns += workers[i].throttled_ns;
+    }
+}
+
+// Write the JSON report of a run to path("-" for stdout)
+int stats_write_json(const char* path, const char* tool, const struct copy_stats* total,
+    const struct copy_stats* workers, int count)
+{
+    FILE* file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if(!file) {
+        return -1;
+    }
+    double wall = (monotonic_ns() - run_start) / 1e9;
+    int i, j;
+    fprintf(file, "{\n  \"tool\": \"%s\",\n  \"wall_seconds\": %.6f,\n", tool, wall);
+    for(i = 0; i < STATS_COUNTERS; i++) {
+        fprintf(file, "  \"%s\": %lu,\n", counter_names[i], total->counters[i]);
+    }
+    fprintf(file, "  \"bytes\": %llu,\n  \"bytes_per_second\": %.0f,\n", total->bytes, wall > 0 ? total->bytes / wall : 0.0);
+    fprintf(file, "  \"throttled_seconds\": %.6f,\n", total->throttled_ns / 1e9);
+    fprintf(file, "  \"phase_seconds\": {");
+    for(i = 0; i < PHASE_COUNT; i++) {
+        fprintf(file, "%s\"%s\": %.6f", i ? ", " : "", phase_names[i], total->phase_ns[i] / 1e9);
+    }
+    // Buckets are listed up to the last used one, bucket i counts latencies below 2^i microseconds
+    fprintf(file, "},\n  \"latency_us_log2_buckets\": {");
+    for(i = 0; i < STATS_SIZE_CLASSES; i++) {
+        int used = STATS_LATENCY_BUCKETS;
+        while(used > 0 && total->latency[i][used - 1] == 0) {
+            used--;
+        }
+        fprintf(file, "%s\n    \"%s\": [", i ? "," : "", size_class_names[i]);
+        for(j = 0; j < used; j++) {
+            fprintf(file, "%s%lu", j ? ", " : "", total->latency[i][j]);
+        }
+        fprintf(file, "]");
+    }
+    fprintf(file, "\n  }");
+    if(count > 0) {
+        fprintf(file, ",\n  \"workers\": [");
+        for(i = 0; i < count; i++) {
+            fprintf(file, "%s\n    {\"worker\": %d, \"items\": %lu, \"busy_seconds\": %.6f, \"utilization\": %.3f}",
+                i ? "," : "", i, workers[i].items, workers[i].busy_ns / 1e9,
+                wall > 0 ? workers[i].busy_ns / 1e9 / wall : 0.0);
+        }
+        fprintf(file, "\n  ]");
+    }
+    fprintf(file, "\n}\n");
+    if(file == stdout) {
+        return fflush(file) == 0 ? 0 : -1;
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
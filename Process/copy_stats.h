@@ -0,0 +1,79 @@
+// Instrumentation of the copy tools: counters, time per phase, latency histograms and a JSON report
+// Author: Noah Lin
+#ifndef COPY_STATS_H
+#define COPY_STATS_H
+
+#include <sys/types.h>
+
+#define STATS_SIZE_CLASSES 6// File sizes: <4K, <64K, <1M, <16M, <256M, larger
+#define STATS_LATENCY_BUCKETS 32// Bucket i counts latencies below 2^i microseconds, the last one counts the rest
+#define STATS_INTERVAL_MS 1000// Interval of the live progress
+
+// Counters
+enum stats_counter {
+    STATS_FILES = 0,// Regular files copied or updated
+    STATS_DIRS,
+    STATS_SYMLINKS,
+    STATS_HARDLINKS,// Names linked to an inode copied before
+    STATS_UNCHANGED,// Targets found up to date by an incremental run
+    STATS_RESUMED,// Files completed by an interrupted run, skipped by the journal
+    STATS_COUNTERS
+};
+
+// Phases of a copy, the time of every phase is summed over all files(overlapping files of io_uring included)
+enum stats_phase {
+    PHASE_READDIR = 0,// getdents64()
+    PHASE_OPEN,// mkdir and opening directories and files
+    PHASE_DATA,// Copying, comparing and cloning data
+    PHASE_CLOSE,
+    PHASE_COUNT
+};
+
+// Statistics of a process(of a worker in copydir_mp)
+struct copy_stats {
+    unsigned long counters[STATS_COUNTERS];
+    unsigned long long bytes;// Bytes written to targets(or cloned)
+    unsigned long long phase_ns[PHASE_COUNT];
+    unsigned long latency[STATS_SIZE_CLASSES][STATS_LATENCY_BUCKETS];// Time from opening to closing a file
+    unsigned long items;// Work items handled by a worker
+    unsigned long long busy_ns;// Time a worker spent on work items
+    unsigned long long throttled_ns;// Time spent waiting for the I/O limiter
+};
+
+extern struct copy_stats* copy_stats;// Statistics of this process, NULL if they are not collected
+
+// Return a monotonic time in nanoseconds, or 0 if statistics are not collected
+unsigned long long stats_now(void);
+
+// Increase a counter
+void stats_count(int counter);
+
+// Add the time since start(from stats_now()) to a phase and return the current time
+unsigned long long stats_phase(int phase, unsigned long long start);
+
+// Record a file of size bytes of which bytes were written, start is the time it was opened(0 if its latency
+// should not be recorded, e.g. a file split into ranges)
+void stats_file(off_t size, off_t bytes, unsigned long long start);
+
+// Record bytes written without a file(a range of a split file)
+void stats_bytes(off_t bytes);
+
+// Add the time since start(from stats_now()) to the time spent waiting for the I/O limiter
+void stats_throttled(unsigned long long start);
+
+// Start collecting statistics into stats(NULL in a process which only reports them) and remember the start
+// time of the run
+void stats_start(struct copy_stats* stats);
+
+// Print the live progress of the run to stderr, at most once per STATS_INTERVAL_MS unless final is not 0
+void stats_progress(const struct copy_stats* total, int final);
+
+// Sum the statistics of count workers into total
+void stats_sum(struct copy_stats* total, const struct copy_stats* workers, int count);
+
+// Write the JSON report of a run to path("-" for stdout), workers are listed if count is not 0
+// Return 0 if succeed, otherwise return -1
+int stats_write_json(const char* path, const char* tool, const struct copy_stats* total,
+    const struct copy_stats* workers, int count);
+
+#endif
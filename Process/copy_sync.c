@@ -0,0 +1,209 @@
+// Incremental sync: skip up to date targets and rewrite only the changed blocks of changed files
+// Both trees are local, so a block is compared at the same offset of the source and the target: a block moved
+// inside a file has to be written at its new offset anyway, so searching the old file for it(like rsync does
+// for a remote target) would not save a write
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include "copy_engine.h"
+#include "copy_sync.h"
+#include "copy_stats.h"
+#include "copy_verify.h"
+#include "copy_attr.h"
+#include "copy_journal.h"
+#include "copy_qos.h"
+
+// Check whether a target is up to date: same size and modification time
+int target_up_to_date(const struct stat* source_stat, const struct stat* target_stat)
+{
+    if(copy_opts.checksum) { // Do not trust the metadata, compare the content
+        return 0;
+    }
+    return source_stat->st_size == target_stat->st_size
+        && source_stat->st_mtim.tv_sec == target_stat->st_mtim.tv_sec
+        && source_stat->st_mtim.tv_nsec == target_stat->st_mtim.tv_nsec;
+}
+
+// Read up to size bytes at offset, return the number of bytes read(less than size only at the end of the file)
+static ssize_t pread_full(int fd, char* buffer, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while(done < size) {
+        ssize_t len = pread(fd, buffer + done, size - done, offset + done);
+        if(len == -1 && errno == EINTR) {
+            continue;
+        }
+        if(len == -1) {
+            return -1;
+        }
+        if(len == 0) {
+            break;
+        }
+        done += len;
+    }
+    return done;
+}
+
+// Write size bytes at offset, return 0 if succeed, otherwise return -1
+static int pwrite_full(int fd, const char* buffer, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while(done < size) {
+        ssize_t len = pwrite(fd, buffer + done, size - done, offset + done);
+        if(len == -1 && errno == EINTR) {
+            continue;
+        }
+        if(len == -1) {
+            return -1;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+// Compare a range of source_fd and target_fd block by block, and write the blocks which differ to target_fd
+int update_range(int source_fd, int target_fd, off_t offset, off_t length, off_t* written, uint32_t* crc)
+{
+    char* source_buffer = malloc(SYNC_BLOCK_SIZE);
+    char* target_buffer = malloc(SYNC_BLOCK_SIZE);
+    off_t bytes = 0;
+    int ret = -1;
+    if(!source_buffer || !target_buffer) {
+        goto out;
+    }
+    off_t end = offset + length;
+    while(offset < end) {
+        size_t want = end - offset < SYNC_BLOCK_SIZE ? end - offset : SYNC_BLOCK_SIZE;
+        ssize_t len = pread_full(source_fd, source_buffer, want, offset);
+        if(len == -1) {
+            goto out;
+        }
+        if(len == 0) { // The source became shorter
+            break;
+        }
+        if(crc) {
+            *crc = crc32c(*crc, source_buffer, len);
+        }
+        ssize_t target_len = pread_full(target_fd, target_buffer, len, offset);
+        if(target_len == -1) {
+            goto out;
+        }
+        qos_charge(len + target_len, 2);// Both files are read, a changed block is written once more
+        if(target_len != len || memcmp(source_buffer, target_buffer, len) != 0) { // Changed block
+            if(pwrite_full(target_fd, source_buffer, len, offset) == -1) {
+                goto out;
+            }
+            qos_charge(len, 1);
+            bytes += len;
+        }
+        offset += len;
+    }
+    ret = 0;
+out:
+    free(source_buffer);
+    free(target_buffer);
+    if(written) {
+        *written = bytes;
+    }
+    return ret;
+}
+
+// Set the modification time of a target to the one of its source
+int keep_mtime(int target_fd, const struct stat* source_stat)
+{
+    struct timespec times[2];
+    times[0].tv_nsec = UTIME_OMIT;// Access time is not compared
+    times[1] = source_stat->st_mtim;
+    return futimens(target_fd, times);
+}
+
+// Bring an existing regular target file up to date, exit if an error occurs
+// In the preserve mode the attributes of an up to date target are brought in line without opening it
+int update_file_at(int source_dirfd, const char* source_file, const struct stat* source_stat,
+    int target_dirfd, const char* target_file, const struct stat* target_stat, const char* label)
+{
+    if(target_up_to_date(source_stat, target_stat)) {
+        if(copy_opts.verbose) {
+            printf("%s [up to date]\n", label);
+        }
+        stats_count(STATS_UNCHANGED);
+        verify_unchanged(source_dirfd, source_file, source_stat, label);
+        if(copy_opts.preserve && preserve_unchanged(target_dirfd, target_file, source_stat, target_stat) == -1) { // ERROR
+            printf("Can not preserve the attributes of a file!\n");
+            perror(label);
+            exit(-1);
+        }
+        journal_record(target_dirfd, label, source_stat->st_size, &source_stat->st_mtim, NULL);
+        return 1;
+    }
+    off_t size = source_stat->st_size;
+    // Comparing costs a read of the target, copying a small file again is cheaper unless only the content
+    // is in doubt; holes of a sparse source would be filled by writing its blocks
+    if(target_stat->st_size == 0 || file_is_sparse(source_stat)
+        || (size < SYNC_THRESHOLD && !(copy_opts.checksum && size == target_stat->st_size))) {
+        return 0;
+    }
+    unsigned long long start = stats_now();
+    int source_fd = openat(source_dirfd, source_file, O_RDONLY);
+    if(source_fd == -1) { // ERROR
+        printf("Can not open a source file!\n");
+        perror(label);
+        exit(-1);
+    }
+    int target_fd = openat(target_dirfd, target_file, O_RDWR | O_NOFOLLOW);
+    if(target_fd == -1) { //ERROR
+        printf("Can not open a target file!\n");
+        perror(label);
+        close(source_fd);
+        exit(-1);
+    }
+    unsigned long long mark = stats_phase(PHASE_OPEN, start);
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(target_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    off_t written = 0;
+    uint32_t crc = 0;
+    // Cut a longer target first, so only the common part is compared
+    if((target_stat->st_size > size && ftruncate(target_fd, size) == -1)
+        || update_range(source_fd, target_fd, 0, size, &written, copy_opts.verify ? &crc : NULL) == -1
+        || ftruncate(target_fd, size) == -1 || keep_mtime(target_fd, source_stat) == -1) { // ERROR
+        printf("An error occurs when updating a file!\n");
+        perror(label);
+        close(source_fd);
+        close(target_fd);
+        exit(-1);
+    }
+    if(copy_opts.verify == VERIFY_READBACK) {
+        verify_range(target_fd, 0, size, crc, label);
+    }
+    if(copy_opts.verify) {
+        manifest_record(label, size, &source_stat->st_mtim, crc);
+    }
+    if(copy_opts.preserve && preserve_fd(source_fd, target_fd, source_stat) == -1) { // ERROR
+        printf("Can not preserve the attributes of a file!\n");
+        perror(label);
+        close(source_fd);
+        close(target_fd);
+        exit(-1);
+    }
+    // Blocks are rewritten in place, an interrupted update leaves the old modification time, so it is compared again
+    journal_record(target_dirfd, label, size, &source_stat->st_mtim, copy_opts.verify ? &crc : NULL);
+    mark = stats_phase(PHASE_DATA, mark);
+    if(copy_opts.verbose && copy_opts.verify) {
+        printf("%s [update: %lld of %lld bytes written] [crc32c: %08x]\n", label, (long long)written,
+            (long long)size, crc);
+    }
+    else if(copy_opts.verbose) {
+        printf("%s [update: %lld of %lld bytes written]\n", label, (long long)written, (long long)size);
+    }
+    close(source_fd);
+    close(target_fd);
+    stats_phase(PHASE_CLOSE, mark);
+    stats_file(size, written, start);
+    return 1;
+}
@@ -0,0 +1,35 @@
+// Incremental sync: skip up to date targets and rewrite only the changed blocks of changed files
+// Author: Noah Lin
+#ifndef COPY_SYNC_H
+#define COPY_SYNC_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define SYNC_BLOCK_SIZE (256 * 1024)// Blocks compared between the source and the target
+#define SYNC_THRESHOLD (1L << 20)// Changed files smaller than this are copied again instead of compared
+
+// Check whether a target is up to date: same size and modification time(never if copy_opts.checksum is set,
+// then the content is compared)
+int target_up_to_date(const struct stat* source_stat, const struct stat* target_stat);
+
+// Compare length bytes at offset of source_fd and target_fd block by block, and write the blocks which differ
+// to target_fd, *written(if not NULL) is set to the number of bytes written, *crc(if not NULL) is extended by
+// the CRC32C of the source range
+// Return 0 if succeed, otherwise return -1(errno is set)
+int update_range(int source_fd, int target_fd, off_t offset, off_t length, off_t* written, uint32_t* crc);
+
+// Set the modification time of a target to the one of its source, so the next incremental run can compare them
+// Return 0 if succeed, otherwise return -1
+int keep_mtime(int target_fd, const struct stat* source_stat);
+
+// Bring an existing regular target file up to date, exit if an error occurs
+// In a verify mode an up to date file keeps the hash of an earlier manifest, a compared file is hashed on the way
+// Return 1 if the target is up to date(it was already, or its changed blocks have been rewritten),
+// return 0 if the file should be copied again(the target is small or empty, or the source is sparse)
+// label is the path shown in reports and error messages
+int update_file_at(int source_dirfd, const char* source_file, const struct stat* source_stat,
+    int target_dirfd, const char* target_file, const struct stat* target_stat, const char* label);
+
+#endif
@@ -0,0 +1,559 @@
+// io_uring copy engine: keeps many openat/read/write/close operations of small files in flight
+// Every file slot owns two fixed files(source and target, opened as direct descriptors) and one registered buffer,
+// a file walks through open -> read -> write -> ... -> close, and all slots are submitted in one io_uring_enter()
+// The source is statx()ed together with the opens, a sparse file is handed over to copy_file_at() to keep its holes
+// In a verify mode every read is hashed in its registered buffer before it is written, reads of a file are sequential
+// The rings are used through the raw system calls, so liburing is not needed
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include "copy_engine.h"
+#include "copy_uring.h"
+#include "copy_stats.h"
+#include "copy_verify.h"
+#include "copy_attr.h"
+#include "copy_journal.h"
+#include "copy_qos.h"
+
+#define RING_ENTRIES (URING_FILES * 4)// A file slot has at most three operations in flight
+
+// States of a file slot
+enum slot_state {
+    SLOT_FREE = 0,
+    SLOT_OPEN,// Opening the source and the target
+    SLOT_READ,
+    SLOT_WRITE,
+    SLOT_CLOSE// Closing the source and the target
+};
+
+// Kinds of operations, stored in the user data of every SQE together with the slot index
+enum op_kind {
+    OP_OPEN_SOURCE = 1,
+    OP_OPEN_TARGET,
+    OP_READ,
+    OP_WRITE,
+    OP_CLOSE,
+    OP_STATX
+};
+
+struct uring_slot {
+    int state;
+    int waiting;// Operations in flight
+    int handoff;// The file is sparse, copy it by copy_file_at() after the direct descriptors are closed
+    int reopen;// The target existed, it has been checked and is opened again without O_EXCL
+    int source_dirfd;
+    int target_dirfd;
+    char* source_file;
+    char* target_file;
+    char* written_file;// Name the data is written to, a temporary name in the journal mode(else target_file)
+    char* label;// NULL if the file names are shown
+    struct statx source_stat;
+    off_t offset;// Offset of the next read
+    unsigned int length;// Bytes in the buffer
+    unsigned int written;// Bytes of the buffer already written
+    uint32_t crc;// CRC32C of the data read so far, in a verify mode
+    unsigned long long start;// Time the file was queued, for statistics
+    unsigned long long mark;// Start of the current phase
+};
+
+struct uring_engine {
+    int ring_fd;
+    // Submission queue
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int to_submit;
+    // Completion queue
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    unsigned int sq_entries;
+    char* buffers;// One registered buffer per slot
+    struct uring_slot slots[URING_FILES];
+    int in_flight;// Slots not free
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Get a zeroed SQE, the ring never overflows because a slot has at most three operations in flight
+static struct io_uring_sqe* get_sqe(struct uring_engine* engine)
+{
+    unsigned int tail = *engine->sq_tail;
+    unsigned int index = tail & *engine->sq_mask;
+    struct io_uring_sqe* sqe = &engine->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    engine->sq_array[index] = index;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    engine->to_submit++;
+    return sqe;
+}
+
+// Queue an operation on a slot
+static void prep_open(struct uring_engine* engine, int slot, int kind, int dirfd, const char* path)
+{
+    struct io_uring_sqe* sqe = get_sqe(engine);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long)path;
+    if(kind == OP_OPEN_SOURCE) {
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = slot * 2 + 1;// Direct descriptor, 1 based
+    }
+    else {
+        // A new target is created at once, an existing one is checked by handle_cqe() before it is opened
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | (engine->slots[slot].reopen ? 0 : O_EXCL);
+        sqe->len = 0644;// Mode
+        sqe->file_index = slot * 2 + 2;
+    }
+    sqe->user_data = ((unsigned long)slot << 8) | kind;
+    engine->slots[slot].waiting++;
+}
+
+static void prep_statx(struct uring_engine* engine, int slot)
+{
+    struct uring_slot* s = &engine->slots[slot];
+    struct io_uring_sqe* sqe = get_sqe(engine);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = s->source_dirfd;
+    sqe->addr = (unsigned long)s->source_file;
+    sqe->len = STATX_SIZE | STATX_BLOCKS | STATX_MTIME;// Mask
+    sqe->off = (unsigned long)&s->source_stat;
+    sqe->user_data = ((unsigned long)slot << 8) | OP_STATX;
+    s->waiting++;
+}
+
+static void prep_rw(struct uring_engine* engine, int slot, int kind)
+{
+    struct uring_slot* s = &engine->slots[slot];
+    struct io_uring_sqe* sqe = get_sqe(engine);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->buf_index = slot;
+    if(kind == OP_READ) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = slot * 2;
+        sqe->addr = (unsigned long)(engine->buffers + (size_t)slot * URING_BUFFER_SIZE);
+        sqe->len = URING_BUFFER_SIZE;
+        sqe->off = s->offset;
+    }
+    else {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = slot * 2 + 1;
+        sqe->addr = (unsigned long)(engine->buffers + (size_t)slot * URING_BUFFER_SIZE + s->written);
+        sqe->len = s->length - s->written;
+        sqe->off = s->offset - s->length + s->written;
+    }
+    sqe->user_data = ((unsigned long)slot << 8) | kind;
+    s->waiting++;
+}
+
+static void prep_close(struct uring_engine* engine, int slot, int file_index)
+{
+    struct io_uring_sqe* sqe = get_sqe(engine);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = file_index;
+    sqe->user_data = ((unsigned long)slot << 8) | OP_CLOSE;
+    engine->slots[slot].waiting++;
+}
+
+// Report an error of a file and exit, like copy_file()
+static void slot_error(struct uring_slot* s, int kind, int err)
+{
+    if(kind == OP_OPEN_SOURCE) {
+        printf("Can not open a source file!\n");
+    }
+    else if(kind == OP_OPEN_TARGET) {
+        printf("Can not open a target file!\n");
+    }
+    else {
+        printf("An error occurs when copying a file!\n");
+    }
+    errno = err;
+    perror(s->label ? s->label : kind == OP_OPEN_TARGET ? s->target_file : s->source_file);// ERROR information
+    exit(-1);
+}
+
+// Handle a completion
+static void handle_cqe(struct uring_engine* engine, struct io_uring_cqe* cqe)
+{
+    int slot = cqe->user_data >> 8;
+    int kind = cqe->user_data & 0xff;
+    struct uring_slot* s = &engine->slots[slot];
+    s->waiting--;
+    if(kind == OP_OPEN_TARGET && (cqe->res == -EEXIST || cqe->res == -ELOOP) && !s->reopen) {
+        // Replace a target which is not a regular file, never write through a symbolic link
+        if(remove_special_at(s->target_dirfd, s->written_file) == -1) {
+            slot_error(s, kind, errno);
+        }
+        s->reopen = 1;
+        prep_open(engine, slot, OP_OPEN_TARGET, s->target_dirfd, s->written_file);
+        return;
+    }
+    if(cqe->res < 0) {
+        slot_error(s, kind, -cqe->res);
+    }
+    switch(kind) {
+        case OP_OPEN_SOURCE:
+        case OP_OPEN_TARGET:
+        case OP_STATX:
+            if(kind == OP_STATX && (off_t)s->source_stat.stx_blocks * 512 < (off_t)s->source_stat.stx_size) {
+                s->handoff = 1;// Sparse file, reading it here would fill its holes in the target
+            }
+            if(s->waiting == 0 && s->handoff) { // Both files are open, release them for copy_file_at()
+                s->state = SLOT_CLOSE;
+                prep_close(engine, slot, slot * 2 + 1);
+                prep_close(engine, slot, slot * 2 + 2);
+            }
+            else if(s->waiting == 0) { // Both files are open
+                s->mark = stats_phase(PHASE_OPEN, s->mark);
+                s->state = SLOT_READ;
+                prep_rw(engine, slot, OP_READ);
+            }
+            break;
+        case OP_READ:
+            if(cqe->res == 0) { // End of the source file
+                s->mark = stats_phase(PHASE_DATA, s->mark);
+                s->state = SLOT_CLOSE;
+                prep_close(engine, slot, slot * 2 + 1);
+                prep_close(engine, slot, slot * 2 + 2);
+            }
+            else {
+                if(copy_opts.verify) {
+                    s->crc = crc32c(s->crc, engine->buffers + (size_t)slot * URING_BUFFER_SIZE, cqe->res);
+                }
+                qos_charge(cqe->res, 1);// The write is queued when the limiter allows it
+                s->length = cqe->res;
+                s->written = 0;
+                s->offset += cqe->res;
+                s->state = SLOT_WRITE;
+                prep_rw(engine, slot, OP_WRITE);
+            }
+            break;
+        case OP_WRITE:
+            s->written += cqe->res;
+            if(s->written < s->length) { // Short write
+                prep_rw(engine, slot, OP_WRITE);
+            }
+            else {
+                s->state = SLOT_READ;
+                prep_rw(engine, slot, OP_READ);
+            }
+            break;
+        case OP_CLOSE:
+            if(s->waiting == 0 && s->handoff) { // Copy the sparse file by the sync engine
+                copy_file_at(s->source_dirfd, s->source_file, s->target_dirfd, s->target_file, s->label);
+            }
+            else if(s->waiting == 0 && copy_opts.verbose && s->label && copy_opts.verify) {
+                printf("%s [io_uring] [crc32c: %08x]\n", s->label, s->crc);
+            }
+            else if(s->waiting == 0 && copy_opts.verbose && s->label) { // Report the data path this file took
+                printf("%s [io_uring]\n", s->label);
+            }
+            else if(s->waiting == 0 && copy_opts.verbose) {
+                printf("%s -> %s [io_uring]\n", s->source_file, s->target_file);
+            }
+            if(s->waiting == 0 && !s->handoff && copy_opts.verify == VERIFY_READBACK) { // The direct descriptor is closed
+                int target_fd = openat(s->target_dirfd, s->written_file, O_RDONLY);
+                if(target_fd == -1) { // ERROR
+                    printf("Can not read back a target file!\n");
+                    perror(s->label ? s->label : s->target_file);
+                    exit(-1);
+                }
+                verify_range(target_fd, 0, s->offset, s->crc, s->label ? s->label : s->target_file);
+                close(target_fd);
+            }
+            if(s->waiting == 0 && !s->handoff && copy_opts.incremental) { // Keep the source mtime for the next run
+                struct timespec times[2];
+                times[0].tv_nsec = UTIME_OMIT;
+                times[1].tv_sec = s->source_stat.stx_mtime.tv_sec;
+                times[1].tv_nsec = s->source_stat.stx_mtime.tv_nsec;
+                if(utimensat(s->target_dirfd, s->written_file, times, 0) == -1) { // ERROR
+                    printf("An error occurs when copying a file!\n");
+                    perror(s->label ? s->label : s->source_file);
+                    exit(-1);
+                }
+            }
+            if(s->waiting == 0 && !s->handoff && copy_opts.preserve) { // Direct descriptors can not be used by fchmod()
+                int source_fd = openat(s->source_dirfd, s->source_file, O_RDONLY);
+                int target_fd = openat(s->target_dirfd, s->written_file, O_RDONLY);
+                struct stat stat_buf;
+                if(source_fd == -1 || target_fd == -1 || fstat(source_fd, &stat_buf) == -1
+                    || preserve_fd(source_fd, target_fd, &stat_buf) == -1) { // ERROR
+                    printf("Can not preserve the attributes of a file!\n");
+                    perror(s->label ? s->label : s->target_file);
+                    exit(-1);
+                }
+                close(source_fd);
+                close(target_fd);
+            }
+            if(s->waiting == 0 && !s->handoff && s->written_file != s->target_file) { // The file is complete
+                journal_commit(s->target_dirfd, s->written_file, s->target_file, s->label);
+            }
+            if(s->waiting == 0 && !s->handoff && (copy_opts.verify || copy_opts.journal)) {
+                struct timespec mtime = {s->source_stat.stx_mtime.tv_sec, s->source_stat.stx_mtime.tv_nsec};
+                manifest_record(s->label, s->offset, &mtime, s->crc);
+                journal_record(s->target_dirfd, s->label, s->offset, &mtime, copy_opts.verify ? &s->crc : NULL);
+            }
+            if(s->waiting == 0 && !s->handoff) { // copy_file_at() records a sparse file itself
+                stats_phase(PHASE_CLOSE, s->mark);
+                stats_file(s->source_stat.stx_size, s->offset, s->start);
+            }
+            if(s->waiting == 0) { // The copy is finished
+                free(s->source_file);
+                if(s->written_file != s->target_file) {
+                    free(s->written_file);
+                }
+                free(s->target_file);
+                free(s->label);
+                s->state = SLOT_FREE;
+                engine->in_flight--;
+            }
+            break;
+    }
+}
+
+// Submit queued operations and handle completions, wait for at least one completion if wait is not 0
+// Return 0 if succeed, otherwise return -1
+static int reap(struct uring_engine* engine, int wait)
+{
+    int ret;
+    do {
+        ret = sys_io_uring_enter(engine->ring_fd, engine->to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    } while(ret == -1 && errno == EINTR);
+    if(ret == -1) {
+        return -1;
+    }
+    engine->to_submit -= ret;
+    unsigned int head = *engine->cq_head;
+    while(head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = engine->cqes[head & *engine->cq_mask];
+        head++;
+        __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+        handle_cqe(engine, &cqe);
+    }
+    return 0;
+}
+
+// Map the rings of an io_uring instance, return 0 if succeed, otherwise return -1
+static int map_rings(struct uring_engine* engine, struct io_uring_params* params)
+{
+    engine->sq_map_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+    engine->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if(params->features & IORING_FEAT_SINGLE_MMAP) { // Both rings share one mapping
+        if(engine->cq_map_size > engine->sq_map_size) {
+            engine->sq_map_size = engine->cq_map_size;
+        }
+    }
+    engine->sq_map = mmap(NULL, engine->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        engine->ring_fd, IORING_OFF_SQ_RING);
+    if(engine->sq_map == MAP_FAILED) {
+        return -1;
+    }
+    if(params->features & IORING_FEAT_SINGLE_MMAP) {
+        engine->cq_map = engine->sq_map;
+    }
+    else {
+        engine->cq_map = mmap(NULL, engine->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            engine->ring_fd, IORING_OFF_CQ_RING);
+        if(engine->cq_map == MAP_FAILED) {
+            return -1;
+        }
+    }
+    engine->sq_entries = params->sq_entries;
+    engine->sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQES);
+    if(engine->sqes == MAP_FAILED) {
+        return -1;
+    }
+    char* sq = engine->sq_map;
+    char* cq = engine->cq_map;
+    engine->sq_head = (unsigned int*)(sq + params->sq_off.head);
+    engine->sq_tail = (unsigned int*)(sq + params->sq_off.tail);
+    engine->sq_mask = (unsigned int*)(sq + params->sq_off.ring_mask);
+    engine->sq_array = (unsigned int*)(sq + params->sq_off.array);
+    engine->cq_head = (unsigned int*)(cq + params->cq_off.head);
+    engine->cq_tail = (unsigned int*)(cq + params->cq_off.tail);
+    engine->cq_mask = (unsigned int*)(cq + params->cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+    return 0;
+}
+
+// Check that direct descriptors work by opening and closing the current directory in slot 0
+static int self_test(struct uring_engine* engine)
+{
+    struct io_uring_sqe* sqe = get_sqe(engine);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)".";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = get_sqe(engine);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    if(sys_io_uring_enter(engine->ring_fd, 2, 2, IORING_ENTER_GETEVENTS) != 2) {
+        return -1;
+    }
+    engine->to_submit = 0;
+    int ret = 0;
+    unsigned int head = *engine->cq_head;
+    while(head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+        if(engine->cqes[head & *engine->cq_mask].res < 0) {
+            ret = -1;
+        }
+        head++;
+    }
+    __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+    return ret;
+}
+
+// Create an io_uring engine, return NULL if the kernel does not support the needed io_uring features
+struct uring_engine* uring_engine_create(void)
+{
+    struct uring_engine* engine = calloc(1, sizeof(struct uring_engine));
+    if(!engine) {
+        return NULL;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    engine->ring_fd = sys_io_uring_setup(RING_ENTRIES, &params);
+    if(engine->ring_fd == -1) { // io_uring is not supported or disabled
+        free(engine);
+        return NULL;
+    }
+    if(map_rings(engine, &params) == -1) {
+        uring_engine_destroy(engine);
+        return NULL;
+    }
+    // Register one buffer per slot
+    engine->buffers = mmap(NULL, (size_t)URING_FILES * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(engine->buffers == MAP_FAILED) {
+        engine->buffers = NULL;
+        uring_engine_destroy(engine);
+        return NULL;
+    }
+    struct iovec iov[URING_FILES];
+    int files[URING_FILES * 2];
+    int i;
+    for(i = 0; i < URING_FILES; i++) {
+        iov[i].iov_base = engine->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+        files[i * 2] = -1;// Sparse fixed file table, filled by direct openat
+        files[i * 2 + 1] = -1;
+    }
+    if(sys_io_uring_register(engine->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_FILES) == -1
+        || sys_io_uring_register(engine->ring_fd, IORING_REGISTER_FILES, files, URING_FILES * 2) == -1
+        || self_test(engine) == -1) {
+        uring_engine_destroy(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+// Queue the copy of a regular file, wait for a free slot if all slots are in flight
+void uring_engine_add(struct uring_engine* engine, int source_dirfd, const char* source_file,
+    int target_dirfd, const char* target_file, const char* label)
+{
+    while(engine->in_flight == URING_FILES) {
+        if(reap(engine, 1) == -1) { // ERROR
+            perror("io_uring_enter");
+            exit(-1);
+        }
+    }
+    int slot;
+    for(slot = 0; engine->slots[slot].state != SLOT_FREE; slot++) {
+    }
+    struct uring_slot* s = &engine->slots[slot];
+    s->source_file = strdup(source_file);// Kept until the copy is finished
+    s->target_file = strdup(target_file);
+    // Files handed by the callers in the journal mode have one name, so they are written under a temporary one
+    char temp[PATH_MAX];
+    s->written_file = copy_opts.journal ? strdup(journal_temp_name(target_file, temp)) : s->target_file;
+    s->label = label ? strdup(label) : NULL;
+    if(!s->source_file || !s->target_file || !s->written_file || (label && !s->label)) { // ERROR
+        perror("strdup");
+        exit(-1);
+    }
+    s->offset = 0;
+    s->length = 0;
+    s->written = 0;
+    s->crc = 0;
+    s->waiting = 0;
+    s->handoff = 0;
+    s->reopen = 0;
+    s->source_dirfd = source_dirfd;
+    s->target_dirfd = target_dirfd;
+    s->start = stats_now();
+    s->mark = s->start;
+    s->state = SLOT_OPEN;
+    engine->in_flight++;
+    prep_open(engine, slot, OP_OPEN_SOURCE, source_dirfd, s->source_file);
+    prep_open(engine, slot, OP_OPEN_TARGET, target_dirfd, s->written_file);
+    prep_statx(engine, slot);
+    // Submit without waiting, so the operations start while the caller keeps reading the directory
+    if(reap(engine, 0) == -1) { // ERROR
+        perror("io_uring_enter");
+        exit(-1);
+    }
+}
+
+// Wait until every queued copy is finished
+void uring_engine_drain(struct uring_engine* engine)
+{
+    while(engine->in_flight > 0) {
+        if(reap(engine, 1) == -1) { // ERROR
+            perror("io_uring_enter");
+            exit(-1);
+        }
+    }
+}
+
+// Release an io_uring engine
+void uring_engine_destroy(struct uring_engine* engine)
+{
+    if(engine->buffers) {
+        munmap(engine->buffers, (size_t)URING_FILES * URING_BUFFER_SIZE);
+    }
+    if(engine->sqes && engine->sqes != MAP_FAILED) {
+        munmap(engine->sqes, engine->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if(engine->cq_map && engine->cq_map != MAP_FAILED && engine->cq_map != engine->sq_map) {
+        munmap(engine->cq_map, engine->cq_map_size);
+    }
+    if(engine->sq_map && engine->sq_map != MAP_FAILED) {
+        munmap(engine->sq_map, engine->sq_map_size);
+    }
+    close(engine->ring_fd);
+    free(engine);
+}
@@ -0,0 +1,29 @@
+// io_uring copy engine: keeps many openat/read/write/close operations of small files in flight
+// Author: Noah Lin
+#ifndef COPY_URING_H
+#define COPY_URING_H
+
+#define URING_FILES 64// Files in flight per ring
+#define URING_BUFFER_SIZE (128 * 1024)// Registered buffer of every file slot
+
+struct uring_engine;
+
+// Create an io_uring engine, return NULL if the kernel does not support the needed io_uring features
+// (the caller should then use copy_file())
+struct uring_engine* uring_engine_create(void);
+
+// Queue the copy of a regular file, wait for a free slot if all slots are in flight
+// source_dirfd and target_dirfd must stay open until uring_engine_drain() returns, exit if an error occurs
+// label is the path shown in reports and error messages(NULL to show the file names)
+// In the journal mode the file is written under its temporary name, so a file with several names(written in place)
+// must be copied by copy_file_at()
+void uring_engine_add(struct uring_engine* engine, int source_dirfd, const char* source_file,
+    int target_dirfd, const char* target_file, const char* label);
+
+// Wait until every queued copy is finished
+void uring_engine_drain(struct uring_engine* engine);
+
+// Release an io_uring engine
+void uring_engine_destroy(struct uring_engine* engine);
+
+#endif
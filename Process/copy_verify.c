@@ -0,0 +1,636 @@
+// Streamed verification: CRC32C of the data while it is copied, an optional read-back of the targets
+// and a manifest of the copied files
+// The kernel copy paths never show the data to user space, so a hashed copy moves it through a buffer: the
+// source is read once for both the copy and the hash, instead of hashing both trees again after the copy
+// CRC32C uses the SSE4.2 crc32 instruction when the CPU has it, otherwise a slicing-by-8 table
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include "copy_engine.h"
+#include "copy_verify.h"
+#include "copy_qos.h"
+
+#define CRC32C_POLY 0x82f63b78// Castagnoli polynomial, bit reflected
+
+struct manifest* copy_manifest = NULL;
+
+static uint32_t crc_table[8][256];// Slicing-by-8 tables of the software CRC32C
+static uint32_t x2n_table[32];// x^(2^n) modulo the polynomial, shifts a CRC over zero bytes
+static int crc_ready = 0;
+static int crc_hardware = 0;
+
+// Build the tables once per process
+static void crc_init(void)
+{
+    uint32_t n, k, crc;
+    for(n = 0; n < 256; n++) {
+        crc = n;
+        for(k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][n] = crc;
+    }
+    for(n = 0; n < 256; n++) {
+        for(k = 1; k < 8; k++) {
+            crc_table[k][n] = (crc_table[k - 1][n] >> 8) ^ crc_table[0][crc_table[k - 1][n] & 0xff];
+        }
+    }
+    uint32_t p = 1U << 30;// x^1
+    x2n_table[0] = p;
+    for(n = 1; n < 32; n++) {
+        uint32_t a = p, b = p, m = 1U << 31;
+        p = 0;
+        while(m) { // Multiply a by b modulo the polynomial
+            if(a & m) {
+                p ^= b;
+            }
+            m >>= 1;
+            b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+        }
+        x2n_table[n] = p;
+    }
+#if defined(__x86_64__)
+    crc_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+    crc_ready = 1;
+}
+
+#if defined(__x86_64__)
+// CRC32C by the crc32 instruction, 8 bytes per instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, size_t len)
+{
+    unsigned long long c = crc;
+    while(len > 0 && ((unsigned long)data & 7)) {
+        c = __builtin_ia32_crc32qi(c, *data++);
+        len--;
+    }
+    while(len >= 8) {
+        c = __builtin_ia32_crc32di(c, *(const unsigned long long*)data);
+        data += 8;
+        len -= 8;
+    }
+    while(len > 0) {
+        c = __builtin_ia32_crc32qi(c, *data++);
+        len--;
+    }
+    return c;
+}
+#endif
+
+// CRC32C by slicing-by-8 tables
+static uint32_t crc32c_software(uint32_t crc, const unsigned char* data, size_t len)
+{
+    while(len > 0 && ((unsigned long)data & 7)) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+    while(len >= 8) {
+        uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = crc_table[7][low & 0xff] ^ crc_table[6][(low >> 8) & 0xff] ^ crc_table[5][(low >> 16) & 0xff]
+            ^ crc_table[4][low >> 24] ^ crc_table[3][data[4]] ^ crc_table[2][data[5]]
+            ^ crc_table[1][data[6]] ^ crc_table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while(len > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+    return crc;
+}
+
+// Extend crc by the CRC32C of len bytes of data
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+    if(!crc_ready) {
+        crc_init();
+    }
+#if defined(__x86_64__)
+    if(crc_hardware) {
+        return ~crc32c_hardware(~crc, data, len);
+    }
+#endif
+    return ~crc32c_software(~crc, data, len);
+}
+
+// Multiply a by b modulo the polynomial
+static uint32_t mult_mod(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1U << 31;
+    uint32_t p = 0;
+    while(m) {
+        if(a & m) {
+            p ^= b;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// Shift a raw CRC register over len zero bytes: multiply it by x^(8 * len)
+static uint32_t shift_zeros(uint32_t crc, off_t len)
+{
+    if(!crc_ready) {
+        crc_init();
+    }
+    int k = 3;// 8 * len = len * 2^3
+    while(len > 0) {
+        if(len & 1) {
+            crc = mult_mod(x2n_table[k & 31], crc);
+        }
+        len >>= 1;
+        k++;
+    }
+    return crc;
+}
+
+// Extend crc by the CRC32C of len zero bytes without reading them
+uint32_t crc32c_zeros(uint32_t crc, off_t len)
+{
+    return ~shift_zeros(~crc, len);
+}
+
+// Return the CRC32C of the concatenation of two inputs from their CRCs
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t len2)
+{
+    return shift_zeros(crc1, len2) ^ crc2;
+}
+
+// Create a manifest, all memory comes from alloc
+struct manifest* manifest_create(manifest_alloc alloc, void* alloc_arg)
+{
+    struct manifest* manifest = alloc(sizeof(struct manifest), alloc_arg);
+    if(!manifest) {
+        return NULL;
+    }
+    manifest->buckets = alloc(sizeof(struct manifest_entry*) * MANIFEST_BUCKETS, alloc_arg);
+    if(!manifest->buckets) {
+        return NULL;
+    }
+    manifest->alloc = alloc;
+    manifest->alloc_arg = alloc_arg;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    int i;
+    for(i = 0; i < MANIFEST_LOCKS; i++) {
+        pthread_mutex_init(&manifest->locks[i], &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return manifest;
+}
+
+// Hash of a path(FNV-1a)
+static unsigned long hash_path(const char* path)
+{
+    unsigned long h = 0xcbf29ce484222325UL;
+    while(*path) {
+        h = (h ^ (unsigned char)*path++) * 0x100000001b3UL;
+    }
+    return (h ^ (h >> 29)) % MANIFEST_BUCKETS;
+}
+
+// Return the entry of a path with its bucket locked, a new entry is added if the path is unknown
+static struct manifest_entry* manifest_lock(struct manifest* manifest, const char* path, pthread_mutex_t** lock)
+{
+    unsigned long bucket = hash_path(path);
+    struct manifest_entry* entry;
+    *lock = &manifest->locks[bucket % MANIFEST_LOCKS];
+    pthread_mutex_lock(*lock);
+    for(entry = manifest->buckets[bucket]; entry; entry = entry->next) {
+        if(strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    size_t len = strlen(path);
+    entry = manifest->alloc(sizeof(struct manifest_entry) + len + 1, manifest->alloc_arg);
+    if(!entry) { // ERROR
+        pthread_mutex_unlock(*lock);
+        perror("manifest_lock()");
+        exit(-1);
+    }
+    char* copy = (char*)(entry + 1);
+    memcpy(copy, path, len + 1);
+    entry->path = copy;
+    entry->next = manifest->buckets[bucket];
+    manifest->buckets[bucket] = entry;
+    return entry;
+}
+
+// Load the manifest of an earlier run, a missing file is an empty manifest
+int manifest_load(struct manifest* manifest, const char* file)
+{
+    FILE* stream = fopen(file, "r");
+    if(!stream) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    // Every line is "crc size mtime path", backslashes and newlines of the path are escaped
+    while((len = getline(&line, &capacity, stream)) != -1) {
+        unsigned int crc;
+        long long size;
+        long long sec;
+        long nsec;
+        int consumed = 0;
+        if(line[0] == '#' || sscanf(line, "%8x %lld %lld.%9ld %n", &crc, &size, &sec, &nsec, &consumed) != 4
+            || consumed == 0) {
+            continue;// Comment or damaged line, the file is hashed again
+        }
+        char* in = line + consumed;
+        char* out = in;
+        while(*in && *in != '\n') {
+            if(*in == '\\' && in[1] == 'n') {
+                *out++ = '\n';
+                in += 2;
+            }
+            else if(*in == '\\' && in[1] == '\\') {
+                *out++ = '\\';
+                in += 2;
+            }
+            else {
+                *out++ = *in++;
+            }
+        }
+        *out = '\0';
+        pthread_mutex_t* lock;
+        struct manifest_entry* entry = manifest_lock(manifest, line + consumed, &lock);
+        entry->crc = crc;
+        entry->size = size;
+        entry->mtime.tv_sec = sec;
+        entry->mtime.tv_nsec = nsec;
+        entry->valid = 1;
+        pthread_mutex_unlock(lock);
+    }
+    free(line);
+    int ret = ferror(stream) ? -1 : 0;
+    fclose(stream);
+    return ret;
+}
+
+// Return the entry of a path, or NULL if the path is unknown(called when the workers have finished)
+static struct manifest_entry* manifest_find(struct manifest* manifest, const char* path)
+{
+    struct manifest_entry* entry;
+    for(entry = manifest->buckets[hash_path(path)]; entry; entry = entry->next) {
+        if(strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Order entries by path
+static int compare_entries(const void* a, const void* b)
+{
+    return strcmp((*(struct manifest_entry* const*)a)->path, (*(struct manifest_entry* const*)b)->path);
+}
+
+// Write the files recorded by this run to file, sorted by path
+int manifest_write(struct manifest* manifest, const char* file)
+{
+    size_t count = 0;
+    size_t capacity = 1024;
+    struct manifest_entry** entries = malloc(sizeof(struct manifest_entry*) * capacity);
+    unsigned long bucket;
+    struct manifest_entry* entry;
+    for(bucket = 0; entries && bucket < MANIFEST_BUCKETS; bucket++) {
+        for(entry = manifest->buckets[bucket]; entry; entry = entry->next) {
+            if(!entry->seen) {
+                continue;
+            }
+            if(entry->link) { // Another name of a hard-linked file, take the hash of the first name
+                struct manifest_entry* first = manifest_find(manifest, entry->link);
+                if(!first || !first->seen || !first->valid) { // The first name has no hash, this name is hashed by a later run
+                    continue;
+                }
+                entry->size = first->size;
+                entry->mtime = first->mtime;
+                entry->crc = first->crc;
+                entry->valid = 1;
+            }
+            if(count == capacity) {
+                struct manifest_entry** grown = realloc(entries, sizeof(struct manifest_entry*) * capacity * 2);
+                if(!grown) {
+                    free(entries);
+                    return -1;
+                }
+                entries = grown;
+                capacity *= 2;
+            }
+            entries[count++] = entry;
+        }
+    }
+    if(!entries) {
+        return -1;
+    }
+    qsort(entries, count, sizeof(struct manifest_entry*), compare_entries);
+    // Write a temporary file next to the manifest, an interrupted run leaves the old one intact
+    size_t len = strlen(file);
+    char* temp = malloc(len + 8);
+    FILE* stream = temp ? fopen(strcat(strcpy(temp, file), ".tmp"), "w") : NULL;
+    if(!stream) {
+        free(entries);
+        free(temp);
+        return -1;
+    }
+    fprintf(stream, "# copydir manifest 1: crc32c size mtime path\n");
+    size_t i;
+    for(i = 0; i < count; i++) {
+        const char* p;
+        fprintf(stream, "%08x %lld %lld.%09ld ", entries[i]->crc, (long long)entries[i]->size,
+            (long long)entries[i]->mtime.tv_sec, entries[i]->mtime.tv_nsec);
+        for(p = entries[i]->path; *p; p++) {
+            if(*p == '\n') {
+                fputs("\\n", stream);
+            }
+            else if(*p == '\\') {
+                fputs("\\\\", stream);
+            }
+            else {
+                putc(*p, stream);
+            }
+        }
+        putc('\n', stream);
+    }
+    free(entries);
+    int ret = fflush(stream) == 0 && fsync(fileno(stream)) == 0 ? 0 : -1;
+    if(fclose(stream) != 0 || ret == -1 || rename(temp, file) == -1) {
+        unlink(temp);
+        ret = -1;
+    }
+    free(temp);
+    return ret;
+}
+
+// Record the hash of a copied file into copy_manifest
+void manifest_record(const char* path, off_t size, const struct timespec* mtime, uint32_t crc)
+{
+    if(!copy_manifest || !path) {
+        return;
+    }
+    pthread_mutex_t* lock;
+    struct manifest_entry* entry = manifest_lock(copy_manifest, path, &lock);
+    entry->size = size;
+    entry->mtime = *mtime;
+    entry->crc = crc;
+    entry->valid = 1;
+    entry->seen = 1;
+    pthread_mutex_unlock(lock);
+}
+
+// Record another name of a hard-linked file
+void manifest_link(const char* path, const char* first_path)
+{
+    if(!copy_manifest || !path) {
+        return;
+    }
+    size_t len = strlen(first_path);
+    char* copy = copy_manifest->alloc(len + 1, copy_manifest->alloc_arg);// The link table may not be shared
+    if(!copy) { // ERROR
+        perror("manifest_link()");
+        exit(-1);
+    }
+    memcpy(copy, first_path, len + 1);
+    pthread_mutex_t* lock;
+    struct manifest_entry* entry = manifest_lock(copy_manifest, path, &lock);
+    entry->link = copy;
+    entry->seen = 1;
+    pthread_mutex_unlock(lock);
+}
+
+// Prepare the entry of a file split into ranges of chunk_size bytes
+void manifest_split(const char* path, const struct stat* source_stat, off_t chunk_size)
+{
+    if(!copy_manifest) {
+        return;
+    }
+    long count = (source_stat->st_size + chunk_size - 1) / chunk_size;
+    pthread_mutex_t* lock;
+    struct manifest_entry* entry = manifest_lock(copy_manifest, path, &lock);
+    // The ranges are pushed after this returns, so they always find the array
+    entry->chunks = copy_manifest->alloc(sizeof(uint32_t) * (count ? count : 1), copy_manifest->alloc_arg);
+    if(!entry->chunks) { // ERROR
+        pthread_mutex_unlock(lock);
+        perror("manifest_split()");
+        exit(-1);
+    }
+    entry->chunk_size = chunk_size;
+    entry->remaining = count;
+    entry->size = source_stat->st_size;
+    entry->mtime = source_stat->st_mtim;
+    entry->crc = 0;
+    entry->valid = count == 0;// An empty file is complete at once
+    entry->seen = count == 0;
+    pthread_mutex_unlock(lock);
+}
+
+// Record the hash of the range at offset of a split file
+void manifest_chunk(const char* path, off_t offset, uint32_t crc)
+{
+    if(!copy_manifest) {
+        return;
+    }
+    pthread_mutex_t* lock;
+    struct manifest_entry* entry = manifest_lock(copy_manifest, path, &lock);
+    pthread_mutex_unlock(lock);// The entry stays valid, every range writes its own slot
+    entry->chunks[offset / entry->chunk_size] = crc;
+    if(__atomic_sub_fetch(&entry->remaining, 1, __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+    // The last range combines the hashes in file order
+    uint32_t total = 0;
+    off_t pos;
+    for(pos = 0; pos < entry->size; pos += entry->chunk_size) {
+        off_t len = entry->size - pos < entry->chunk_size ? entry->size - pos : entry->chunk_size;
+        total = crc32c_combine(total, entry->chunks[pos / entry->chunk_size], len);
+    }
+    entry->crc = total;
+    entry->valid = 1;
+    entry->seen = 1;
+}
+
+// Find the next data extent in [pos, end) of fd, holes are only searched if sparse is not 0
+// Return 1 and set [*data, *hole) if an extent is found, return 0 if only a hole is left, -1 if an error occurs
+static int next_extent(int fd, off_t pos, off_t end, int sparse, off_t* data, off_t* hole)
+{
+    if(!sparse) {
+        *data = pos;
+        *hole = end;
+        return 1;
+    }
+    *data = lseek(fd, pos, SEEK_DATA);
+    if(*data == -1 && errno == ENXIO) {
+        return 0;
+    }
+    if(*data == -1 && (errno == EINVAL || errno == EOPNOTSUPP)) { // The filesystem can not report holes
+        *data = pos;
+        *hole = end;
+        return 1;
+    }
+    if(*data == -1 || (*data < end && (*hole = lseek(fd, *data, SEEK_HOLE)) == -1)) {
+        return -1;
+    }
+    if(*data >= end) {
+        return 0;
+    }
+    if(*hole > end) {
+        *hole = end;
+    }
+    return 1;
+}
+
+// Return the buffer of hashing, allocated once per process
+static char* hash_buffer(void)
+{
+    static char* buffer = NULL;
+    if(!buffer) {
+        buffer = malloc(COPY_BUFFER_SIZE);
+    }
+    return buffer;
+}
+
+// Hash [offset, offset + length) of fd into *crc, and write the data to the same offset of target_fd
+// unless it is -1, *data_bytes is set to the number of bytes read
+static int hash_extents(int fd, int target_fd, off_t offset, off_t length, uint32_t* crc, off_t* data_bytes)
+{
+    char* buffer = hash_buffer();
+    struct stat stat_buf;
+    if(!buffer || fstat(fd, &stat_buf) == -1) {
+        return -1;
+    }
+    int sparse = file_is_sparse(&stat_buf);
+    off_t end = offset + length;
+    off_t pos = offset;
+    *data_bytes = 0;
+    while(pos < end) {
+        off_t data;
+        off_t hole;
+        int found = next_extent(fd, pos, end, sparse, &data, &hole);
+        if(found == -1) {
+            return -1;
+        }
+        if(!found) { // The rest is a hole
+            data = hole = end;
+        }
+        *crc = crc32c_zeros(*crc, data - pos);
+        while(data < hole) {
+            size_t want = hole - data < COPY_BUFFER_SIZE ? hole - data : COPY_BUFFER_SIZE;
+            ssize_t read_bytes = pread(fd, buffer, want, data);
+            if(read_bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            if(read_bytes == -1) {
+                return -1;
+            }
+            if(read_bytes == 0) { // The file is shorter than expected
+                return 0;
+            }
+            *crc = crc32c(*crc, buffer, read_bytes);
+            qos_charge(read_bytes, 1);
+            ssize_t done = 0;
+            while(target_fd != -1 && done < read_bytes) { // Tackle with short writes
+                ssize_t write_bytes = pwrite(target_fd, buffer + done, read_bytes - done, data + done);
+                if(write_bytes == -1 && errno == EINTR) {
+                    continue;
+                }
+                if(write_bytes == -1) {
+                    return -1;
+                }
+                done += write_bytes;
+            }
+            data += read_bytes;
+            *data_bytes += read_bytes;
+        }
+        pos = hole;
+    }
+    return 0;
+}
+
+// Hash length bytes at offset of fd into *crc, holes are hashed as zeros without reading them
+int hash_range(int fd, off_t offset, off_t length, uint32_t* crc)
+{
+    off_t data_bytes;
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    return hash_extents(fd, -1, offset, length, crc, &data_bytes);
+}
+
+// Copy like copy_range(), but data is moved through a user space buffer and hashed on the way
+int copy_range_hashed(int source_fd, int target_fd, off_t offset, off_t length, uint32_t* crc, off_t* data_bytes)
+{
+    off_t data = 0;
+    if(reflink_usable()) {
+        int cloned = clone_range(source_fd, target_fd, offset, length);
+        if(cloned == 1 && hash_range(source_fd, offset, length, crc) == 0) { // The blocks are shared, hash the source
+            *data_bytes = 0;
+            return COPY_PATH_REFLINK;
+        }
+        if(cloned != 0) {
+            return -1;
+        }
+    }
+    if(hash_extents(source_fd, target_fd, offset, length, crc, &data) == -1) {
+        return -1;
+    }
+    *data_bytes = data;
+    return length ? COPY_PATH_BUFFERED : COPY_PATH_NONE;
+}
+
+// Read back length bytes at offset of a written target and compare their hash with crc, exit if an error occurs
+void verify_range(int target_fd, off_t offset, off_t length, uint32_t crc, const char* label)
+{
+    uint32_t target_crc = 0;
+    // Clean pages can be dropped, so the read has to come from the device instead of the copy just written
+    if(fdatasync(target_fd) == -1) { // ERROR
+        printf("Can not read back a target file!\n");
+        perror(label);
+        exit(-1);
+    }
+    posix_fadvise(target_fd, offset, length, POSIX_FADV_DONTNEED);
+    if(hash_range(target_fd, offset, length, &target_crc) == -1) { // ERROR
+        printf("Can not read back a target file!\n");
+        perror(label);
+        exit(-1);
+    }
+    if(target_crc != crc) { // ERROR
+        printf("A target file does not match its source!\n");
+        printf("%s: crc32c %08x, expected %08x\n", label, target_crc, crc);
+        exit(-1);
+    }
+}
+
+// Record an up to date file found by an incremental run
+void verify_unchanged(int source_dirfd, const char* source_file, const struct stat* source_stat, const char* label)
+{
+    if(!copy_manifest) {
+        return;
+    }
+    pthread_mutex_t* lock;
+    struct manifest_entry* entry = manifest_lock(copy_manifest, label, &lock);
+    if(entry->size == source_stat->st_size && entry->mtime.tv_sec == source_stat->st_mtim.tv_sec
+        && entry->mtime.tv_nsec == source_stat->st_mtim.tv_nsec && entry->valid) {
+        entry->seen = 1;// The hash of the earlier run is still valid
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    pthread_mutex_unlock(lock);
+    uint32_t crc = 0;
+    int source_fd = openat(source_dirfd, source_file, O_RDONLY);
+    if(source_fd == -1 || hash_range(source_fd, 0, source_stat->st_size, &crc) == -1) { // ERROR
+        printf("Can not hash a source file!\n");
+        perror(label);
+        exit(-1);
+    }
+    close(source_fd);
+    manifest_record(label, source_stat->st_size, &source_stat->st_mtim, crc);
+}
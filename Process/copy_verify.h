@@ -0,0 +1,94 @@
+// Streamed verification: CRC32C of the data while it is copied, an optional read-back of the targets
+// and a manifest of the copied files
+// Author: Noah Lin
+#ifndef COPY_VERIFY_H
+#define COPY_VERIFY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MANIFEST_BUCKETS (1UL << 18)// Hash buckets, chains grow beyond it
+#define MANIFEST_LOCKS 256// Bucket locks, a lock protects every MANIFEST_LOCKS-th bucket
+
+// Extend crc(0 for an empty input) by the CRC32C of len bytes of data
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+// Extend crc by the CRC32C of len zero bytes(a hole) without reading them
+uint32_t crc32c_zeros(uint32_t crc, off_t len);
+
+// Return the CRC32C of the concatenation of two inputs from their CRCs, len2 is the length of the second one
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t len2);
+
+// A file of the manifest
+struct manifest_entry {
+    const char* path;// Path relative to the roots
+    off_t size;
+    struct timespec mtime;// Modification time of the source the hash belongs to
+    uint32_t crc;
+    int valid;// crc belongs to size and mtime
+    int seen;// Recorded by this run, entries of removed files are not written again
+    uint32_t* chunks;// CRCs of the ranges of a split file, NULL if the file is not split
+    off_t chunk_size;
+    volatile long remaining;// Ranges not hashed yet
+    const char* link;// Path of the first name of a hard-linked file, its hash is written for this name too
+    struct manifest_entry* next;
+};
+
+// Allocate zeroed memory for the manifest, memory is never freed while the manifest is used
+typedef void* (*manifest_alloc)(size_t size, void* arg);
+
+struct manifest {
+    pthread_mutex_t locks[MANIFEST_LOCKS];// Process-shared, so the manifest can be filled by worker processes
+    struct manifest_entry** buckets;
+    manifest_alloc alloc;
+    void* alloc_arg;
+};
+
+extern struct manifest* copy_manifest;// Manifest of this run, NULL if copied files are not recorded
+
+// Create a manifest, all memory comes from alloc(use shared memory to share it by processes forked later)
+struct manifest* manifest_create(manifest_alloc alloc, void* alloc_arg);
+
+// Load the manifest of an earlier run, a missing file is an empty manifest
+// Return 0 if succeed, otherwise return -1
+int manifest_load(struct manifest* manifest, const char* file);
+
+// Write the files recorded by this run to file, sorted by path(replaced atomically by rename())
+// Return 0 if succeed, otherwise return -1
+int manifest_write(struct manifest* manifest, const char* file);
+
+// Record the hash of a copied file into copy_manifest(nothing if it or path is NULL)
+void manifest_record(const char* path, off_t size, const struct timespec* mtime, uint32_t crc);
+
+// Record another name of a hard-linked file, it is written with the size, time and hash of first_path
+void manifest_link(const char* path, const char* first_path);
+
+// Prepare the entry of a file split into ranges of chunk_size bytes, the ranges are recorded by manifest_chunk()
+void manifest_split(const char* path, const struct stat* source_stat, off_t chunk_size);
+
+// Record the hash of the range at offset of a split file, the hash of the file is combined when the last
+// range is recorded
+void manifest_chunk(const char* path, off_t offset, uint32_t crc);
+
+// Hash length bytes at offset of fd into *crc, holes are hashed as zeros without reading them
+// Return 0 if succeed, otherwise return -1(errno is set)
+int hash_range(int fd, off_t offset, off_t length, uint32_t* crc);
+
+// Copy like copy_range(), but data is moved through a user space buffer and hashed on the way(a cloned range
+// is hashed by reading the source), *crc is extended by the CRC32C of the range
+// Return the data path which finished the copy, or -1 if an error occurs(errno is set)
+int copy_range_hashed(int source_fd, int target_fd, off_t offset, off_t length, uint32_t* crc, off_t* data_bytes);
+
+// Read back length bytes at offset of a written target and compare their hash with crc, exit if an error occurs
+// or the target does not match(label is the path shown in error messages)
+// The target is flushed and dropped from the page cache first, so the data is read from the device
+void verify_range(int target_fd, off_t offset, off_t length, uint32_t crc, const char* label);
+
+// Record an up to date file found by an incremental run: the hash of an earlier manifest is kept if the
+// source has the same size and modification time, otherwise the source is hashed, exit if an error occurs
+void verify_unchanged(int source_dirfd, const char* source_file, const struct stat* source_stat, const char* label);
+
+#endif
@@ -1,129 +1,896 @@
 // A program coping a directory and its subdirectories by multiprocess
-// Compile: gcc -o copydir_mp copydir_mp.c
-// Use: ./copydir_mp <source directory> <target directory>
+// A fixed number of worker processes share the work: directories and files are pushed to per-worker deques,
+// and an idle worker steals work from the others
+// Compile: gcc -o copydir_mp copydir_mp.c copy_engine.c copy_uring.c dir_reader.c work_pool.c link_table.c copy_sync.c copy_stats.c copy_verify.c copy_attr.c copy_order.c copy_journal.c copy_qos.c -pthread
+// Use: ./copydir_mp [-v] [-u] [-j workers] [-e sync|uring] [-t threshold] [-c chunk] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>
+//      -v: report the data path(reflink, copy_file_range, sendfile, splice, buffered or io_uring) of every copied file
+//      -j: number of worker processes(default: number of online CPUs)
+//      -e: copy engine, sync(default) or uring(every worker owns a ring, falls back to sync if the kernel
+//          does not support io_uring)
+//      -t: files of at least this size(K, M or G suffix, default 256M, 0 disables) are split into ranges
+//          which are copied by all workers concurrently
+//      -c: size of a range(default 64M)
+//      --reflink: clone files with FICLONE(ranges with FICLONERANGE) instead of copying their data,
+//                 auto(default: clone if the filesystem supports it), always(fail if a file can not be cloned) or never
+//      -u: incremental mode: targets with the size and modification time of their sources are skipped, only the
+//          changed blocks of large changed files are written(ranges of split files are compared by all workers)
+//      --checksum: incremental mode comparing the content of every existing target instead of its modification time
+//      --verify: hash(CRC32C) the data of every file while it is copied, then read the target back and compare
+//                (every range of a split file is hashed and read back by the worker copying it)
+//      --manifest: hash the data of every file while it is copied and write a manifest(hash, size, modification
+//                  time and path of every file) to file, an incremental run keeps the hashes of unchanged files
+//      --preserve: keep the owner(as root), mode, timestamps and extended attributes(ACLs included) of every file,
+//                  directory and symbolic link, the last range of a split file applies them to it, directories get
+//                  their mode and timestamps after all workers finished, deepest first
+//      --order: order of the regular files of a directory, readdir(default), inode or extent(first physical
+//               block by FIEMAP), the files are pushed so the owning worker pops them in this order
+//      --journal: resumable copy, every worker appends its completed files to the journal file(at a checkpoint
+//                 every few seconds, after the target filesystem is flushed), files are written under a temporary
+//                 name(.name.copydir-part) and renamed when complete(the last range renames a split file), a run
+//                 restarted with the same journal skips the files completed by the interrupted one, the journal
+//                 is removed when the copy is complete
+//      --bwlimit: limit the data read and copied by all workers together to rate bytes per second(K, M or G suffix)
+//      --iops: limit the data requests(reads, writes and in-kernel copies of at most 1M) of all workers to rate
+//              per second
+//      --qos-control: load bwlimit=rate and iops=rate lines from file, it is loaded again when it changes(checked
+//                     every second) or on SIGHUP to the main process, so the limits can be changed while the copy runs
+//      --ioprio: I/O priority of all workers, idle(only served when the disk is otherwise idle), be[:level] or
+//                rt[:level](level 0 to 7, 0 is the highest), needs an I/O scheduler with priorities(BFQ)
+//      --nice: CPU nice value of all workers
+//      --progress: print the progress(files, directories, bytes and throughput) to stderr every second
+//      --stats: write a JSON report(counters, time per phase, latency histograms per file size and the
+//               utilization of every worker) to file("-" for stdout)
+//      Hard links are kept: a file with several names is copied once and its other names are linked to the copy,
+//      the table of copied inodes is shared by all workers
 // Author: Noah Lin
+#define _GNU_SOURCE
 #include <unistd.h>
+#include <getopt.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include "copy_engine.h"
+#include "copy_uring.h"
+#include "dir_reader.h"
+#include "work_pool.h"
+#include "link_table.h"
+#include "copy_sync.h"
+#include "copy_stats.h"
+#include "copy_verify.h"
+#include "copy_attr.h"
+#include "copy_order.h"
+#include "copy_journal.h"
+#include "copy_qos.h"
 
-void copy_file(const char* source_file, const char* target_file)
+#define DEQUE_CAPACITY (1UL << 20)// Work items per worker deque, a worker copies inline when its deque is full
+#define CHUNK_THRESHOLD (256L << 20)// Default size from which a file is split into ranges
+#define CHUNK_SIZE (64L << 20)// Default size of a range
+#define DIR_CACHE_SIZE 16// Directory pairs kept open by a worker
+#define CHUNK_UPDATE 1// Flag of a range of an existing target, only its changed blocks are written
+#define CHUNK_TEMP 2// Flag of a range written to the temporary name of its target(journal mode)
+
+// Root directories of the copy, opened before the workers are forked
+struct copy_roots {
+    int source_fd;
+    int target_fd;
+    int use_uring;
+    off_t chunk_threshold;// Files of at least this size are split into ranges, 0 if disabled
+    off_t chunk_size;
+    struct link_table* links;// First names of the source inodes with several names, in the shared arena
+    struct copy_stats* stats;// Statistics of every worker in the shared arena, NULL if they are not collected
+    int workers;
+    struct dir_attrs* dir_attrs;// Directories waiting for their mode and timestamps, in the shared arena
+};
+
+// A directory whose mode and timestamps are applied after the run, later writes into it would change them
+struct dir_attr {
+    const char* path;
+    struct stat source_stat;
+    int owner_kept;
+    struct dir_attr* next;
+};
+
+// Stack of directories pushed by all workers
+struct dir_attrs {
+    struct dir_attr* head;
+};
+
+// State shared by the ranges of a split file, the last range to finish applies the attributes of the source
+struct split_state {
+    volatile long remaining;// Ranges not finished yet
+    struct stat source_stat;
+};
+
+struct uring_engine* uring = NULL;// io_uring engine of this worker, created after fork because a ring can not be shared
+
+// An open pair of source and target directories, entries are resolved relative to them
+struct dir_pair {
+    const char* key;// Path of the directory item in the shared arena, NULL if the entry is empty
+    int source_fd;
+    int target_fd;
+};
+
+// Directory pairs of this worker, most work items of a worker come from the same few directories
+// because the worker pops its own deque newest first
+struct dir_pair dir_cache[DIR_CACHE_SIZE];
+int dir_cache_next = 0;// Next entry to replace
+
+// Add an open directory pair to the cache of this worker(the cache owns the file descriptors)
+struct dir_pair* dir_cache_put(const char* key, int source_fd, int target_fd)
+{
+    struct dir_pair* pair = &dir_cache[dir_cache_next];
+    dir_cache_next = (dir_cache_next + 1) % DIR_CACHE_SIZE;
+    if(pair->key) {
+        if(uring) { // Files in flight may be opened relative to the replaced directories
+            uring_engine_drain(uring);
+        }
+        close(pair->source_fd);
+        close(pair->target_fd);
+    }
+    pair->key = key;
+    pair->source_fd = source_fd;
+    pair->target_fd = target_fd;
+    return pair;
+}
+
+// Return the open pair of a directory, on a miss it is opened by its path relative to the roots(once per worker)
+struct dir_pair* dir_cache_get(struct copy_roots* roots, const char* dir_path)
+{
+    int i;
+    for(i = 0; i < DIR_CACHE_SIZE; i++) {
+        if(dir_cache[i].key == dir_path) {
+            return &dir_cache[i];
+        }
+    }
+    int source_fd = open_dir_path(roots->source_fd, dir_path);
+    int target_fd = open_dir_path(roots->target_fd, dir_path);
+    if(source_fd == -1 || target_fd == -1) { // ERROR
+        printf("Cannot open a directory\n");
+        perror(dir_path);
+        exit(-1);
+    }
+    return dir_cache_put(dir_path, source_fd, target_fd);
+}
+
+// Allocate zeroed memory for the link table and the manifest from the shared arena
+void* link_alloc_shared(size_t size, void* arg)
+{
+    return work_pool_alloc(arg, size);
+}
+
+// Join a relative directory path and an entry name into the shared arena
+char* join_path(struct work_pool* pool, const char* dir, const char* name)
+{
+    if(strcmp(dir, ".") == 0) { // Entries of the root directory
+        return work_pool_strdup(pool, name);
+    }
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char* path = work_pool_alloc(pool, dir_len + name_len + 2);
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+// Copy a range of a large file, the target file has been created and preallocated by split_file()
+void copy_chunk(struct copy_roots* roots, struct work_item* item)
 {
-    int source_fd = open(source_file, O_RDONLY);
+    struct dir_pair* dir = dir_cache_get(roots, item->parent);
+    unsigned long long start = stats_now();
+    int source_fd = openat(dir->source_fd, item->name, O_RDONLY);
     if(source_fd == -1) { // ERROR
         printf("Can not open a source file!\n");
-        close(source_fd);
+        perror(item->path);
         exit(-1);
     }
-    int target_fd = open(target_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int update = item->flags & CHUNK_UPDATE;
+    char temp[PATH_MAX];
+    const char* written_file = item->flags & CHUNK_TEMP ? journal_temp_name(item->name, temp) : item->name;
+    int target_fd = openat(dir->target_fd, written_file,
+        (update || copy_opts.verify == VERIFY_READBACK ? O_RDWR : O_WRONLY) | O_NOFOLLOW);
     if(target_fd == -1) { //ERROR
         printf("Can not open a target file!\n");
+        perror(item->path);
+        close(source_fd);
+        exit(-1);
+    }
+    unsigned long long mark = stats_phase(PHASE_OPEN, start);
+    off_t data_bytes;
+    uint32_t crc = 0;// Hash of this range, combined with the other ranges by the last one
+    int engine;
+    if(update) {
+        engine = update_range(source_fd, target_fd, item->offset, item->length, &data_bytes,
+            copy_opts.verify ? &crc : NULL);
+    }
+    else if(copy_opts.verify) {
+        engine = copy_range_hashed(source_fd, target_fd, item->offset, item->length, &crc, &data_bytes);
+    }
+    else {
+        engine = copy_range(source_fd, target_fd, item->offset, item->length, &data_bytes);
+    }
+    // Every range sets the modification time after its writes, so the last range to finish leaves the source one
+    struct stat stat_buf;
+    if(engine != -1 && copy_opts.incremental
+        && (fstat(source_fd, &stat_buf) == -1 || keep_mtime(target_fd, &stat_buf) == -1)) {
+        engine = -1;
+    }
+    if(engine == -1) { // ERROR
+        printf("An error occurs when copying a file!\n");
+        perror(item->path);// ERROR information
+        close(source_fd);
         close(target_fd);
         exit(-1);
     }
-    char buffer[4096];// Buffer of copying(copy 4096 bytes everytime)
-    ssize_t read_bytes;
-    // Keep reading and copying the source file until reaching the end
-    while((read_bytes = read(source_fd, buffer, sizeof(buffer))) > 0) { // read_bytes is the number of bytes actually read
-        ssize_t write_bytes = write(target_fd, buffer, read_bytes);
-        if(write_bytes == -1) { // ERROR
-            printf("An error occurs when writing a target file!\n");
-            printf("write");// ERROR information
+    if(copy_opts.verify == VERIFY_READBACK) {
+        verify_range(target_fd, item->offset, item->length, crc, item->path);
+    }
+    if(copy_opts.verify) {
+        manifest_chunk(item->path, item->offset, crc);
+    }
+    struct split_state* split = item->file;
+    if(split && __atomic_sub_fetch(&split->remaining, 1, __ATOMIC_SEQ_CST) == 0) { // The last range finishes the file
+        if(copy_opts.preserve && preserve_fd(source_fd, target_fd, &split->source_stat) == -1) { // ERROR
+            printf("Can not preserve the attributes of a file!\n");
+            perror(item->path);
+            exit(-1);
+        }
+        if(item->flags & CHUNK_TEMP) {
+            journal_commit(dir->target_fd, written_file, item->name, item->path);
+        }
+        journal_record(dir->target_fd, item->path, split->source_stat.st_size, &split->source_stat.st_mtim, NULL);
+    }
+    mark = stats_phase(PHASE_DATA, mark);
+    stats_bytes(data_bytes);
+    if(copy_opts.verbose && update) { // Report the bytes written of a compared range
+        printf("%s [%lld+%lld] [update: %lld of %lld bytes written]\n", item->path, (long long)item->offset,
+            (long long)item->length, (long long)data_bytes, (long long)item->length);
+    }
+    else if(copy_opts.verbose && data_bytes < item->length) { // Report the data path and the bytes read of a sparse range
+        printf("%s [%lld+%lld] [%s] [sparse: %lld of %lld bytes read]\n", item->path, (long long)item->offset,
+            (long long)item->length, copy_path_name(engine), (long long)data_bytes, (long long)item->length);
+    }
+    else if(copy_opts.verbose) { // Report the data path this range took
+        printf("%s [%lld+%lld] [%s]\n", item->path, (long long)item->offset, (long long)item->length,
+            copy_path_name(engine));
+    }
+    close(source_fd);
+    close(target_fd);
+    stats_phase(PHASE_CLOSE, mark);
+}
+
+// Create and preallocate the target of a large file, then push its ranges so idle workers can steal them
+// An existing target(target_stat is not NULL) is only resized, its ranges are compared instead of copied
+void split_file(struct work_pool* pool, int worker, struct copy_roots* roots, struct work_item* file_item,
+    const struct stat* source_stat, const struct stat* target_stat)
+{
+    off_t size = source_stat->st_size;
+    int sparse = file_is_sparse(source_stat);
+    int update = target_stat && target_stat->st_size > 0 && !sparse;// Holes of a sparse source would be filled
+    int temp = !update && journal_use_temp(source_stat);// An update is rewritten in place, block by block
+    char temp_name[PATH_MAX];
+    const char* written_file = temp ? journal_temp_name(file_item->name, temp_name) : file_item->name;
+    struct dir_pair* dir = dir_cache_get(roots, file_item->parent);
+    int target_fd = update ? openat(dir->target_fd, written_file, O_WRONLY | O_NOFOLLOW)
+        : open_target_at(dir->target_fd, written_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(target_fd == -1) { //ERROR
+        printf("Can not open a target file!\n");
+        perror(file_item->path);
+        exit(-1);
+    }
+    // Clone the whole file at once, it is cheaper than any range copy, unless the data has to be hashed:
+    // then the ranges are cloned and hashed by all workers
+    if(!update && !copy_opts.verify && reflink_usable()) {
+        int source_fd = openat(dir->source_fd, file_item->name, O_RDONLY);
+        int cloned = source_fd == -1 ? 0 : clone_range(source_fd, target_fd, 0, 0);
+        if(cloned == 1 && copy_opts.incremental && keep_mtime(target_fd, source_stat) == -1) {
+            cloned = -1;
+        }
+        if(cloned == 1 && copy_opts.preserve && preserve_fd(source_fd, target_fd, source_stat) == -1) {
+            cloned = -1;
+        }
+        if(source_fd != -1) {
             close(source_fd);
+        }
+        if(cloned == 1) {
+            if(copy_opts.verbose) {
+                printf("%s [%s]\n", file_item->path, copy_path_name(COPY_PATH_REFLINK));
+            }
+            if(temp) {
+                journal_commit(dir->target_fd, written_file, file_item->name, file_item->path);
+            }
+            journal_record(dir->target_fd, file_item->path, size, &source_stat->st_mtim, NULL);
+            close(target_fd);
+            stats_file(size, size, 0);
+            return;
+        }
+        else if(cloned == -1) { // ERROR
+            printf("Can not clone a file!\n");
+            perror(file_item->path);
             close(target_fd);
             exit(-1);
         }
     }
-    if(read_bytes == -1) { // ERROR
-        printf("An error occurs when reading a source file!\n");
-        perror("read");// ERROR information
-        close(source_fd);
+    // Reserve the blocks at once, so concurrent ranges do not fragment the file, and set the final size
+    // A sparse file is only truncated to its size, its holes must not be allocated, an existing target keeps
+    // its blocks and is only cut or extended
+    if((update || sparse || fallocate(target_fd, 0, 0, size) == -1) && ftruncate(target_fd, size) == -1) { // ERROR
+        printf("Can not allocate a target file!\n");
+        perror(file_item->path);
         close(target_fd);
         exit(-1);
     }
-    close(source_fd);
     close(target_fd);
+    stats_file(size, 0, 0);// The ranges count their bytes
+    if(copy_opts.verify) {
+        manifest_split(file_item->path, source_stat, roots->chunk_size);
+    }
+    struct split_state* split = NULL;
+    if(copy_opts.preserve || copy_opts.journal) { // Ranges finish in any order, the last one completes the file
+        split = work_pool_alloc(pool, sizeof(struct split_state));
+        split->remaining = (size + roots->chunk_size - 1) / roots->chunk_size;
+        split->source_stat = *source_stat;
+    }
+    off_t offset;
+    for(offset = 0; offset < size; offset += roots->chunk_size) {
+        struct work_item item = *file_item;// Same path, parent and name, all in the shared arena
+        item.type = WORK_CHUNK;
+        item.flags = (update ? CHUNK_UPDATE : 0) | (temp ? CHUNK_TEMP : 0);
+        item.file = split;
+        item.offset = offset;
+        item.length = size - offset < roots->chunk_size ? size - offset : roots->chunk_size;
+        if(!work_pool_push(pool, worker, &item)) { // Deque is full, copy the range by this worker
+            copy_chunk(roots, &item);
+        }
+    }
 }
 
-void copy_dir(const char* source_dir, const char* target_dir)
+// Copy a file: another name of a copied file is linked to its copy, an existing target is brought up to date
+// in the incremental mode, a large file is split into ranges, otherwise the file is copied by the engine
+void copy_file_item(struct work_pool* pool, int worker, struct copy_roots* roots, struct work_item* item)
 {
-    DIR* dir;// Directory stream
-    struct dirent* ptr;
-    dir = opendir(source_dir);// Open directory
-    if(!dir) { // ERROR
-        printf("Cannot open a directory\n");
-        perror("opendir");
+    struct dir_pair* dir = dir_cache_get(roots, item->parent);
+    struct stat stat_buf;
+    struct stat target_stat;
+    int shared = 0;// Other names are linked to the target, it is written in place
+    // Without a stat the file is copied, and copy_file_at() reports the error
+    if(fstatat(dir->source_fd, item->name, &stat_buf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(stat_buf.st_mode)) {
+        const char* first_path;
+        int linked = link_file(roots->links, &stat_buf, item->path, roots->target_fd, dir->target_fd, item->name,
+            &pool->abort, &first_path);
+        if(linked == -1) { // ERROR
+            printf("Can not create a hard link!\n");
+            perror(item->path);
+            exit(-1);
+        }
+        if(linked) { // Another name of a copied file
+            if(copy_opts.verbose) {
+                printf("%s [hardlink]\n", item->path);
+            }
+            stats_count(STATS_HARDLINKS);
+            manifest_link(item->path, first_path);
+            return;
+        }
+        // After link_file(), so a later name of a resumed file is still linked to it
+        if(copy_opts.journal && journal_skip(dir->source_fd, item->name, &stat_buf, item->path)) {
+            if(copy_opts.verbose) {
+                printf("%s [resumed]\n", item->path);
+            }
+            stats_count(STATS_RESUMED);
+            return;
+        }
+        shared = stat_buf.st_nlink > 1;
+        int exists = copy_opts.incremental && fstatat(dir->target_fd, item->name, &target_stat, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISREG(target_stat.st_mode);
+        if(exists && target_up_to_date(&stat_buf, &target_stat)) {
+            if(copy_opts.verbose) {
+                printf("%s [up to date]\n", item->path);
+            }
+            stats_count(STATS_UNCHANGED);
+            verify_unchanged(dir->source_fd, item->name, &stat_buf, item->path);
+            if(copy_opts.preserve && preserve_unchanged(dir->target_fd, item->name, &stat_buf, &target_stat) == -1) { // ERROR
+                printf("Can not preserve the attributes of a file!\n");
+                perror(item->path);
+                exit(-1);
+            }
+            journal_record(dir->target_fd, item->path, stat_buf.st_size, &stat_buf.st_mtim, NULL);
+            return;
+        }
+        if(roots->chunk_threshold > 0 && stat_buf.st_size >= roots->chunk_threshold) { // Large file
+            split_file(pool, worker, roots, item, &stat_buf, exists ? &target_stat : NULL);
+            return;
+        }
+        if(exists && update_file_at(dir->source_fd, item->name, &stat_buf, dir->target_fd, item->name,
+            &target_stat, item->path)) {
+            return;
+        }
+    }
+    if(roots->use_uring && !uring && !(uring = uring_engine_create())) {
+        roots->use_uring = 0;// io_uring is not usable in this worker, use the sync engine
+    }
+    // io_uring can not clone, so files go through copy_file_at() until cloning turns out to be unsupported,
+    // and io_uring writes under temporary names in the journal mode, so a shared target goes there too
+    if(uring && !reflink_usable() && !(copy_opts.journal && shared)) { // Queue the file, it is finished later
+        uring_engine_add(uring, dir->source_fd, item->name, dir->target_fd, item->name, item->path);
+    }
+    else {
+        copy_file_at(dir->source_fd, item->name, dir->target_fd, item->name, item->path);// Copy file
+    }
+}
+
+// Apply the owner and the extended attributes of a directory at once, and push it to the directories
+// waiting for their mode and timestamps, exit if an error occurs
+void save_dir_attrs(struct work_pool* pool, struct copy_roots* roots, struct work_item* dir_item, int source_fd,
+    int target_fd)
+{
+    struct dir_attr* attr = work_pool_alloc(pool, sizeof(struct dir_attr));
+    attr->path = dir_item->path;
+    if(fstat(source_fd, &attr->source_stat) == -1
+        || (attr->owner_kept = preserve_owner(source_fd, target_fd, &attr->source_stat)) == -1) { // ERROR
+        printf("Can not preserve the attributes of a directory!\n");
+        perror(dir_item->path);
         exit(-1);
     }
-    struct stat stat_buf;
-    if(stat(target_dir, &stat_buf) == -1) { // If target directory has not existed
-        if(mkdir(target_dir, 0755) == -1) { // Create target directory
+    attr->next = __atomic_load_n(&roots->dir_attrs->head, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&roots->dir_attrs->head, &attr->next, attr, 1, __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED)) {
+    }
+}
+
+// Return the depth of a directory path
+int path_depth(const char* path)
+{
+    int depth = strcmp(path, ".") != 0;
+    for(; *path; path++) {
+        depth += *path == '/';
+    }
+    return depth;
+}
+
+// Order directories deepest first, the times of a directory are set after those of its subdirectories
+int compare_depth(const void* a, const void* b)
+{
+    return path_depth((*(struct dir_attr* const*)b)->path) - path_depth((*(struct dir_attr* const*)a)->path);
+}
+
+// Apply the mode and the timestamps of every copied directory after the run, deepest first
+// Return 0 if succeed, otherwise return -1
+int apply_dir_attrs(struct copy_roots* roots)
+{
+    size_t count = 0;
+    struct dir_attr* attr;
+    for(attr = roots->dir_attrs->head; attr; attr = attr->next) {
+        count++;
+    }
+    struct dir_attr** attrs = malloc(sizeof(struct dir_attr*) * (count ? count : 1));
+    if(!attrs) {
+        perror("malloc");
+        return -1;
+    }
+    count = 0;
+    for(attr = roots->dir_attrs->head; attr; attr = attr->next) {
+        attrs[count++] = attr;
+    }
+    qsort(attrs, count, sizeof(struct dir_attr*), compare_depth);
+    size_t i;
+    int ret = 0;
+    for(i = 0; i < count && ret == 0; i++) {
+        int fd = strcmp(attrs[i]->path, ".") == 0 ? dup(roots->target_fd) : open_dir_path(roots->target_fd, attrs[i]->path);
+        if(fd == -1 || fchmod(fd, preserved_mode(&attrs[i]->source_stat, attrs[i]->owner_kept)) == -1
+            || preserve_times(fd, &attrs[i]->source_stat) == -1) { // ERROR
+            printf("Can not preserve the attributes of a directory!\n");
+            perror(attrs[i]->path);
+            ret = -1;
+        }
+        if(fd != -1) {
+            close(fd);
+        }
+    }
+    free(attrs);
+    return ret;
+}
+
+// Push the regular files of a batch in the order of their keys, then empty the batch
+// The owner pops its deque from the bottom, so the files are pushed from the last to the first
+void push_batch(struct work_pool* pool, int worker, struct copy_roots* roots, struct work_item* dir_item,
+    struct order_batch* batch)
+{
+    order_batch_sort(batch);
+    size_t i;
+    for(i = batch->count; i > 0; i--) {
+        const char* name = order_batch_name(batch, i - 1);
+        struct work_item item = {0};
+        item.path = join_path(pool, dir_item->path, name);
+        item.parent = dir_item->path;
+        item.name = item.path + strlen(item.path) - strlen(name);
+        item.type = WORK_FILE;
+        if(!work_pool_push(pool, worker, &item)) { // Deque is full, copy the file by this worker
+            copy_file_item(pool, worker, roots, &item);
+        }
+    }
+    order_batch_clear(batch);
+}
+
+// Copy a directory: create the target directory and push its entries to the deque of this worker
+// The directory is opened relative to its parent and cached, so its entries are resolved relative to it
+void copy_dir(struct work_pool* pool, int worker, struct copy_roots* roots, struct work_item* dir_item)
+{
+    int source_fd;
+    int target_fd;
+    unsigned long long start = stats_now();
+    if(!dir_item->parent) { // Root directory, created by main()
+        source_fd = dup(roots->source_fd);
+        target_fd = dup(roots->target_fd);
+    }
+    else {
+        struct dir_pair* parent = dir_cache_get(roots, dir_item->parent);
+        // Create target directory if it has not existed
+        if(mkdirat(parent->target_fd, dir_item->name, 0755) == -1 && errno != EEXIST) {
             printf("Can not make a directory!\n");
-            perror("mkdir");// ERROR information
+            perror(dir_item->path);// ERROR information
             exit(-1);
         }
+        source_fd = openat(parent->source_fd, dir_item->name, O_RDONLY | O_DIRECTORY);
+        target_fd = openat(parent->target_fd, dir_item->name, O_RDONLY | O_DIRECTORY);
+    }
+    if(source_fd == -1 || target_fd == -1) { // ERROR
+        printf("Cannot open a directory\n");
+        perror(dir_item->path);
+        exit(-1);
     }
-    pid_t pid;// Use for multiprocess
+    stats_phase(PHASE_OPEN, start);
+    stats_count(STATS_DIRS);
+    if(copy_opts.preserve) {
+        save_dir_attrs(pool, roots, dir_item, source_fd, target_fd);
+    }
+    // The cache owns the opened pair, this function reads and links through its own duplicates
+    // because the pair may be replaced while the directory is read
+    dir_cache_put(dir_item->path, source_fd, target_fd);
+    source_fd = dup(source_fd);
+    target_fd = dup(target_fd);
+    struct dir_reader reader;
+    if(source_fd == -1 || target_fd == -1 || dir_reader_open(&reader, source_fd) == -1) { // ERROR
+        printf("Cannot open a directory\n");
+        perror(dir_item->path);
+        exit(-1);
+    }
+    struct order_batch batch = {0};// Regular files waiting to be sorted, unless they are pushed in readdir order
+    struct linux_dirent64* ptr;
     // Read directory
-    while((ptr = readdir(dir)) != NULL) {
+    while((ptr = dir_reader_next(&reader)) != NULL) {
         char* current_dir = ptr->d_name;// Current directory entry
-        if(strcmp(current_dir, ".") == 0 || strcmp(current_dir, "..") == 0) {
-            continue;// Skip . and ..
-        }
-        char target_path[1024];
-        snprintf(target_path, sizeof(target_path), "%s/%s", target_dir, current_dir);// Target path
-        char source_path[1024];
-        snprintf(source_path, sizeof(source_path), "%s/%s", source_dir, current_dir);// Source path
-        if(ptr->d_type == DT_DIR) { // If type of current directory entry is a directory
-            pid = fork();// Fork a child process and use it to copy the subdirectory
-            if(pid == 0) { // Child process
-                copy_dir(source_path, target_path);// Recursively copy subdirectories
-                exit(0);// Exit child processs after copying is end
+        int type = dir_entry_type(source_fd, ptr);
+        if(copy_opts.order && type == DT_REG) {
+            order_batch_add(&batch, source_fd, ptr);
+            if(batch.count == ORDER_BATCH) {
+                push_batch(pool, worker, roots, dir_item, &batch);
             }
-            else if(pid < 0) { // ERROR
-                printf("Cannot fork a process\n");
-                perror("fork");
-                exit(-1);
+            continue;
+        }
+        struct work_item item = {0};
+        item.path = join_path(pool, dir_item->path, current_dir);
+        item.parent = dir_item->path;
+        item.name = item.path + strlen(item.path) - strlen(current_dir);
+        if(type == DT_DIR) { // If type of current directory entry is a directory
+            item.type = WORK_DIR;
+            if(!work_pool_push(pool, worker, &item)) { // Deque is full, copy the subdirectory by this worker
+                copy_dir(pool, worker, roots, &item);
             }
         }
-        else if(ptr->d_type == DT_LNK) { // If type of current directory entry is a symbol link file
-            if(stat(target_path, &stat_buf) == -1) {// If target link file has not existed
-                if(link(source_path, target_path) == -1) { // Create a link file
-                    printf("Can not create a link file!\n");
-                    perror("link");
-                    exit(-1);
-                }
+        else if(type == DT_LNK) { // If type of current directory entry is a symbol link file
+            if(copy_symlink(source_fd, current_dir, target_fd, current_dir) == -1) { // Create a link file
+                printf("Can not create a link file!\n");
+                perror(item.path);
+                exit(-1);
             }
+            if(copy_opts.preserve && preserve_symlink(source_fd, current_dir, target_fd, current_dir) == -1) { // ERROR
+                printf("Can not preserve the attributes of a link file!\n");
+                perror(item.path);
+                exit(-1);
+            }
+            stats_count(STATS_SYMLINKS);
         }
         else {
-            if(stat(target_path, &stat_buf) == -1) { // If target file has not existed
-                copy_file(source_path, target_path);// Copy file
+            item.type = WORK_FILE;
+            if(!work_pool_push(pool, worker, &item)) { // Deque is full, copy the file by this worker
+                copy_file_item(pool, worker, roots, &item);
             }
         }
     }
-    // Wait for child processes
-    while(1) {
-        pid = wait(NULL);
-        if(pid == -1) { // All child processes have been done
-            break;
+    if(errno != 0) { // ERROR
+        printf("Cannot read a directory\n");
+        perror(dir_item->path);
+        exit(-1);
+    }
+    push_batch(pool, worker, roots, dir_item, &batch);
+    order_batch_free(&batch);
+    dir_reader_close(&reader);
+    close(source_fd);
+    close(target_fd);
+}
+
+// Handle a work item taken by a worker
+void handle_item(struct work_pool* pool, int worker, struct work_item* item, void* arg)
+{
+    struct copy_roots* roots = arg;
+    if(roots->stats) { // Every worker counts into its own slot, the parent sums them
+        copy_stats = &roots->stats[worker];
+    }
+    unsigned long long start = stats_now();
+    if(!item) { // Out of work, finish the files in flight
+        if(uring) {
+            uring_engine_drain(uring);
+        }
+        if(journal_checkpoint() == -1) { // ERROR, an idle worker has no reason to keep its entries in memory
+            printf("Can not write the journal!\n");
+            perror("journal_checkpoint()");
+            exit(-1);
         }
     }
-    closedir(dir);
+    else if(item->type == WORK_DIR) {
+        copy_dir(pool, worker, roots, item);
+    }
+    else if(item->type == WORK_CHUNK) {
+        copy_chunk(roots, item);
+    }
+    else {
+        copy_file_item(pool, worker, roots, item);
+    }
+    if(copy_stats) {
+        copy_stats->busy_ns += stats_now() - start;
+        copy_stats->items += item ? 1 : 0;
+    }
+}
+
+// Print the progress of all workers, called by the parent process while the workers run
+void show_progress(struct work_pool* pool, void* arg)
+{
+    (void)pool;
+    struct copy_roots* roots = arg;
+    struct copy_stats total;
+    stats_sum(&total, roots->stats, roots->workers);
+    stats_progress(&total, 0);
 }
 
 int main(int argc, char* argv[])
 {
-    if(argc != 3) {
-        printf("Use copydir_mp by: ./copydir_mp <source directory> <target directory>\n");
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);// Default number of workers
+    struct copy_roots roots = {0};
+    roots.chunk_threshold = CHUNK_THRESHOLD;
+    roots.chunk_size = CHUNK_SIZE;
+    int progress = 0;
+    const char* stats_path = NULL;// JSON report, NULL if not wanted
+    const char* manifest_path = NULL;// Manifest, NULL if not wanted
+    const char* journal_path = NULL;// Journal of the completed files, NULL if the copy is not resumable
+    off_t byte_rate = 0;// Limits of the I/O limiter, 0 for no limit
+    off_t op_rate = 0;
+    const char* qos_control = NULL;// Control file of the limits, NULL if they are fixed
+    int ioprio = 0;// I/O priority, 0 to keep the inherited one, -1 if invalid
+    int nice_value = 0;
+    static struct option long_options[] = {
+        {"reflink", required_argument, NULL, 'r'},
+        {"checksum", no_argument, NULL, 'k'},
+        {"progress", no_argument, NULL, 'p'},
+        {"stats", required_argument, NULL, 's'},
+        {"verify", no_argument, NULL, 'y'},
+        {"manifest", required_argument, NULL, 'm'},
+        {"preserve", no_argument, NULL, 'a'},
+        {"order", required_argument, NULL, 'o'},
+        {"journal", required_argument, NULL, 'J'},
+        {"bwlimit", required_argument, NULL, 'B'},
+        {"iops", required_argument, NULL, 'I'},
+        {"qos-control", required_argument, NULL, 'Q'},
+        {"ioprio", required_argument, NULL, 'P'},
+        {"nice", required_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "vuj:e:t:c:", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'v':
+                copy_opts.verbose = 1;
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 't':
+                roots.chunk_threshold = parse_size(optarg);
+                break;
+            case 'c':
+                roots.chunk_size = parse_size(optarg);
+                break;
+            case 'u':
+                copy_opts.incremental = 1;
+                break;
+            case 'k':
+                copy_opts.incremental = 1;
+                copy_opts.checksum = 1;
+                break;
+            case 'p':
+                progress = 1;
+                break;
+            case 's':
+                stats_path = optarg;
+                break;
+            case 'y':
+                copy_opts.verify = VERIFY_READBACK;
+                break;
+            case 'm':
+                manifest_path = optarg;
+                break;
+            case 'a':
+                copy_opts.preserve = 1;
+                break;
+            case 'o':
+                copy_opts.order = parse_order(optarg);
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'B':
+                byte_rate = parse_size(optarg);
+                break;
+            case 'I':
+                op_rate = parse_size(optarg);
+                break;
+            case 'Q':
+                qos_control = optarg;
+                break;
+            case 'P':
+                ioprio = parse_ioprio(optarg);
+                break;
+            case 'N': {
+                char* end;
+                nice_value = strtol(optarg, &end, 10);
+                if(end == optarg || *end != '\0') {
+                    nice_value = PRIO_MAX;// Invalid
+                }
+                break;
+            }
+            case 'r':
+                copy_opts.reflink = parse_reflink(optarg);
+                break;
+            case 'e':
+                if(strcmp(optarg, "uring") == 0) {
+                    roots.use_uring = 1;
+                }
+                else if(strcmp(optarg, "sync") == 0) {
+                    roots.use_uring = 0;
+                }
+                else { // Unknown engine
+                    printf("Use copydir_mp by: ./copydir_mp [-v] [-u] [-j workers] [-e sync|uring] [-t threshold] [-c chunk] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>\n");
+                    return -1;// ERROR
+                }
+                break;
+            default:
+                printf("Use copydir_mp by: ./copydir_mp [-v] [-u] [-j workers] [-e sync|uring] [-t threshold] [-c chunk] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>\n");
+                return -1;// ERROR
+        }
+    }
+    if(argc - optind != 2 || copy_opts.reflink == -1 || copy_opts.order == -1 || workers < 1 || roots.chunk_threshold < 0
+        || roots.chunk_size <= 0 || byte_rate < 0 || op_rate < 0 || ioprio == -1 || nice_value < PRIO_MIN
+        || nice_value >= PRIO_MAX) {
+        printf("Use copydir_mp by: ./copydir_mp [-v] [-u] [-j workers] [-e sync|uring] [-t threshold] [-c chunk] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>\n");
         return -1;// ERROR
     }
-    char* source_dir = argv[1];
-    char* target_dir = argv[2];
-    copy_dir(source_dir, target_dir);
-    return 0;
-}
\ No newline at end of file
+    char* source_dir = argv[optind];
+    char* target_dir = argv[optind + 1];
+    if(roots.use_uring) { // Probe io_uring once, the workers create their own rings
+        struct uring_engine* probe = uring_engine_create();
+        if(probe) {
+            uring_engine_destroy(probe);
+        }
+        else {
+            roots.use_uring = 0;
+            if(copy_opts.verbose) {
+                printf("io_uring is not supported, use the sync engine\n");
+            }
+        }
+    }
+    if(mkdir(target_dir, 0755) == -1 && errno != EEXIST) { // Create target directory if it has not existed
+        printf("Can not make a directory!\n");
+        perror("mkdir");// ERROR information
+        return -1;
+    }
+    roots.source_fd = open(source_dir, O_RDONLY | O_DIRECTORY);
+    roots.target_fd = open(target_dir, O_RDONLY | O_DIRECTORY);
+    if(roots.source_fd == -1 || roots.target_fd == -1) { // ERROR
+        printf("Cannot open a directory\n");
+        perror("open");
+        return -1;
+    }
+    struct work_pool* pool = work_pool_create(workers, DEQUE_CAPACITY);
+    if(!pool) { // ERROR
+        printf("Cannot create the worker pool\n");
+        perror("mmap");
+        return -1;
+    }
+    if(!(roots.links = link_table_create(link_alloc_shared, pool))) { // ERROR
+        printf("Cannot create the link table\n");
+        work_pool_destroy(pool);
+        return -1;
+    }
+    if(manifest_path) { // Filled by all workers, written by the parent after the run
+        if(!copy_opts.verify) {
+            copy_opts.verify = VERIFY_HASH;
+        }
+        if(!(copy_manifest = manifest_create(link_alloc_shared, pool))
+            || (copy_opts.incremental && manifest_load(copy_manifest, manifest_path) == -1)) { // ERROR
+            perror(manifest_path);
+            work_pool_destroy(pool);
+            return -1;
+        }
+    }
+    if(copy_opts.preserve) {
+        roots.dir_attrs = work_pool_alloc(pool, sizeof(struct dir_attrs));
+    }
+    // The workers inherit the priorities, and share the limiter in the arena
+    if((ioprio && qos_set_ioprio(ioprio) == -1) || (nice_value && setpriority(PRIO_PROCESS, 0, nice_value) == -1)) { // ERROR
+        perror("Can not lower the priority");
+        work_pool_destroy(pool);
+        return -1;
+    }
+    if((byte_rate || op_rate || qos_control) && (!(copy_qos = qos_create(link_alloc_shared, pool, byte_rate, op_rate))
+        || (qos_control && qos_set_control(qos_control) == -1))) { // ERROR
+        perror(qos_control ? qos_control : "qos_create()");
+        work_pool_destroy(pool);
+        return -1;
+    }
+    if(journal_path) { // Loaded before the workers are forked, they share the completed files and the descriptor
+        if(journal_open(journal_path) == -1) { // ERROR
+            perror(journal_path);
+            work_pool_destroy(pool);
+            return -1;
+        }
+        copy_opts.journal = 1;
+    }
+    // The root directory is the first work item
+    struct work_item root = {0};
+    root.type = WORK_DIR;
+    root.path = work_pool_strdup(pool, ".");
+    work_pool_push(pool, 0, &root);
+    if(progress || stats_path) {
+        roots.workers = workers;
+        roots.stats = work_pool_alloc(pool, sizeof(struct copy_stats) * workers);
+        stats_start(NULL);// The parent only reports
+    }
+    if(progress) {
+        work_pool_set_monitor(pool, show_progress, &roots, STATS_INTERVAL_MS);
+    }
+    int ret = work_pool_run(pool, handle_item, &roots);
+    if(copy_opts.preserve && ret == 0 && apply_dir_attrs(&roots) == -1) {
+        ret = -1;
+    }
+    if(roots.stats) {
+        struct copy_stats total;
+        stats_sum(&total, roots.stats, workers);
+        if(progress) {
+            stats_progress(&total, 1);
+        }
+        if(stats_path && stats_write_json(stats_path, "copydir_mp", &total, roots.stats, workers) == -1) { // ERROR
+            perror(stats_path);
+            ret = -1;
+        }
+    }
+    // A failed run keeps the old manifest, its hashes may not match the targets
+    if(manifest_path && ret == 0 && manifest_write(copy_manifest, manifest_path) == -1) { // ERROR
+        perror(manifest_path);
+        ret = -1;
+    }
+    // A failed run keeps the journal, so the next run resumes it
+    if(journal_path && journal_close(ret == 0) == -1) { // ERROR
+        perror(journal_path);
+        ret = -1;
+    }
+    work_pool_destroy(pool);
+    close(roots.source_fd);
+    close(roots.target_fd);
+    return ret;
+}
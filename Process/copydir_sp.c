@@ -1,98 +1,407 @@
 // A program coping a directory and its subdirectories by a single process
-// Compile: gcc -o copydir_sp copydir_sp.c
-// Use: ./copydir_sp <source directory> <target directory>
+// Compile: gcc -o copydir_sp copydir_sp.c copy_engine.c copy_uring.c dir_reader.c link_table.c copy_sync.c copy_stats.c copy_verify.c copy_attr.c copy_order.c copy_journal.c copy_qos.c -pthread
+// Use: ./copydir_sp [-v] [-u] [-e sync|uring] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>
+//      -v: report the data path(reflink, copy_file_range, sendfile, splice, buffered or io_uring) of every copied file
+//      -e: copy engine, sync(default) or uring(falls back to sync if the kernel does not support io_uring)
+//      --reflink: clone files with FICLONE instead of copying their data, auto(default: clone if the filesystem
+//                 supports it), always(fail if a file can not be cloned) or never
+//      -u: incremental mode, the target directory may exist from an earlier run: targets with the size and
+//          modification time of their sources are skipped, only the changed blocks of large changed files are written
+//      --checksum: incremental mode comparing the content of every existing target instead of its modification time
+//      --verify: hash(CRC32C) the data of every file while it is copied, then read the target back and compare
+//      --manifest: hash the data of every file while it is copied and write a manifest(hash, size, modification
+//                  time and path of every file) to file, an incremental run keeps the hashes of unchanged files
+//      --preserve: keep the owner(as root), mode, timestamps and extended attributes(ACLs included) of every file,
+//                  directory and symbolic link, a directory gets its timestamps after its entries are copied
+//      --order: order of the regular files of a directory, readdir(default), inode or extent(first physical
+//               block by FIEMAP), inode and extent avoid seeks on rotational disks, the next file is read ahead
+//               while one is copied
+//      --journal: resumable copy, every completed file is appended to the journal file(at a checkpoint every few
+//                 seconds, after the target filesystem is flushed), files are written under a temporary name
+//                 (.name.copydir-part) and renamed when complete, a run restarted with the same journal skips
+//                 the files completed by the interrupted one, the journal is removed when the copy is complete
+//      --bwlimit: limit the data read and copied to rate bytes per second(K, M or G suffix)
+//      --iops: limit the data requests(reads, writes and in-kernel copies of at most 1M) to rate per second
+//      --qos-control: load bwlimit=rate and iops=rate lines from file, it is loaded again when it changes(checked
+//                     every second) or on SIGHUP, so the limits can be changed while the copy runs
+//      --ioprio: I/O priority of the copy, idle(only served when the disk is otherwise idle), be[:level] or
+//                rt[:level](level 0 to 7, 0 is the highest), needs an I/O scheduler with priorities(BFQ)
+//      --nice: CPU nice value of the copy
+//      --progress: print the progress(files, directories, bytes and throughput) to stderr every second
+//      --stats: write a JSON report(counters, time per phase, latency histograms per file size) to file("-" for stdout)
+//      Hard links are kept: a file with several names is copied once and its other names are linked to the copy
 // Author: Noah Lin
 #include <unistd.h>
+#include <getopt.h>
 #include <dirent.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <string.h>
 #include <stdio.h>
+#include "copy_engine.h"
+#include "copy_uring.h"
+#include "dir_reader.h"
+#include "link_table.h"
+#include "copy_sync.h"
+#include "copy_stats.h"
+#include "copy_verify.h"
+#include "copy_attr.h"
+#include "copy_order.h"
+#include "copy_journal.h"
+#include "copy_qos.h"
 
-void copy_file(const char* source_file, const char* target_file)
+struct uring_engine* uring = NULL;// io_uring engine, NULL if the sync engine is used
+struct link_table* links = NULL;// First names of the source inodes with several names
+int target_root_fd = -1;// Target directory, paths in links are relative to it
+struct copy_stats stats;// Statistics of the run, collected if progress or a report is wanted
+int show_progress = 0;
+
+// Allocate zeroed memory for the link table and the manifest
+void* link_alloc_heap(size_t size, void* arg)
 {
-    int source_fd = open(source_file, O_RDONLY);
-    if(source_fd == -1) { // ERROR
-        printf("Can not open a source file!\n");
-        close(source_fd);
-        exit(-1);
-    }
-    int target_fd = open(target_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if(target_fd == -1) { //ERROR
-        printf("Can not open a target file!\n");
-        close(target_fd);
-        exit(-1);
-    }
-    char buffer[4096];// Buffer of copying(copy 4096 bytes everytime)
-    ssize_t read_bytes;
-    // Keep reading and copying the source file until reaching the end
-    while((read_bytes = read(source_fd, buffer, sizeof(buffer))) > 0) { // read_bytes is the number of bytes actually read
-        ssize_t write_bytes = write(target_fd, buffer, read_bytes);
-        if(write_bytes == -1) { // ERROR
-            printf("An error occurs when writing a target file!\n");
-            printf("write");// ERROR information
-            close(source_fd);
-            close(target_fd);
+    (void)arg;
+    return calloc(1, size);
+}
+
+// Copy a regular file: another name of a copied file is linked to its copy, an existing target is brought
+// up to date in the incremental mode, otherwise the file is copied by the engine
+void copy_regular(int source_fd, int target_fd, const char* name, const char* path)
+{
+    struct stat source_stat;
+    struct stat target_stat;
+    int shared = 0;// Other names are linked to the target, it is written in place
+    // Without a stat the file is copied, and copy_file_at() reports the error
+    if(fstatat(source_fd, name, &source_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(source_stat.st_mode)) {
+        const char* first_path;
+        int linked = link_file(links, &source_stat, path, target_root_fd, target_fd, name, NULL, &first_path);
+        if(linked == -1) { // ERROR
+            printf("Can not create a hard link!\n");
+            perror(path);
             exit(-1);
         }
+        if(linked) { // Another name of a copied file
+            if(copy_opts.verbose) {
+                printf("%s [hardlink]\n", path);
+            }
+            stats_count(STATS_HARDLINKS);
+            manifest_link(path, first_path);
+            return;
+        }
+        // After link_file(), so a later name of a resumed file is still linked to it
+        if(copy_opts.journal && journal_skip(source_fd, name, &source_stat, path)) {
+            if(copy_opts.verbose) {
+                printf("%s [resumed]\n", path);
+            }
+            stats_count(STATS_RESUMED);
+            return;
+        }
+        shared = source_stat.st_nlink > 1;
+        if(copy_opts.incremental && fstatat(target_fd, name, &target_stat, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISREG(target_stat.st_mode)
+            && update_file_at(source_fd, name, &source_stat, target_fd, name, &target_stat, path)) {
+            return;
+        }
     }
-    if(read_bytes == -1) { // ERROR
-        printf("An error occurs when reading a source file!\n");
-        perror("read");// ERROR information
-        close(source_fd);
-        close(target_fd);
-        exit(-1);
+    // io_uring can not clone, so files go through copy_file_at() until cloning turns out to be unsupported,
+    // and io_uring writes under temporary names in the journal mode, so a shared target goes there too
+    if(uring && !reflink_usable() && !(copy_opts.journal && shared)) { // Queue the file, the copy overlaps
+        uring_engine_add(uring, source_fd, name, target_fd, name, path);
     }
-    close(source_fd);
-    close(target_fd);
+    else {
+        copy_file_at(source_fd, name, target_fd, name, path);// Copy file
+    }
+}
+
+// Copy a batch of regular files in the order of their keys, the beginning of the next file is read ahead
+// while one is copied(io_uring keeps many files in flight, it needs no read ahead)
+void copy_batch(int source_fd, int target_fd, struct order_batch* batch, struct path_buf* path)
+{
+    order_batch_sort(batch);
+    size_t i;
+    for(i = 0; i < batch->count; i++) {
+        const char* name = order_batch_name(batch, i);
+        if(!uring && i + 1 < batch->count) {
+            prefetch_file(source_fd, order_batch_name(batch, i + 1));
+        }
+        size_t len = path_push(path, name);
+        copy_regular(source_fd, target_fd, name, path->data);
+        path_pop(path, len);
+        if(show_progress) {
+            stats_progress(&stats, 0);
+        }
+    }
+    order_batch_clear(batch);
 }
 
-void copy_dir(const char* source_dir, const char* target_dir)
+// Copy a directory, source_name and target_name are relative to the file descriptors of their parent directories
+// path is the path relative to the source directory shown in reports, it grows without a fixed limit
+void copy_dir(int source_parent_fd, const char* source_name, int target_parent_fd, const char* target_name,
+    struct path_buf* path)
 {
-    if(mkdir(target_dir, 0755) == -1) { // Create target directory
+    const char* label = path->len ? path->data : source_name;// path->data moves when the path grows
+    unsigned long long start = stats_now();
+    // Create target directory, in the incremental and the journal modes it may exist from an earlier run
+    int may_exist = copy_opts.incremental || copy_opts.journal;
+    if(mkdirat(target_parent_fd, target_name, 0755) == -1 && !(may_exist && errno == EEXIST)) {
         printf("Can not make a directory!\n");
-        perror("mkdir");// ERROR information
+        perror(label);// ERROR information
+        exit(-1);
+    }
+    // Keep both directories open, so every entry is resolved relative to them instead of from the root
+    int source_fd = openat(source_parent_fd, source_name, O_RDONLY | O_DIRECTORY);
+    int target_fd = openat(target_parent_fd, target_name, O_RDONLY | O_DIRECTORY);
+    struct dir_reader reader;
+    if(source_fd == -1 || target_fd == -1 || dir_reader_open(&reader, source_fd) == -1) { // ERROR
+        printf("Cannot open a directory\n");
+        perror(label);
         exit(-1);
     }
-    DIR* dir;// Directory stream
-    struct dirent* ptr;
-    dir = opendir(source_dir);// Open directory
+    stats_phase(PHASE_OPEN, start);
+    stats_count(STATS_DIRS);
+    if(path->len == 0) { // Target root, open until the whole tree is copied
+        target_root_fd = target_fd;
+    }
+    struct path_buf subdirs = {0};// Names of subdirectories, copied after this directory is read
+    struct order_batch batch = {0};// Regular files waiting to be sorted, unless they are copied in readdir order
+    struct linux_dirent64* ptr;
     // Read directory
-    while((ptr = readdir(dir)) != NULL) {
+    while((ptr = dir_reader_next(&reader)) != NULL) {
         char* current_dir = ptr->d_name;// Current directory entry
-        if(strcmp(current_dir, ".") == 0 || strcmp(current_dir, "..") == 0) {
-            continue;// Skip . and ..
+        int type = dir_entry_type(source_fd, ptr);
+        size_t len = path_push(path, current_dir);
+        if(type == DT_DIR) { // If type of current directory entry is a directory
+            name_list_add(&subdirs, current_dir);
         }
-        char target_path[1024];
-        snprintf(target_path, sizeof(target_path), "%s/%s", target_dir, current_dir);// Target path
-        char source_path[1024];
-        snprintf(source_path, sizeof(source_path), "%s/%s", source_dir, current_dir);// Source path
-        if(ptr->d_type == DT_DIR) { // If type of current directory entry is a directory
-            copy_dir(source_path, target_path);// Recursively copy subdirectories
-        }
-        else if(ptr->d_type == DT_LNK) { // If type of current directory entry is a symbol link file
-            if(link(source_path, target_path) == -1) { // Create a link file
+        else if(type == DT_LNK) { // If type of current directory entry is a symbol link file
+            if(copy_symlink(source_fd, current_dir, target_fd, current_dir) == -1) { // Create a link file
                 printf("Can not create a link file!\n");
-                perror("link");
+                perror(path->data);
+                exit(-1);
+            }
+            if(copy_opts.preserve && preserve_symlink(source_fd, current_dir, target_fd, current_dir) == -1) { // ERROR
+                printf("Can not preserve the attributes of a link file!\n");
+                perror(path->data);
                 exit(-1);
             }
+            stats_count(STATS_SYMLINKS);
+        }
+        else if(copy_opts.order && type == DT_REG) {
+            order_batch_add(&batch, source_fd, ptr);
+            if(batch.count == ORDER_BATCH) {
+                path_pop(path, len);
+                copy_batch(source_fd, target_fd, &batch, path);
+                continue;
+            }
         }
         else {
-            copy_file(source_path, target_path);// Copy file
+            copy_regular(source_fd, target_fd, current_dir, path->data);
         }
+        path_pop(path, len);
+        if(show_progress) {
+            stats_progress(&stats, 0);
+        }
+    }
+    if(errno != 0) { // ERROR
+        printf("Cannot read a directory\n");
+        perror(path->len ? path->data : source_name);
+        exit(-1);
+    }
+    copy_batch(source_fd, target_fd, &batch, path);
+    order_batch_free(&batch);
+    dir_reader_close(&reader);// Free the batch buffer before going deeper
+    size_t off;
+    for(off = 0; off < subdirs.len; off += strlen(subdirs.data + off) + 1) {
+        size_t len = path_push(path, subdirs.data + off);
+        copy_dir(source_fd, subdirs.data + off, target_fd, subdirs.data + off, path);// Recursively copy subdirectories
+        path_pop(path, len);
     }
-    closedir(dir);
+    free(subdirs.data);
+    if(uring) { // Files in flight are opened relative to these directories
+        uring_engine_drain(uring);
+    }
+    // Every entry is written, so nothing changes the timestamps any more, and a read-only mode can not
+    // stop the copy of an entry
+    struct stat stat_buf;
+    if(copy_opts.preserve && (fstat(source_fd, &stat_buf) == -1
+        || preserve_fd(source_fd, target_fd, &stat_buf) == -1)) { // ERROR
+        printf("Can not preserve the attributes of a directory!\n");
+        perror(path->len ? path->data : source_name);
+        exit(-1);
+    }
+    close(source_fd);
+    close(target_fd);
 }
 
 int main(int argc, char* argv[])
 {
-    if(argc != 3) {
-        printf("Use copydir_sp by: ./copydir_sp <source directory> <target directory>\n");
+    int use_uring = 0;
+    const char* stats_path = NULL;// JSON report, NULL if not wanted
+    const char* manifest_path = NULL;// Manifest, NULL if not wanted
+    const char* journal_path = NULL;// Journal of the completed files, NULL if the copy is not resumable
+    off_t byte_rate = 0;// Limits of the I/O limiter, 0 for no limit
+    off_t op_rate = 0;
+    const char* qos_control = NULL;// Control file of the limits, NULL if they are fixed
+    int ioprio = 0;// I/O priority, 0 to keep the inherited one, -1 if invalid
+    int nice_value = 0;
+    static struct option long_options[] = {
+        {"reflink", required_argument, NULL, 'r'},
+        {"checksum", no_argument, NULL, 'k'},
+        {"progress", no_argument, NULL, 'p'},
+        {"stats", required_argument, NULL, 's'},
+        {"verify", no_argument, NULL, 'y'},
+        {"manifest", required_argument, NULL, 'm'},
+        {"preserve", no_argument, NULL, 'a'},
+        {"order", required_argument, NULL, 'o'},
+        {"journal", required_argument, NULL, 'J'},
+        {"bwlimit", required_argument, NULL, 'B'},
+        {"iops", required_argument, NULL, 'I'},
+        {"qos-control", required_argument, NULL, 'Q'},
+        {"ioprio", required_argument, NULL, 'P'},
+        {"nice", required_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "vue:", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'v':
+                copy_opts.verbose = 1;
+                break;
+            case 'u':
+                copy_opts.incremental = 1;
+                break;
+            case 'k':
+                copy_opts.incremental = 1;
+                copy_opts.checksum = 1;
+                break;
+            case 'p':
+                show_progress = 1;
+                break;
+            case 's':
+                stats_path = optarg;
+                break;
+            case 'y':
+                copy_opts.verify = VERIFY_READBACK;
+                break;
+            case 'm':
+                manifest_path = optarg;
+                break;
+            case 'a':
+                copy_opts.preserve = 1;
+                break;
+            case 'o':
+                copy_opts.order = parse_order(optarg);
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'B':
+                byte_rate = parse_size(optarg);
+                break;
+            case 'I':
+                op_rate = parse_size(optarg);
+                break;
+            case 'Q':
+                qos_control = optarg;
+                break;
+            case 'P':
+                ioprio = parse_ioprio(optarg);
+                break;
+            case 'N': {
+                char* end;
+                nice_value = strtol(optarg, &end, 10);
+                if(end == optarg || *end != '\0') {
+                    nice_value = PRIO_MAX;// Invalid
+                }
+                break;
+            }
+            case 'r':
+                copy_opts.reflink = parse_reflink(optarg);
+                break;
+            case 'e':
+                if(strcmp(optarg, "uring") == 0) {
+                    use_uring = 1;
+                }
+                else if(strcmp(optarg, "sync") == 0) {
+                    use_uring = 0;
+                }
+                else { // Unknown engine
+                    printf("Use copydir_sp by: ./copydir_sp [-v] [-u] [-e sync|uring] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>\n");
+                    return -1;// ERROR
+                }
+                break;
+            default:
+                printf("Use copydir_sp by: ./copydir_sp [-v] [-u] [-e sync|uring] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>\n");
+                return -1;// ERROR
+        }
+    }
+    if(argc - optind != 2 || copy_opts.reflink == -1 || copy_opts.order == -1 || byte_rate < 0 || op_rate < 0
+        || ioprio == -1 || nice_value < PRIO_MIN || nice_value >= PRIO_MAX) {
+        printf("Use copydir_sp by: ./copydir_sp [-v] [-u] [-e sync|uring] [--reflink=auto|always|never] [--checksum] [--verify] [--manifest=file] [--preserve] [--order=readdir|inode|extent] [--journal=file] [--bwlimit=rate] [--iops=rate] [--qos-control=file] [--ioprio=class[:level]] [--nice=n] [--progress] [--stats=file] <source directory> <target directory>\n");
         return -1;// ERROR
     }
-    char* source_dir = argv[1];
-    char* target_dir = argv[2];
-    copy_dir(source_dir, target_dir);
+    char* source_dir = argv[optind];
+    char* target_dir = argv[optind + 1];
+    if(use_uring && !(uring = uring_engine_create()) && copy_opts.verbose) {
+        printf("io_uring is not supported, use the sync engine\n");
+    }
+    raise_fd_limit();
+    if(!(links = link_table_create(link_alloc_heap, NULL))) { // ERROR
+        perror("link_table_create()");
+        return -1;
+    }
+    if(manifest_path) { // Hashes of an earlier run are only reused for files found up to date
+        if(!copy_opts.verify) {
+            copy_opts.verify = VERIFY_HASH;
+        }
+        if(!(copy_manifest = manifest_create(link_alloc_heap, NULL))
+            || (copy_opts.incremental && manifest_load(copy_manifest, manifest_path) == -1)) { // ERROR
+            perror(manifest_path);
+            return -1;
+        }
+    }
+    if((ioprio && qos_set_ioprio(ioprio) == -1) || (nice_value && setpriority(PRIO_PROCESS, 0, nice_value) == -1)) { // ERROR
+        perror("Can not lower the priority");
+        return -1;
+    }
+    if((byte_rate || op_rate || qos_control) && (!(copy_qos = qos_create(link_alloc_heap, NULL, byte_rate, op_rate))
+        || (qos_control && qos_set_control(qos_control) == -1))) { // ERROR
+        perror(qos_control ? qos_control : "qos_create()");
+        return -1;
+    }
+    if(journal_path) { // Before the copy starts, so completed files are known when the tree is read
+        if(journal_open(journal_path) == -1) { // ERROR
+            perror(journal_path);
+            return -1;
+        }
+        copy_opts.journal = 1;
+    }
+    if(show_progress || stats_path) {
+        stats_start(&stats);
+    }
+    struct path_buf path = {0};
+    copy_dir(AT_FDCWD, source_dir, AT_FDCWD, target_dir, &path);
+    free(path.data);
+    if(uring) {
+        uring_engine_drain(uring);
+        uring_engine_destroy(uring);
+    }
+    if(show_progress) {
+        stats_progress(&stats, 1);
+    }
+    if(stats_path && stats_write_json(stats_path, "copydir_sp", &stats, NULL, 0) == -1) { // ERROR
+        perror(stats_path);
+        return -1;
+    }
+    if(manifest_path && manifest_write(copy_manifest, manifest_path) == -1) { // ERROR
+        perror(manifest_path);
+        return -1;
+    }
+    if(journal_path && journal_close(1) == -1) { // ERROR
+        perror(journal_path);
+        return -1;
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+// Directory reading by getdents64() in large batches, and growable paths for reports
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <stdio.h>
+#include "dir_reader.h"
+#include "copy_stats.h"
+
+// Start reading a directory, return 0 if succeed, otherwise return -1
+int dir_reader_open(struct dir_reader* reader, int dir_fd)
+{
+    reader->fd = dir_fd;
+    reader->pos = 0;
+    reader->len = 0;
+    reader->buffer = malloc(DIR_BATCH_SIZE);
+    return reader->buffer ? 0 : -1;
+}
+
+// Return the next entry except . and .., return NULL at the end of the directory or if an error occurs
+struct linux_dirent64* dir_reader_next(struct dir_reader* reader)
+{
+    while(1) {
+        if(reader->pos >= reader->len) { // Read the next batch
+            unsigned long long start = stats_now();
+            long len = syscall(SYS_getdents64, reader->fd, reader->buffer, DIR_BATCH_SIZE);
+            stats_phase(PHASE_READDIR, start);
+            if(len <= 0) {
+                if(len == 0) {
+                    errno = 0;// End of the directory
+                }
+                return NULL;
+            }
+            reader->len = len;
+            reader->pos = 0;
+        }
+        struct linux_dirent64* entry = (struct linux_dirent64*)(reader->buffer + reader->pos);
+        reader->pos += entry->d_reclen;
+        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) { // Skip . and ..
+            return entry;
+        }
+    }
+}
+
+// Release the buffer of a directory reader, the directory file descriptor is not closed
+void dir_reader_close(struct dir_reader* reader)
+{
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+// Return the type(DT_*) of an entry, DT_UNKNOWN is resolved by fstatat() relative to dir_fd
+int dir_entry_type(int dir_fd, struct linux_dirent64* entry)
+{
+    if(entry->d_type != DT_UNKNOWN) {
+        return entry->d_type;
+    }
+    // Some filesystems(e.g. XFS without ftype, NFS, some FUSE filesystems) do not fill d_type
+    struct stat stat_buf;
+    if(fstatat(dir_fd, entry->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW) == -1) {
+        return DT_UNKNOWN;
+    }
+    return IFTODT(stat_buf.st_mode);
+}
+
+// Make room for need bytes in a path_buf
+static void path_reserve(struct path_buf* path, size_t need)
+{
+    if(need > path->cap) {
+        size_t cap = path->cap ? path->cap : 256;
+        while(cap < need) {
+            cap *= 2;
+        }
+        char* data = realloc(path->data, cap);
+        if(!data) { // ERROR
+            perror("path_push()");
+            exit(-1);
+        }
+        path->data = data;
+        path->cap = cap;
+    }
+}
+
+// Append "/name"(or "name" if the path is empty) to a path, return the old length for path_pop()
+size_t path_push(struct path_buf* path, const char* name)
+{
+    size_t old_len = path->len;
+    size_t name_len = strlen(name);
+    path_reserve(path, path->len + name_len + 2);
+    if(path->len > 0) {
+        path->data[path->len++] = '/';
+    }
+    memcpy(path->data + path->len, name, name_len + 1);
+    path->len += name_len;
+    return old_len;
+}
+
+// Restore the length returned by path_push()
+void path_pop(struct path_buf* path, size_t len)
+{
+    path->len = len;
+    if(path->data) {
+        path->data[len] = '\0';
+    }
+}
+
+// Append name and a '\0' to a list of names kept in a path_buf
+void name_list_add(struct path_buf* list, const char* name)
+{
+    size_t name_len = strlen(name);
+    path_reserve(list, list->len + name_len + 1);
+    memcpy(list->data + list->len, name, name_len + 1);
+    list->len += name_len + 1;
+}
+
+// Open a directory by a relative path of any length, paths longer than PATH_MAX are opened component by component
+int open_dir_path(int dir_fd, const char* path)
+{
+    if(strlen(path) < PATH_MAX) {
+        return openat(dir_fd, path, O_RDONLY | O_DIRECTORY);
+    }
+    int fd = dup(dir_fd);
+    const char* start = path;
+    char name[NAME_MAX + 1];
+    while(fd != -1 && *start) {
+        const char* end = strchr(start, '/');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if(len > NAME_MAX) {
+            close(fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, start, len);
+        name[len] = '\0';
+        int next = len ? openat(fd, name, O_RDONLY | O_DIRECTORY) : dup(fd);
+        close(fd);
+        fd = next;
+        start += end ? len + 1 : len;
+    }
+    return fd;
+}
+
+// Raise the soft limit of open files to the hard limit, a deep traversal keeps a directory open per level
+void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
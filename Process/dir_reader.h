@@ -0,0 +1,64 @@
+// Directory reading by getdents64() in large batches, and growable paths for reports
+// Author: Noah Lin
+#ifndef DIR_READER_H
+#define DIR_READER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DIR_BATCH_SIZE (256 * 1024)// Bytes of directory entries read by one getdents64()
+
+// A directory entry as returned by getdents64()
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A directory being read batch by batch
+struct dir_reader {
+    int fd;// Directory file descriptor(owned by the caller)
+    char* buffer;
+    long pos;
+    long len;
+};
+
+// A path which grows with the depth of the traversal, there is no PATH_MAX limit
+struct path_buf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+// Start reading a directory, return 0 if succeed, otherwise return -1
+int dir_reader_open(struct dir_reader* reader, int dir_fd);
+
+// Return the next entry except . and .., return NULL at the end of the directory or if an error occurs
+// (errno is set to 0 at the end)
+struct linux_dirent64* dir_reader_next(struct dir_reader* reader);
+
+// Release the buffer of a directory reader, the directory file descriptor is not closed
+void dir_reader_close(struct dir_reader* reader);
+
+// Return the type(DT_*) of an entry, DT_UNKNOWN is resolved by fstatat() relative to dir_fd
+int dir_entry_type(int dir_fd, struct linux_dirent64* entry);
+
+// Append "/name"(or "name" if the path is empty) to a path, return the old length for path_pop()
+size_t path_push(struct path_buf* path, const char* name);
+
+// Restore the length returned by path_push()
+void path_pop(struct path_buf* path, size_t len);
+
+// Append name and a '\0' to a list of names kept in a path_buf
+void name_list_add(struct path_buf* list, const char* name);
+
+// Open a directory by a relative path of any length, paths longer than PATH_MAX are opened component by component
+// Return the file descriptor, or -1 if an error occurs
+int open_dir_path(int dir_fd, const char* path);
+
+// Raise the soft limit of open files to the hard limit, a deep traversal keeps a directory open per level
+void raise_fd_limit(void);
+
+#endif
@@ -0,0 +1,226 @@
+// Hard link table: remembers the first target of every source inode with more than one name
+// Every inode is copied once, the other names are recreated by linkat() to the first target
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include "dir_reader.h"
+#include "copy_engine.h"
+#include "link_table.h"
+
+// Create a table, all memory comes from alloc(use shared memory to share it by processes forked later)
+struct link_table* link_table_create(link_alloc alloc, void* alloc_arg)
+{
+    struct link_table* table = alloc(sizeof(struct link_table), alloc_arg);
+    if(!table) {
+        return NULL;
+    }
+    table->buckets = alloc(sizeof(struct link_entry*) * LINK_BUCKETS, alloc_arg);
+    if(!table->buckets) {
+        return NULL;
+    }
+    table->alloc = alloc;
+    table->alloc_arg = alloc_arg;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    int i;
+    for(i = 0; i < LINK_LOCKS; i++) {
+        pthread_mutex_init(&table->locks[i], &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return table;
+}
+
+// Hash of an inode
+static unsigned long hash_inode(dev_t dev, ino_t ino)
+{
+    unsigned long h = (unsigned long)ino * 0x9E3779B97F4A7C15UL;
+    h ^= (unsigned long)dev * 0xC2B2AE3D27D4EB4FUL;
+    return (h ^ (h >> 29)) % LINK_BUCKETS;
+}
+
+// Look up an inode, if it is new, record path as its first name and set *added
+struct link_entry* link_table_add(struct link_table* table, dev_t dev, ino_t ino, const char* path, int* added)
+{
+    unsigned long bucket = hash_inode(dev, ino);
+    pthread_mutex_t* lock = &table->locks[bucket % LINK_LOCKS];
+    struct link_entry* entry;
+    pthread_mutex_lock(lock);
+    for(entry = table->buckets[bucket]; entry; entry = entry->next) {
+        if(entry->dev == dev && entry->ino == ino) {
+            pthread_mutex_unlock(lock);
+            __atomic_add_fetch(&table->links, 1, __ATOMIC_RELAXED);
+            *added = 0;
+            return entry;
+        }
+    }
+    // First name of the inode, the caller copies it
+    size_t len = strlen(path);
+    entry = table->alloc(sizeof(struct link_entry) + len + 1, table->alloc_arg);
+    if(!entry) { // ERROR
+        pthread_mutex_unlock(lock);
+        perror("link_table_add()");
+        exit(-1);
+    }
+    char* copy = (char*)(entry + 1);
+    memcpy(copy, path, len + 1);
+    entry->dev = dev;
+    entry->ino = ino;
+    entry->path = copy;
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    pthread_mutex_unlock(lock);
+    __atomic_add_fetch(&table->files, 1, __ATOMIC_RELAXED);
+    *added = 1;
+    return entry;
+}
+
+// Mark the first name of an inode as created
+static void link_entry_ready(struct link_entry* entry)
+{
+    __atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+}
+
+// Link name in target_dir_fd to the first name of an entry, return 0 if succeed, otherwise return -1
+static int link_path(struct link_entry* entry, int target_root_fd, int target_dir_fd, const char* name)
+{
+    if(strlen(entry->path) < PATH_MAX) {
+        return linkat(target_root_fd, entry->path, target_dir_fd, name, 0);
+    }
+    // Open the directory of a long first name component by component
+    const char* slash = strrchr(entry->path, '/');
+    size_t dir_len = slash - entry->path;
+    char* dir_path = strndup(entry->path, dir_len);
+    if(!dir_path) {
+        return -1;
+    }
+    int dir_fd = open_dir_path(target_root_fd, dir_path);
+    free(dir_path);
+    if(dir_fd == -1) {
+        return -1;
+    }
+    int ret = linkat(dir_fd, slash + 1, target_dir_fd, name, 0);
+    int saved_errno = errno;
+    close(dir_fd);
+    errno = saved_errno;
+    return ret;
+}
+
+// Create a hard link named name in target_dir_fd to the first name of an entry, an existing name is replaced
+// unless it is already that link
+static int link_entry_link(struct link_entry* entry, int target_root_fd, int target_dir_fd, const char* name,
+    volatile int* abort)
+{
+    // The first name is created right after it is added, so this wait is short
+    while(!__atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE)) {
+        if(abort && *abort) {
+            errno = EINTR;
+            return -1;
+        }
+        sched_yield();
+    }
+    if(link_path(entry, target_root_fd, target_dir_fd, name) == 0) {
+        return 0;
+    }
+    struct stat stat_buf;
+    if(errno != EEXIST || fstatat(target_dir_fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) == -1) {
+        return -1;
+    }
+    if(stat_buf.st_dev == entry->target_dev && stat_buf.st_ino == entry->target_ino) { // Linked by an earlier run
+        return 0;
+    }
+    // A stale file of an earlier run, replace it by the link
+    if(unlinkat(target_dir_fd, name, 0) == -1) {
+        return -1;
+    }
+    return link_path(entry, target_root_fd, target_dir_fd, name);
+}
+
+// Handle a regular file of a source inode with more than one name
+int link_file(struct link_table* table, const struct stat* stat_buf, const char* target_path, int target_root_fd,
+    int target_dir_fd, const char* name, volatile int* abort, const char** first_path)
+{
+    if(stat_buf->st_nlink < 2) {
+        return 0;
+    }
+    int added;
+    struct link_entry* entry = link_table_add(table, stat_buf->st_dev, stat_buf->st_ino, target_path, &added);
+    if(!added) { // Another name of an inode already copied
+        *first_path = entry->path;
+        return link_entry_link(entry, target_root_fd, target_dir_fd, name, abort) == -1 ? -1 : 1;
+    }
+    // The first name, create its target file now, the copy itself may be queued
+    // An existing target is kept, an incremental run may find it up to date
+    int fd = open_target_at(target_dir_fd, name, O_WRONLY | O_CREAT, 0644);
+    struct stat target_stat;
+    if(fd != -1 && fstat(fd, &target_stat) == 0) {
+        entry->target_dev = target_stat.st_dev;
+        entry->target_ino = target_stat.st_ino;
+    }
+    link_entry_ready(entry);// Waiting names fail on their own if the file could not be created
+    if(fd == -1) {
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Check whether name in dir_fd is a symbolic link to content
+static int same_symlink(int dir_fd, const char* name, const char* content)
+{
+    size_t len = strlen(content);
+    char* old = malloc(len + 2);// One more byte to detect a longer link
+    if(!old) {
+        return 0;
+    }
+    ssize_t old_len = readlinkat(dir_fd, name, old, len + 2);
+    int same = old_len == (ssize_t)len && memcmp(old, content, len) == 0;
+    free(old);
+    return same;
+}
+
+// Copy a symbolic link, return 0 if succeed, otherwise return -1
+int copy_symlink(int source_dir_fd, const char* source_name, int target_dir_fd, const char* target_name)
+{
+    size_t size = 256;
+    char* content = NULL;
+    while(1) { // Grow the buffer until the whole content fits, a symbolic link has no fixed length limit here
+        char* bigger = realloc(content, size);
+        if(!bigger) {
+            free(content);
+            return -1;
+        }
+        content = bigger;
+        ssize_t len = readlinkat(source_dir_fd, source_name, content, size);
+        if(len == -1) {
+            free(content);
+            return -1;
+        }
+        if((size_t)len < size) {
+            content[len] = '\0';
+            break;
+        }
+        size *= 2;
+    }
+    int ret = symlinkat(content, target_dir_fd, target_name);
+    if(ret == -1 && errno == EEXIST) { // Left by an earlier run, keep it if it still points to the same place
+        if(same_symlink(target_dir_fd, target_name, content)) {
+            ret = 0;
+        }
+        else if(unlinkat(target_dir_fd, target_name, 0) == 0) {
+            ret = symlinkat(content, target_dir_fd, target_name);
+        }
+    }
+    int saved_errno = errno;
+    free(content);
+    errno = saved_errno;
+    return ret;
+}
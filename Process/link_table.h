@@ -0,0 +1,55 @@
+// Hard link table: remembers the first target of every source inode with more than one name
+// Author: Noah Lin
+#ifndef LINK_TABLE_H
+#define LINK_TABLE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#define LINK_BUCKETS (1UL << 18)// Hash buckets, chains grow beyond it
+#define LINK_LOCKS 256// Bucket locks, a lock protects every LINK_LOCKS-th bucket
+
+// The first name of an inode in the target tree
+struct link_entry {
+    dev_t dev;
+    ino_t ino;
+    const char* path;// Target path relative to the target root
+    dev_t target_dev;// Inode of the first name in the target tree
+    ino_t target_ino;
+    volatile int ready;// Set when the target file exists, other names can be linked to it
+    struct link_entry* next;
+};
+
+// Allocate zeroed memory for the table, memory is never freed while the table is used
+typedef void* (*link_alloc)(size_t size, void* arg);
+
+struct link_table {
+    pthread_mutex_t locks[LINK_LOCKS];// Process-shared, so the table can be shared by worker processes
+    struct link_entry** buckets;
+    link_alloc alloc;
+    void* alloc_arg;
+    volatile unsigned long files;// Inodes copied once
+    volatile unsigned long links;// Names recreated by linkat()
+};
+
+// Create a table, all memory comes from alloc(use shared memory to share it by processes forked later)
+struct link_table* link_table_create(link_alloc alloc, void* alloc_arg);
+
+// Look up an inode and return the entry of its first name, if the inode is new, record path as its first name
+// and set *added to 1, otherwise set *added to 0
+struct link_entry* link_table_add(struct link_table* table, dev_t dev, ino_t ino, const char* path, int* added);
+
+// Handle a regular file of a source inode with more than one name(stat_buf is its source stat)
+// The first name records target_path(relative to target_root_fd) and creates its target file at once, so later
+// names can be linked while it is copied, later names wait for that file(or until *abort becomes not 0)
+// Return 1 if the file has been linked to an earlier name(*first_path is set to the path of that name),
+// 0 if the caller should copy it, -1 if an error occurs
+int link_file(struct link_table* table, const struct stat* stat_buf, const char* target_path, int target_root_fd,
+    int target_dir_fd, const char* name, volatile int* abort, const char** first_path);
+
+// Copy a symbolic link, an existing target is replaced unless it has the same content
+// Return 0 if succeed, otherwise return -1
+int copy_symlink(int source_dir_fd, const char* source_name, int target_dir_fd, const char* target_name);
+
+#endif
@@ -1,9 +1,11 @@
 // A program showing information of processes like ps -ef
-// Complie: gcc -o showproc showproc.c
-// Use: ./showproc
+// Complie: gcc -o showproc showproc.c -pthread
+// Use: ./showproc [-D|--debug] [-j threads] [-d interval [-n iterations]] [-o columns] [-u users] [-p pids]
+//     [--cmd=regex] [--sort=[-]column] [--top=n] [--tree] [-L] [--format=text|jsonl|binary] [--read=file]
 // Author: Noah Lin 
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/sysinfo.h>
 #include <sys/stat.h>
@@ -11,7 +13,15 @@
 #include <pwd.h> // getpwuid()
 #include <string.h>
 #include <ctype.h>
+#include <getopt.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <regex.h>
+#include "showproc_snapshot.h"
 #include <stdio.h>
 
 // Check whether the name of a directory is constructed by numbers, if true, return 1, else return 0
@@ -41,134 +51,278 @@ int open_proc_file(const char* proc_dir, const char* file_name, FILE** file_pp)
     }
 }
 
-// Return position of the end of a process name in order to tackle with possible space in the process name
-int get_end_of_proc_name(const char* proc_dir)
+// Fields of /proc/pid/stat used by the columns, taken from one read of the file so they are consistent
+struct proc_snapshot {
+    int pid;
+    char comm[64];// Name of the process(at most 15 chars in the kernel)
+    char state;
+    int ppid;
+    int tty_nr;
+    unsigned long utime;// User mode time(measured in jiffies)
+    unsigned long stime;// System mode time(measured in jiffies)
+    long num_threads;
+    unsigned long long start_jiffies;// Process start time after boot(measured in jiffies)
+    unsigned long vsz;// Virtual memory size(measured in KiB)
+    unsigned long rss;// Resident set size(measured in KiB)
+};
+
+static long page_kib = 4;// KiB of a memory page, set by main()
+
+// Skip spaces and parse a decimal number(may be negative) of a stat line, move *pos behind it
+static long long parse_number(const char** pos)
 {
-    FILE* stat;
-    if(open_proc_file(proc_dir, "stat", &stat) == 0) {
-        printf("get_end_of_proc_name(): Cannot open stat file of process %s\n", proc_dir);
-        exit(-1);
+    const char* p = *pos;
+    while(*p == ' ') {
+        p++;
     }
-    char line[1024];
-    if(fgets(line, sizeof(line), stat) != NULL) {
-        char* name_end = strchr(line, ')');
-        fclose(stat);
-        if(name_end) {
-            return (int)(name_end - line);
+    int negative = *p == '-';
+    if(negative) {
+        p++;
+    }
+    long long value = 0;
+    while(*p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+    *pos = p;
+    return negative ? -value : value;
+}
+
+// Skip count space separated fields of a stat line
+static void skip_fields(const char** pos, int count)
+{
+    const char* p = *pos;
+    while(count-- > 0) {
+        while(*p == ' ') {
+            p++;
         }
-        else {
-            return -1;// ERROR
+        while(*p && *p != ' ') {
+            p++;
         }
     }
-    else {
-        fclose(stat);
-        printf("get_end_of_proc_name(): Cannot read stat file of process %s\n", proc_dir);
+    *pos = p;
+}
+
+// Open /proc/pid/stat of a process, return -1 if failed(errno is set)
+int open_proc_stat(const char* proc_dir)
+{
+    char file_path[256];
+    snprintf(file_path, sizeof(file_path), "/proc/%s/stat", proc_dir);
+    return open(file_path, O_RDONLY | O_CLOEXEC);
+}
+
+// Read /proc/pid/stat of a process by an open descriptor and parse it, the descriptor can be read again later
+// Return 1 if succeed, otherwise return 0(the process has exited)
+int pread_proc_snapshot(int fd, const char* proc_dir, struct proc_snapshot* snap)
+{
+    char line[1024];
+    ssize_t len = pread(fd, line, sizeof(line) - 1, 0);// The kernel produces the whole line by one read
+    if(len <= 0) {
+        return 0;
+    }
+    line[len] = '\0';
+    // The name is enclosed by "(" and the last ")", it may contain spaces and parentheses itself
+    char* name_start = strchr(line, '(');
+    char* name_end = strrchr(line, ')');
+    if(!name_start || !name_end || name_end < name_start) { // ERROR
+        printf("pread_proc_snapshot(): Name error of process %s\n", proc_dir);
         exit(-1);
     }
+    const char* pos = line;
+    snap->pid = parse_number(&pos);
+    size_t name_len = name_end - name_start - 1;
+    if(name_len >= sizeof(snap->comm)) {
+        name_len = sizeof(snap->comm) - 1;
+    }
+    memcpy(snap->comm, name_start + 1, name_len);
+    snap->comm[name_len] = '\0';
+    pos = name_end + 1;
+    while(*pos == ' ') {
+        pos++;
+    }
+    snap->state = *pos ? *pos++ : '?';// Field 3
+    snap->ppid = parse_number(&pos);// Field 4
+    skip_fields(&pos, 2);// pgrp, session
+    snap->tty_nr = parse_number(&pos);// Field 7
+    skip_fields(&pos, 6);// tpgid, flags, minflt, cminflt, majflt, cmajflt
+    snap->utime = parse_number(&pos);// Field 14
+    snap->stime = parse_number(&pos);// Field 15
+    skip_fields(&pos, 4);// cutime, cstime, priority, nice
+    snap->num_threads = parse_number(&pos);// Field 20
+    skip_fields(&pos, 1);// itrealvalue
+    snap->start_jiffies = parse_number(&pos);// Field 22
+    snap->vsz = parse_number(&pos) / 1024;// Field 23(measured in bytes)
+    snap->rss = parse_number(&pos) * page_kib;// Field 24(measured in pages)
+    return 1;
+}
+
+// Read /proc/pid/stat of a process once and parse it, return 1 if succeed, otherwise return 0
+// (the process may have exited since its directory was listed)
+int read_proc_snapshot(const char* proc_dir, struct proc_snapshot* snap)
+{
+    int fd = open_proc_stat(proc_dir);
+    if(fd == -1) {
+        return 0;
+    }
+    int ret = pread_proc_snapshot(fd, proc_dir, snap);
+    close(fd);
+    return ret;
+}
+
+// Read a file of a process by one read() into buffer(NUL-terminated), return its length, otherwise return -1
+// (errno is set, the process may have exited since its directory was listed)
+ssize_t read_proc_text(const char* proc_dir, const char* file_name, char* buffer, size_t buffer_size)
+{
+    char file_path[256];
+    snprintf(file_path, sizeof(file_path), "/proc/%s/%s", proc_dir, file_name);
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        return -1;
+    }
+    ssize_t len = read(fd, buffer, buffer_size - 1);// The kernel produces the whole file by one read
+    int read_errno = errno;
+    close(fd);
+    errno = read_errno;
+    if(len >= 0) {
+        buffer[len] = '\0';
+    }
+    return len;
+}
+
+// Get the shared memory of a process from /proc/pid/statm(measured in KiB)
+// Return 1 if succeed, otherwise return 0(the process has exited)
+int get_statm(const char* proc_dir, unsigned long* shared)
+{
+    char line[256];
+    if(read_proc_text(proc_dir, "statm", line, sizeof(line)) <= 0) {
+        return 0;
+    }
+    const char* pos = line;
+    skip_fields(&pos, 2);// size, resident(VSZ and RSS are read from stat)
+    *shared = parse_number(&pos) * page_kib;// Field 3(measured in pages)
+    return 1;
+}
+
+// Get the proportional set size and the swapped out memory of a process from /proc/pid/smaps_rollup(measured
+// in KiB), the kernel walks the page tables of the process for it
+// Both are -1 if the file is not readable(the process belongs to another user), return 1 if succeed, otherwise
+// return 0(the process has exited)
+int get_smaps_rollup(const char* proc_dir, long* pss, long* swap)
+{
+    char text[4096];
+    *pss = -1;
+    *swap = -1;
+    if(read_proc_text(proc_dir, "smaps_rollup", text, sizeof(text)) == -1) {
+        if(errno == ESRCH) { // A kernel thread or a zombie has no memory
+            *pss = 0;
+            *swap = 0;
+        }
+        return errno == EACCES || errno == EPERM || errno == ESRCH;
+    }
+    *pss = 0;
+    *swap = 0;
+    const char* pos = strstr(text, "\nPss:");
+    if(pos) {
+        pos += 5;
+        *pss = parse_number(&pos);
+    }
+    pos = strstr(text, "\nSwap:");
+    if(pos) {
+        pos += 6;
+        *swap = parse_number(&pos);
+    }
+    return 1;
 }
 
-// Get EUID of a process
-int get_euid(const char* proc_dir)
+// Get EUID of a process, return 1 if succeed, otherwise return 0(the process has exited)
+int get_euid(const char* proc_dir, uid_t* euid)
 {
     FILE* status;// status file
-    if(open_proc_file(proc_dir, "status", &status) == 0) { // ERROR
-        printf("get_euid(): Cannot open status file of process %s\n", proc_dir);
-        exit(-1);
+    if(open_proc_file(proc_dir, "status", &status) == 0) {
+        return 0;
     }
     char line[512];
     // Read lines of the status file in order to find Effective UID
-    int EUID;// Effective UID
+    unsigned int EUID;// Effective UID
+    int found = 0;
     while(fgets(line, sizeof(line), status)) {
         if(strncmp(line, "Uid:", 4) == 0) {
-            sscanf(line, "Uid:\t%*d\t%d\t%*d\t%*d", &EUID);
+            found = sscanf(line, "Uid:\t%*u\t%u", &EUID) == 1;
             break;
         }
     }
     fclose(status);
-    return EUID;
+    *euid = EUID;
+    return found;
 }
 
-// Get username(maximum 7 chars) of a process by the EUID of the process
-void get_uname(const char* proc_dir, char* uname)
+#define UID_BUCKETS 256// Hash buckets of the username cache, chains grow beyond it
+
+// A UID and its username as displayed
+struct uid_entry {
+    uid_t uid;
+    char name[16];
+    struct uid_entry* next;
+};
+
+static struct uid_entry* uid_cache[UID_BUCKETS];
+static unsigned long uid_lookups = 0;
+static unsigned long uid_hits = 0;
+static unsigned long uid_entries = 0;
+static pthread_mutex_t uid_lock = PTHREAD_MUTEX_INITIALIZER;// The scan threads share the cache
+
+// Get the username(maximum 7 chars) of a UID, looked up once by getpwuid() and then kept for every later row
+// An unknown UID is displayed by its number
+void lookup_uname(uid_t uid, char* uname)
 {
-    int EUID = get_euid(proc_dir);
-    struct passwd* pw = getpwuid(EUID);
-    if(!pw) { //ERROR
-        printf("get_uname(): Cannot get username of process %s\n", proc_dir);
-        exit(-1);
-    }
-    int i;
-    int j = 0;
-    for(i = 0; i < strlen(pw->pw_name); i++) {
-        if(j < 7) {
-            uname[j] = pw->pw_name[i];
-            j++;
-        }
-        else if(j == 7) { // Truncate the username
-            uname[j] = '+';
-            j++;
-            break;
+    struct uid_entry* entry;
+    unsigned int bucket = uid % UID_BUCKETS;
+    pthread_mutex_lock(&uid_lock);
+    uid_lookups++;
+    for(entry = uid_cache[bucket]; entry; entry = entry->next) {
+        if(entry->uid == uid) {
+            uid_hits++;
+            strcpy(uname, entry->name);
+            pthread_mutex_unlock(&uid_lock);
+            return;
         }
     }
-    uname[j] = '\0';
-}
-
-// Get pid and ppid of a process
-void get_pid_and_ppid(const char* proc_dir, int* pid, int* ppid)
-{
-    FILE* stat;// stat file
-    if(open_proc_file(proc_dir, "stat", &stat) == 0) { // ERROR
-        printf("get_pid_and_ppid(): Cannot open stat file of process %s\n", proc_dir);
+    entry = malloc(sizeof(struct uid_entry));
+    if(!entry) { // ERROR
+        perror("lookup_uname()");
         exit(-1);
     }
-    // Read stat file to get pid and ppid
-    char line[1024];
-    if(fgets(line, sizeof(line), stat) != NULL) {
-        sscanf(line, "%d", pid);
-        int name_end_ind = get_end_of_proc_name(proc_dir);
-        if(name_end_ind == -1) {
-            printf("get_pid_and_ppid(): Name error of process %s\n", proc_dir);
-            fclose(stat);
-            exit(-1);
-        }
-        sscanf(line + name_end_ind + 4, "%d", ppid);
+    entry->uid = uid;
+    struct passwd pw_buf;
+    struct passwd* pw = NULL;
+    char pw_strings[1024];
+    getpwuid_r(uid, &pw_buf, pw_strings, sizeof(pw_strings), &pw);
+    if(!pw) { // Not in the passwd database(or NSS failed), use the number
+        snprintf(entry->name, sizeof(entry->name), "%u", (unsigned int)uid);
     }
-    else { //ERROR
-        printf("get_pid_and_ppid(): Cannot read stat file of process %s\n", proc_dir);
-        fclose(stat);
-        exit(-1);
+    else if(strlen(pw->pw_name) > 7) { // Truncate the username
+        snprintf(entry->name, sizeof(entry->name), "%.7s+", pw->pw_name);
+    }
+    else {
+        strcpy(entry->name, pw->pw_name);
     }
-    fclose(stat);
+    entry->next = uid_cache[bucket];
+    uid_cache[bucket] = entry;
+    uid_entries++;
+    strcpy(uname, entry->name);
+    pthread_mutex_unlock(&uid_lock);
 }
 
-// Get process start time(measured in jiffies)
-unsigned long get_start_jiffies(const char* proc_dir)
+// Get username(maximum 7 chars) of a process by the EUID of the process
+// Return 1 if succeed, otherwise return 0(the process has exited)
+int get_uname(const char* proc_dir, char* uname)
 {
-    FILE* stat;// stat file
-    if(open_proc_file(proc_dir, "stat", &stat) == 0) { // ERROR
-        printf("Cannot open stat file of process: %s\n", proc_dir);
-        exit(-1);
-    }
-    // Read the stat file to get start time(jiffies) of the process
-    unsigned long start_jiffies;
-    // Move file pointer to ppid
-    int name_end_ind = get_end_of_proc_name(proc_dir);
-    if(name_end_ind == -1) { // ERROR
-        printf("get_start_jiffies(): Name error of process %s\n", proc_dir);
-        fclose(stat);
-        exit(-1);
-    }
-    if(fseek(stat, name_end_ind + 4, SEEK_SET) == -1) { // ERROR
-        perror("get_start_jiffies(): Cannot seek stat file");
-        fclose(stat);
-        exit(-1);
-    }
-    int i;
-    for(i = 0; i < 19; i++) {
-        fscanf(stat, (i == 18) ? "%lu" : "%*s", &start_jiffies);// Only save the 22nd filed(process start time)
+    uid_t euid;
+    if(get_euid(proc_dir, &euid) == 0) {
+        return 0;
     }
-    fclose(stat);
-    return start_jiffies;
+    lookup_uname(euid, uname);
+    return 1;
 }
 
 // Get system boot time(measured in seconds)
@@ -184,69 +338,40 @@ time_t get_boot_time()
     return boot_time;
 }
 
-// Get process CPU utilization time(measured in jiffies)
-unsigned long get_proc_cpu_time(const char* proc_dir)
+// Get the time since boot(measured in seconds, the clock of the process start times)
+double get_uptime()
 {
-    FILE* stat;// stat file
-    if(open_proc_file(proc_dir, "stat", &stat) == 0) { // ERROR
-        printf("get_proc_cpu_time(): Cannot open stat file of process %s\n", proc_dir);
-        exit(-1);
-    }
-    // Read stat file to get utime and stime
-    unsigned long utime, stime;// User mode time，System mode time
-    char line[1024];
-    if(fgets(line, sizeof(line), stat) != NULL) {
-        int name_end_ind = get_end_of_proc_name(proc_dir);
-        if(name_end_ind == -1) {
-            printf("get_proc_cpu_time(): Name error of process %s\n", proc_dir);
-            fclose(stat);
-            exit(-1);
-        }
-        sscanf(line + name_end_ind + 4, "%*d %*d %*d %*d %*d %*d %*d %*d %*d %*d %lu %lu", &utime, &stime);
-    }
-    else { //ERROR
-        printf("get_proc_cpu_time(): Cannot read stat file of process %s\n", proc_dir);
-        fclose(stat);
+    struct timespec now;
+    if(clock_gettime(CLOCK_BOOTTIME, &now) == -1) {
+        perror("get_uptime(): Cannot get the boot time clock");
         exit(-1);
     }
-    fclose(stat);
-    unsigned long proc_cpu_time = utime + stime;// Process CPU time
-    return proc_cpu_time;
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
 // Get elapsed time of a process(measured in jiffies)
-unsigned long get_elapsed_time(const char* proc_dir, time_t boot_time, time_t current_time, long jiffies_per_sec)
+double get_elapsed_time(const struct proc_snapshot* snap, double uptime, long jiffies_per_sec)
 {
-    unsigned long proc_cpu_time = get_proc_cpu_time(proc_dir);
-    unsigned long start_jiffies = get_start_jiffies(proc_dir);
-    // Caculate the process start time(the time from the UNIX epoch to the present which is measured in seconds)
-    time_t start_time = boot_time + (start_jiffies / jiffies_per_sec);
-    time_t elapsed_sec = current_time - start_time;// Elapsed time(measured in seconds)
-    unsigned long elapsed_time = elapsed_sec * jiffies_per_sec;// Elapsed time(measured in jiffies)
-    return elapsed_time;
+    return uptime * jiffies_per_sec - snap->start_jiffies;
 }
 
-// Get CPU unilization(C) of a process
-int get_cpu_util(const char* proc_dir, time_t boot_time, time_t current_time, long jiffies_per_sec)
+// Get CPU unilization(C) of a process over its lifetime
+int get_cpu_util(const struct proc_snapshot* snap, double uptime, long jiffies_per_sec)
 {
-    unsigned long proc_cpu_time = get_proc_cpu_time(proc_dir);
-    unsigned long elapsed_time = get_elapsed_time(proc_dir, boot_time, current_time, jiffies_per_sec);
-    if(proc_cpu_time >= 0 && elapsed_time >=0) {
-        int cpu_util = ((double)proc_cpu_time / (double)elapsed_time) * 100.0;
-        return cpu_util;
-    }
-    else { //ERROR
-        printf("get_cpu_util(): CPU time error\n");
-        exit(-1);
+    unsigned long proc_cpu_time = snap->utime + snap->stime;// Process CPU time
+    double elapsed_time = get_elapsed_time(snap, uptime, jiffies_per_sec);
+    if(elapsed_time < 1) { // Started within the current jiffy
+        return 0;
     }
+    int cpu_util = ((double)proc_cpu_time / (double)elapsed_time) * 100.0;
+    return cpu_util;
 }
 
 // Get the start time of a process(STIME)
-void get_stime(const char* proc_dir, char* time_str, size_t buffer_size, time_t boot_time, time_t current_time, long jiffies_per_sec)
+void get_stime(const struct proc_snapshot* snap, char* time_str, size_t buffer_size, time_t boot_time, time_t current_time, long jiffies_per_sec)
 {
-    unsigned long start_jiffies = get_start_jiffies(proc_dir);
     // Caculate the process start time(the time from the UNIX epoch to the present which is measured in seconds)
-    time_t start_time = boot_time + (start_jiffies / jiffies_per_sec);
+    time_t start_time = boot_time + (snap->start_jiffies / jiffies_per_sec);
     struct tm start_tm;
     if(localtime_r(&start_time, &start_tm) != NULL) { // Get formatted time struct
         // If the procees was started in current day, return hour and minute, otherwise return month and date
@@ -268,106 +393,188 @@ void get_stime(const char* proc_dir, char* time_str, size_t buffer_size, time_t
     }
 }
 
-// Get the tty number of a process
-int get_tty_nr(const char* proc_dir)
+#define TTY_BUCKETS 1024// Hash buckets of the tty map, chains grow beyond it
+#define TTY_DRIVERS 64// Most tty drivers read from /proc/tty/drivers
+
+// A device number and its name under /dev("?" if no device file has it)
+struct tty_entry {
+    dev_t dev;
+    char name[32];
+    struct tty_entry* next;
+};
+
+// Device numbers of a tty driver(a line of /proc/tty/drivers)
+struct tty_driver {
+    char path[64];// Device file, or prefix of the device files of a range
+    unsigned int major_num;
+    unsigned int minor_start;
+    unsigned int minor_end;
+};
+
+static struct tty_entry* tty_map[TTY_BUCKETS];
+static struct tty_driver tty_drivers[TTY_DRIVERS];
+static int tty_driver_count = 0;
+static pthread_mutex_t tty_lock = PTHREAD_MUTEX_INITIALIZER;// The scan threads share the map
+
+// Return the hash bucket of a device number
+static unsigned int tty_bucket(dev_t dev)
 {
-    FILE* stat;// stat file
-    if(open_proc_file(proc_dir, "stat", &stat) == 0) { // ERROR
-        printf("get_tty_nr(): Cannot open stat file of process %s\n", proc_dir);
-        exit(-1);
+    return (unsigned int)((dev * 0x9e3779b97f4a7c15ULL) >> 32) % TTY_BUCKETS;
+}
+
+// Return the entry of a device number, NULL if it is not in the map
+static struct tty_entry* tty_map_find(dev_t dev)
+{
+    struct tty_entry* entry;
+    for(entry = tty_map[tty_bucket(dev)]; entry; entry = entry->next) {
+        if(entry->dev == dev) {
+            return entry;
+        }
     }
-    // Read stat file to get tty number
-    int tty_nr;
-    char line[1024];
-    if(fgets(line, sizeof(line), stat) != NULL) {
-        int name_end_ind = get_end_of_proc_name(proc_dir);
-        if(name_end_ind == -1) { // ERROR
-            printf("get_tty_nr(): Name error of process %s\n", proc_dir);
-            fclose(stat);
+    return NULL;
+}
+
+// Add or replace the name of a device number(path is the device file, "/dev/" is omitted)
+static void tty_map_add(dev_t dev, const char* path)
+{
+    struct tty_entry* entry = tty_map_find(dev);
+    if(!entry) {
+        entry = malloc(sizeof(struct tty_entry));
+        if(!entry) { // ERROR
+            perror("tty_map_add()");
             exit(-1);
         }
-        sscanf(line + name_end_ind + 4, "%*d %*d %*d %d", &tty_nr);
-        fclose(stat);
-        return tty_nr;
+        entry->dev = dev;
+        entry->next = tty_map[tty_bucket(dev)];
+        tty_map[tty_bucket(dev)] = entry;
     }
-    else { // ERROR
-        printf("get_tty_nr(): Cannot read stat file");
-        fclose(stat);
-        exit(-1);
+    if(strncmp(path, "/dev/", 5) == 0) {
+        path += 5;
     }
+    snprintf(entry->name, sizeof(entry->name), "%s", path);
 }
 
-// Match terminal, return 1 if succeed, otherwise return 0
-// Note that stdin, stdout and stderr actually refer to pts/0
-int match_term(const char* dev_path, int major_num, int minor_num, char* tty_name, size_t buffer_size)
+// Add the character devices of a directory whose names start with prefix(NULL for all) to the map
+static void tty_map_scan(const char* dev_path, const char* prefix)
 {
     DIR* dev_dir = opendir(dev_path);
     struct dirent* dir_entry;
     struct stat dev_stat;
     if(!dev_dir) {
-        perror("match_term(): Cannot open directory");
-        return 0;
+        perror("tty_map_scan(): Cannot open directory");
+        return;
     }
     while((dir_entry = readdir(dev_dir)) != NULL) {
+        if(dir_entry->d_name[0] == '.' || (prefix && strncmp(dir_entry->d_name, prefix, strlen(prefix)) != 0)) {
+            continue;
+        }
         char path[512];// Path of the device file
         snprintf(path, sizeof(path), "%s/%s", dev_path, dir_entry->d_name);
-        // Check if current device is matched
         if(stat(path, &dev_stat) == 0 && S_ISCHR(dev_stat.st_mode)) {
-            // Compare device number
-            if(major(dev_stat.st_rdev) == major_num && minor(dev_stat.st_rdev) == minor_num) { // Matched
-                if(strcmp(path, "/dev/stdin") == 0 
-                    || strcmp(path, "/dev/stdout") == 0 
-                    || strcmp(path, "/dev/stderr") == 0) {
-                        strncpy(tty_name, "pts/0", buffer_size - 1);
-                        closedir(dev_dir);
-                        return 1;
-                    }
-                else {
-                    int i;
-                    int j = 0;
-                    for(i = 5; i < strlen(path); i++) { // Omit "/dev/"
-                        if(j < buffer_size) {
-                            tty_name[j] = path[i];
-                            j++;
-                        }
-                    }
-                closedir(dev_dir);
-                return 1;
-                }
-            }
+            tty_map_add(dev_stat.st_rdev, path);
         }
     }
     closedir(dev_dir);
+}
+
+// Read the device numbers of the tty drivers from /proc/tty/drivers
+// Every line is "driver path major minor_start[-minor_end] type"
+static void tty_load_drivers()
+{
+    FILE* drivers = fopen("/proc/tty/drivers", "r");
+    if(!drivers) { // Not mounted, only the device files of the scans are known
+        return;
+    }
+    char line[256];
+    while(tty_driver_count < TTY_DRIVERS && fgets(line, sizeof(line), drivers)) {
+        struct tty_driver* driver = &tty_drivers[tty_driver_count];
+        char path[64];
+        int count = sscanf(line, "%*s %63s %u %u-%u", path, &driver->major_num, &driver->minor_start,
+            &driver->minor_end);
+        if(count < 3) {
+            continue;
+        }
+        if(count == 3) {
+            driver->minor_end = driver->minor_start;
+        }
+        strcpy(driver->path, path);
+        tty_driver_count++;
+    }
+    fclose(drivers);
+}
+
+// Build the map from device numbers to tty names once: /dev/tty*, /dev/console and /dev/pts
+void tty_map_build()
+{
+    tty_map_scan("/dev", "tty");
+    tty_map_scan("/dev", "console");
+    tty_map_scan("/dev/pts", NULL);
+    tty_load_drivers();
+}
+
+// Check whether a device file has a device number, add it to the map if true
+static int tty_try_path(const char* path, dev_t dev)
+{
+    struct stat dev_stat;
+    if(stat(path, &dev_stat) == 0 && S_ISCHR(dev_stat.st_mode) && dev_stat.st_rdev == dev) {
+        tty_map_add(dev, path);
+        return 1;
+    }
     return 0;
 }
 
+// Find the device file of a device number missing from the map(a terminal opened after the map was built)
+// The driver owning its major number gives the path: /dev/pts/N, /dev/ttyN, /dev/ttySN...
+static void tty_map_refresh(dev_t dev)
+{
+    unsigned int major_num = major(dev);
+    unsigned int minor_num = minor(dev);
+    int i;
+    for(i = 0; i < tty_driver_count; i++) {
+        struct tty_driver* driver = &tty_drivers[i];
+        if(driver->major_num != major_num || minor_num < driver->minor_start || minor_num > driver->minor_end) {
+            continue;
+        }
+        char path[sizeof(driver->path) + 16];// Driver path, a slash and the index
+        unsigned int index = minor_num - driver->minor_start;
+        if(driver->minor_start == driver->minor_end && tty_try_path(driver->path, dev)) {
+            return;
+        }
+        if(snprintf(path, sizeof(path), "%s%u", driver->path, index) < (int)sizeof(path) && tty_try_path(path, dev)) {
+            return;
+        }
+        if(snprintf(path, sizeof(path), "%s/%u", driver->path, index) < (int)sizeof(path) && tty_try_path(path, dev)) {
+            return;
+        }
+    }
+    tty_map_scan("/dev/pts", NULL);// No driver knows it, the pseudo terminals may have changed
+    if(!tty_map_find(dev)) {
+        tty_map_add(dev, "?");// Unknown tty, it is not looked up again
+    }
+}
+
 // Get tty name of a process
-void get_tty(const char* proc_dir, char* tty_name, size_t buffer_size)
+void get_tty(const struct proc_snapshot* snap, char* tty_name, size_t buffer_size)
 {
-    int tty_nr = get_tty_nr(proc_dir);
+    int tty_nr = snap->tty_nr;
     if(tty_nr == 0) { // The process does not use a tty device
         strncpy(tty_name, "?", buffer_size);// TTY name is set as ? 
         return;
     }
-    int major_num = major(tty_nr);// Major device numebr
-    int minor_num = minor(tty_nr);// Minor device number
-    // Match physical terminal
-    if(match_term("/dev", major_num, minor_num, tty_name, buffer_size) == 1) {
-        return;
-    }
-    else if(match_term("/dev/pts", major_num, minor_num, tty_name, buffer_size) == 1) { // Match pseudo terminal
-        return;
-    }
-    else { // Unknown tty
-        strncpy(tty_name, "?", buffer_size);// TTY name is set as ?
-        return;
+    dev_t dev = makedev(major(tty_nr), minor(tty_nr));
+    pthread_mutex_lock(&tty_lock);
+    struct tty_entry* entry = tty_map_find(dev);
+    if(!entry) {
+        tty_map_refresh(dev);
+        entry = tty_map_find(dev);
     }
+    snprintf(tty_name, buffer_size, "%s", entry->name);
+    pthread_mutex_unlock(&tty_lock);
 }
 
-// Get process CPU utilization time(TIME, measured in seconds)
-void get_time(const char* proc_dir, char* time_str, size_t buffer_size, long jiffies_per_sec)
+// Format a CPU time measured in jiffies as hh:mm:ss
+void format_cpu_time(unsigned long long proc_cpu_time, char* time_str, size_t buffer_size, long jiffies_per_sec)
 {
-    unsigned long proc_cpu_time = get_proc_cpu_time(proc_dir);
     unsigned long proc_cpu_time_sec = proc_cpu_time / jiffies_per_sec;
     unsigned long hours = proc_cpu_time_sec / 3600;
     unsigned long minutes = (proc_cpu_time_sec % 3600) / 60;
@@ -375,16 +582,21 @@ void get_time(const char* proc_dir, char* time_str, size_t buffer_size, long jif
     snprintf(time_str, buffer_size, "%02ld:%02ld:%02ld", hours, minutes, seconds);
 }
 
-// Get startup command of a process
-void get_cmd(const char* proc_dir, char* cmd, size_t buffer_size)
+// Get process CPU utilization time(TIME, measured in seconds)
+void get_time(const struct proc_snapshot* snap, char* time_str, size_t buffer_size, long jiffies_per_sec)
+{
+    format_cpu_time(snap->utime + snap->stime, time_str, buffer_size, jiffies_per_sec);
+}
+
+// Get startup command of a process, return 1 if succeed, otherwise return 0(the process has exited)
+int get_cmd(const char* proc_dir, char* cmd, size_t buffer_size)
 {
     FILE* cmdline;// cmdline file
-    if(open_proc_file(proc_dir, "cmdline", &cmdline) == 0) { // ERROR
-        printf("get_cmd(): Cannot open cmdline file of process %s\n", proc_dir);
-        exit(-1);
+    if(open_proc_file(proc_dir, "cmdline", &cmdline) == 0) {
+        return 0;
     }
-    // Read cmdline to get startup command(maximum 54 bytes)
-    size_t read_bytes = fread(cmd, 1, 54, cmdline);// Use fread to tackle with \0 in cmdline file
+    // Read cmdline to get startup command(maximum buffer_size - 1 bytes)
+    size_t read_bytes = fread(cmd, 1, buffer_size - 1, cmdline);// Use fread to tackle with \0 in cmdline file
     if(read_bytes > 0) {
         fclose(cmdline);
         int i;
@@ -398,54 +610,2014 @@ void get_cmd(const char* proc_dir, char* cmd, size_t buffer_size)
     else { // The process does not have a startup command, then get name of the process
         fclose(cmdline);
         FILE* comm;// comm file
-        if(open_proc_file(proc_dir, "comm", &comm) == 0) { // ERROR
-            printf("get_cmd(): Cannot open comm file of process %s\n", proc_dir);
-            exit(-1);
+        if(open_proc_file(proc_dir, "comm", &comm) == 0) {
+            return 0;
         }
         char proc_name[100];
-        if(fscanf(comm, "%s", proc_name) != EOF) {
-
-        }
-        else { // ERROR
-            printf("get_cmd(): Cannot read comm file of process %s\n", proc_dir);
+        if(fscanf(comm, "%99s", proc_name) == EOF) {
             fclose(comm);
-            exit(-1);
+            return 0;
         }
         fclose(comm);
         snprintf(cmd, buffer_size, "[%s]", proc_name);
     }
+    return 1;
 }
 
-int main()
-{
-    // Read /proc to get all processes
-    DIR* dir;
-    struct dirent* ptr;
-    dir = opendir("/proc");// Open /proc
-    time_t boot_time = get_boot_time();// System boot time
-    time_t current_time = time(NULL);// Current_time
-    long jiffies_per_sec = sysconf(_SC_CLK_TCK);// Get number of jiffies in per second
-    // Read process directories in /proc
-    printf("%-10s %-8s %-8s %-2s %-6s %-8s %-10s %-s\n", "UID", "PID", "PPID", "C" ,"STIME", "TTY" , "TIME" , "CMD");
-    while((ptr = readdir(dir)) != NULL) {
-        char* proc_dir = ptr->d_name;
-        if(ptr->d_type == DT_DIR && is_process(proc_dir) == 1) {
-            char uname[16];
-            get_uname(proc_dir, uname);
-            int pid, ppid;
-            get_pid_and_ppid(proc_dir, &pid, &ppid);
-            int C = get_cpu_util(proc_dir, boot_time, current_time, jiffies_per_sec);
-            char stime[16];
-            get_stime(proc_dir, stime, sizeof(stime), boot_time, current_time, jiffies_per_sec);
-            char tty[64];
-            get_tty(proc_dir, tty, sizeof(tty));
-            char time[64];
-            get_time(proc_dir, time, sizeof(time), jiffies_per_sec);
-            char cmd[256];
-            get_cmd(proc_dir, cmd, sizeof(cmd));
-            printf("%-10s %-8d %-8d %-2d %-6s %-8s %-10s %-s\n",uname, pid, ppid, C ,stime, tty, time, cmd);
-        }
-    }
-    closedir(dir);
-    exit(0);
-}
\ No newline at end of file
+#define SCAN_BATCH 512// PIDs handed to a scan thread at once
+#define SCAN_MAX_THREADS 64
+#define SCAN_DIRENT_BUFFER (64 * 1024)// Bytes of directory entries read from /proc by one getdents64()
+
+#define CMD_WIDTH 54// Bytes of the startup command shown
+#define CMD_MATCH_SIZE 4096// Bytes of the startup command matched by --cmd
+
+// What a process needs to be read for(the /proc files and lookups of the columns, the sort key and the filters)
+#define NEED_STAT 1// /proc/pid/stat
+#define NEED_STATUS 2// /proc/pid/status(EUID)
+#define NEED_UNAME 4// Username of the EUID
+#define NEED_TTY 8// Name of the tty
+#define NEED_CMDLINE 16// /proc/pid/cmdline(comm if it is empty)
+#define NEED_STATM 32// /proc/pid/statm
+#define NEED_SMAPS 64// /proc/pid/smaps_rollup(slow for large processes)
+
+// The columns of a process, only the fields needed by the query are filled
+struct proc_row {
+    struct proc_snapshot snap;
+    uid_t euid;
+    char uname[16];
+    int cpu_util;
+    double cpu_percent;// CPU utilization over the lifetime, or since the previous sample(live mode)
+    char tty[32];
+    char cmd[64];// Startup command(maximum CMD_WIDTH bytes)
+    char* full_cmd;// Whole startup command(jsonl and binary formats), NULL if it is not read
+    int depth;// Level in the process tree(--tree), 0 for a root and for a flat listing
+    unsigned long long tree_time;// CPU time of the process and its descendants(--tree, measured in jiffies)
+    unsigned long long tree_rss;// Resident set size of the process and its descendants(--tree, measured in KiB)
+    long tree_threads;// Threads of the process and its descendants(--tree)
+    int tid;// Thread ID(-L), the PID for a process
+    unsigned long shared;// Shared memory(measured in KiB)
+    long pss;// Proportional set size(measured in KiB), -1 if it is not readable
+    long swap;// Swapped out memory(measured in KiB), -1 if it is not readable
+};
+
+// Output formats(--format)
+enum output_format {
+    FORMAT_TEXT = 0,// Fixed-width columns
+    FORMAT_JSONL,// A JSON object per process and line
+    FORMAT_BINARY// Snapshots of showproc_snapshot.h
+};
+
+// Name, header, width and needs of a column
+struct column_def {
+    const char* name;
+    const char* header;
+    int width;
+    int needs;
+};
+
+static const struct column_def column_defs[COLUMN_COUNT] = {
+    {"user", "UID", 10, NEED_STATUS | NEED_UNAME},
+    {"uid", "EUID", 6, NEED_STATUS},
+    {"pid", "PID", 8, 0},
+    {"ppid", "PPID", 8, NEED_STAT},
+    {"c", "C", 2, NEED_STAT},
+    {"pcpu", "%CPU", 5, NEED_STAT},
+    {"stime", "STIME", 6, NEED_STAT},
+    {"tty", "TTY", 8, NEED_STAT | NEED_TTY},
+    {"time", "TIME", 10, NEED_STAT},
+    {"s", "S", 1, NEED_STAT},
+    {"nlwp", "NLWP", 5, NEED_STAT},
+    {"comm", "COMMAND", 16, NEED_STAT},
+    {"cmd", "CMD", 0, NEED_CMDLINE},
+    {"rss", "RSS", 8, NEED_STAT},
+    {"vsz", "VSZ", 10, NEED_STAT},
+    {"tree_time", "TTIME", 10, NEED_STAT},
+    {"tree_rss", "TRSS", 9, NEED_STAT},
+    {"tree_nlwp", "TNLWP", 6, NEED_STAT},
+    {"shr", "SHR", 8, NEED_STATM},
+    {"pss", "PSS", 8, NEED_SMAPS},
+    {"swap", "SWAP", 8, NEED_SMAPS},
+    {"lwp", "LWP", 8, 0}
+};
+
+// What a listing shows and which processes it keeps, set up before the scan and read only afterwards
+struct proc_query {
+    int columns[SNAPSHOT_MAX_COLUMNS];
+    int column_count;
+    int needs;// NEED_* flags
+    int sort_column;
+    int sort_descending;
+    long top;// Rows kept(the first ones by the sort), 0 for all
+    int* pids;// PIDs kept sorted, NULL for all
+    size_t pid_count;
+    uid_t* uids;// EUIDs kept, NULL for all
+    size_t uid_count;
+    regex_t cmd_regex;
+    int match_cmd;// Only keep processes whose startup command matches cmd_regex
+    int format;// enum output_format
+    int full_cmd;// Keep the whole startup command(a structured format shows the cmd column)
+    int tree;// Show the processes as a tree under their parents(--tree)
+    int list_threads;// A row per thread(-L)
+};
+
+static struct proc_query query;
+static unsigned long files_read[5];// stat, status, cmdline, statm and smaps_rollup files read(-D)
+
+// Times shared by all rows of a scan
+struct scan_clock {
+    time_t boot_time;
+    time_t current_time;
+    double uptime;
+    long jiffies_per_sec;
+};
+
+// PIDs listed from /proc, waiting for a scan thread
+struct pid_batch {
+    int count;
+    int pids[SCAN_BATCH];
+    struct pid_batch* next;
+};
+
+// Queue of the listed PIDs, filled by the main thread and emptied by the scan threads
+struct scan_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct pid_batch* head;
+    struct pid_batch* tail;
+    int done;// All PIDs have been listed
+};
+
+// A scan thread and the rows it has collected
+struct scan_worker {
+    pthread_t thread;
+    struct scan_queue* queue;
+    const struct scan_clock* clock;
+    struct proc_row* rows;
+    size_t count;
+    size_t capacity;
+};
+
+// Directory entry returned by getdents64()
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Check whether a value is in a sorted array of PIDs
+static int compare_int(const void* a, const void* b)
+{
+    int pid_a = *(const int*)a;
+    int pid_b = *(const int*)b;
+    return (pid_a > pid_b) - (pid_a < pid_b);
+}
+
+// Collect the memory fields of a process needed by the query which are not in /proc/pid/stat
+// Return 1 if succeed, otherwise return 0(the process has exited)
+int collect_memory(const char* proc_dir, struct proc_row* row)
+{
+    if(query.needs & NEED_STATM) {
+        __atomic_fetch_add(&files_read[3], 1, __ATOMIC_RELAXED);
+        if(get_statm(proc_dir, &row->shared) == 0) {
+            return 0;
+        }
+    }
+    if(query.needs & NEED_SMAPS) {
+        __atomic_fetch_add(&files_read[4], 1, __ATOMIC_RELAXED);
+        if(get_smaps_rollup(proc_dir, &row->pss, &row->swap) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Check whether a PID is selected by -p(every PID is selected without -p)
+static int pid_selected(int pid)
+{
+    return !query.pids || bsearch(&pid, query.pids, query.pid_count, sizeof(int), compare_int);
+}
+
+// Read the effective UID of a process from status and apply -u
+// Return 1 if succeed, 0 if the process has exited, -1 if -u drops it
+static int collect_status(const char* proc_dir, struct proc_row* row)
+{
+    __atomic_fetch_add(&files_read[1], 1, __ATOMIC_RELAXED);
+    if(get_euid(proc_dir, &row->euid) == 0) {
+        return 0;
+    }
+    size_t i;
+    for(i = 0; query.uids && i < query.uid_count && query.uids[i] != row->euid; i++) {
+    }
+    return query.uids && i == query.uid_count ? -1 : 1;
+}
+
+// Collect the fields of a process needed by the query, the cheap filters first
+// Return 1 if succeed, 0 if the process has exited, -1 if the filters drop it
+
+int collect_proc(int pid, const struct scan_clock* clock, struct proc_row* row)
+{
+    char proc_dir[16];
+    snprintf(proc_dir, sizeof(proc_dir), "%d", pid);
+    memset(row, 0, sizeof(struct proc_row));
+    row->snap.pid = pid;
+    row->tid = pid;
+    if(!pid_selected(pid)) {
+        return -1;
+    }
+    if(query.uids) { // status is the cheaper filter, read it before the command line
+        int ret = collect_status(proc_dir, row);
+        if(ret != 1) {
+            return ret;
+        }
+    }
+    char cmd[CMD_MATCH_SIZE];// Whole startup command if it is matched or kept
+    if(query.needs & NEED_CMDLINE) {
+        __atomic_fetch_add(&files_read[2], 1, __ATOMIC_RELAXED);
+        if(query.match_cmd || query.full_cmd) { // Match or keep the whole command, show its beginning
+            if(get_cmd(proc_dir, cmd, sizeof(cmd)) == 0) {
+                return 0;
+            }
+            if(query.match_cmd && regexec(&query.cmd_regex, cmd, 0, NULL, 0) != 0) {
+                return -1;
+            }
+            snprintf(row->cmd, sizeof(row->cmd), "%.*s", CMD_WIDTH, cmd);
+        }
+        else if(get_cmd(proc_dir, row->cmd, CMD_WIDTH + 1) == 0) {
+            return 0;
+        }
+    }
+    if((query.needs & NEED_STATUS) && !query.uids && collect_status(proc_dir, row) == 0) { // Only for the user column
+        return 0;
+    }
+    if(query.needs & NEED_STAT) {
+        __atomic_fetch_add(&files_read[0], 1, __ATOMIC_RELAXED);
+        if(read_proc_snapshot(proc_dir, &row->snap) == 0) {
+            return 0;
+        }
+        row->cpu_util = get_cpu_util(&row->snap, clock->uptime, clock->jiffies_per_sec);
+        double elapsed_time = get_elapsed_time(&row->snap, clock->uptime, clock->jiffies_per_sec);
+        row->cpu_percent = elapsed_time >= 1 ? 100.0 * (row->snap.utime + row->snap.stime) / elapsed_time : 0;
+    }
+    if(collect_memory(proc_dir, row) == 0) {
+        return 0;
+    }
+    if(query.needs & NEED_UNAME) {
+        lookup_uname(row->euid, row->uname);
+    }
+    if(query.needs & NEED_TTY) {
+        get_tty(&row->snap, row->tty, sizeof(row->tty));
+    }
+    if(query.full_cmd) {
+        size_t len = strlen(cmd);
+        while(len > 0 && cmd[len - 1] == ' ') { // The separator after the last argument
+            len--;
+        }
+        if(!(row->full_cmd = strndup(cmd, len))) { // ERROR
+            perror("collect_proc()");
+            exit(-1);
+        }
+    }
+    return 1;
+}
+
+// Release the strings of a row
+static void free_row(struct proc_row* row)
+{
+    free(row->full_cmd);
+    row->full_cmd = NULL;
+}
+
+// Compare two rows by the sort column of the query, then by PID
+static int compare_rows(const struct proc_row* row_a, const struct proc_row* row_b)
+{
+    int ret = 0;
+    switch(query.sort_column) {
+        case COL_USER:
+            ret = strcmp(row_a->uname, row_b->uname);
+            break;
+        case COL_UID:
+            ret = (row_a->euid > row_b->euid) - (row_a->euid < row_b->euid);
+            break;
+        case COL_PID:
+            ret = (row_a->snap.pid > row_b->snap.pid) - (row_a->snap.pid < row_b->snap.pid);
+            break;
+        case COL_PPID:
+            ret = (row_a->snap.ppid > row_b->snap.ppid) - (row_a->snap.ppid < row_b->snap.ppid);
+            break;
+        case COL_C:
+        case COL_PCPU:
+            ret = (row_a->cpu_percent > row_b->cpu_percent) - (row_a->cpu_percent < row_b->cpu_percent);
+            break;
+        case COL_STIME:
+            ret = (row_a->snap.start_jiffies > row_b->snap.start_jiffies)
+                - (row_a->snap.start_jiffies < row_b->snap.start_jiffies);
+            break;
+        case COL_TTY:
+            ret = strcmp(row_a->tty, row_b->tty);
+            break;
+        case COL_TIME: {
+            unsigned long time_a = row_a->snap.utime + row_a->snap.stime;
+            unsigned long time_b = row_b->snap.utime + row_b->snap.stime;
+            ret = (time_a > time_b) - (time_a < time_b);
+            break;
+        }
+        case COL_STATE:
+            ret = (row_a->snap.state > row_b->snap.state) - (row_a->snap.state < row_b->snap.state);
+            break;
+        case COL_NLWP:
+            ret = (row_a->snap.num_threads > row_b->snap.num_threads)
+                - (row_a->snap.num_threads < row_b->snap.num_threads);
+            break;
+        case COL_COMM:
+            ret = strcmp(row_a->snap.comm, row_b->snap.comm);
+            break;
+        case COL_CMD:
+            ret = strcmp(row_a->cmd, row_b->cmd);
+            break;
+        case COL_RSS:
+            ret = (row_a->snap.rss > row_b->snap.rss) - (row_a->snap.rss < row_b->snap.rss);
+            break;
+        case COL_VSZ:
+            ret = (row_a->snap.vsz > row_b->snap.vsz) - (row_a->snap.vsz < row_b->snap.vsz);
+            break;
+        case COL_TREE_TIME:
+            ret = (row_a->tree_time > row_b->tree_time) - (row_a->tree_time < row_b->tree_time);
+            break;
+        case COL_TREE_RSS:
+            ret = (row_a->tree_rss > row_b->tree_rss) - (row_a->tree_rss < row_b->tree_rss);
+            break;
+        case COL_TREE_NLWP:
+            ret = (row_a->tree_threads > row_b->tree_threads) - (row_a->tree_threads < row_b->tree_threads);
+            break;
+        case COL_SHR:
+            ret = (row_a->shared > row_b->shared) - (row_a->shared < row_b->shared);
+            break;
+        case COL_PSS:
+            ret = (row_a->pss > row_b->pss) - (row_a->pss < row_b->pss);
+            break;
+        case COL_SWAP:
+            ret = (row_a->swap > row_b->swap) - (row_a->swap < row_b->swap);
+            break;
+        case COL_LWP:
+            ret = (row_a->tid > row_b->tid) - (row_a->tid < row_b->tid);
+            break;
+    }
+    if(query.sort_descending) {
+        ret = -ret;
+    }
+    if(ret == 0) {
+        ret = (row_a->snap.pid > row_b->snap.pid) - (row_a->snap.pid < row_b->snap.pid);
+    }
+    if(ret == 0) { // Threads of a process(-L)
+        ret = (row_a->tid > row_b->tid) - (row_a->tid < row_b->tid);
+    }
+    return ret;
+}
+
+// qsort() comparator of rows
+static int compare_rows_qsort(const void* a, const void* b)
+{
+    return compare_rows(a, b);
+}
+
+// Offer a row to a bounded heap of at most query.top rows whose root sorts last, return 1 if it is kept
+// The heap keeps the first query.top rows by the sort of every row offered, the others are released
+static int heap_offer(struct proc_row* heap, size_t* count, struct proc_row* row)
+{
+    size_t i;
+    if(*count < (size_t)query.top) { // Not full, sift the new row up
+        i = (*count)++;
+        while(i > 0 && compare_rows(&heap[(i - 1) / 2], row) < 0) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = *row;
+        return 1;
+    }
+    if(compare_rows(row, &heap[0]) >= 0) { // Sorts after every kept row
+        free_row(row);
+        return 0;
+    }
+    // Replace the root and sift it down
+    free_row(&heap[0]);
+    i = 0;
+    while(2 * i + 1 < *count) {
+        size_t child = 2 * i + 1;
+        if(child + 1 < *count && compare_rows(&heap[child + 1], &heap[child]) > 0) {
+            child++;
+        }
+        if(compare_rows(&heap[child], row) <= 0) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = *row;
+    return 1;
+}
+
+// Format a column of a row
+void format_column(const struct proc_row* row, int column, const struct scan_clock* clock, char* buffer, size_t buffer_size)
+{
+    switch(column) {
+        case COL_USER:
+            snprintf(buffer, buffer_size, "%s", row->uname);
+            break;
+        case COL_UID:
+            snprintf(buffer, buffer_size, "%u", (unsigned int)row->euid);
+            break;
+        case COL_PID:
+            snprintf(buffer, buffer_size, "%d", row->snap.pid);
+            break;
+        case COL_PPID:
+            snprintf(buffer, buffer_size, "%d", row->snap.ppid);
+            break;
+        case COL_C:
+            snprintf(buffer, buffer_size, "%d", row->cpu_util);
+            break;
+        case COL_PCPU:
+            snprintf(buffer, buffer_size, "%.1f", row->cpu_percent);
+            break;
+        case COL_STIME:
+            get_stime(&row->snap, buffer, buffer_size, clock->boot_time, clock->current_time, clock->jiffies_per_sec);
+            break;
+        case COL_TTY:
+            snprintf(buffer, buffer_size, "%s", row->tty);
+            break;
+        case COL_TIME:
+            get_time(&row->snap, buffer, buffer_size, clock->jiffies_per_sec);
+            break;
+        case COL_STATE:
+            snprintf(buffer, buffer_size, "%c", row->snap.state);
+            break;
+        case COL_NLWP:
+            snprintf(buffer, buffer_size, "%ld", row->snap.num_threads);
+            break;
+        case COL_COMM:
+            snprintf(buffer, buffer_size, "%s", row->snap.comm);
+            break;
+        case COL_CMD:
+            snprintf(buffer, buffer_size, "%s", row->cmd);
+            break;
+        case COL_RSS:
+            snprintf(buffer, buffer_size, "%lu", row->snap.rss);
+            break;
+        case COL_VSZ:
+            snprintf(buffer, buffer_size, "%lu", row->snap.vsz);
+            break;
+        case COL_TREE_TIME:
+            format_cpu_time(row->tree_time, buffer, buffer_size, clock->jiffies_per_sec);
+            break;
+        case COL_TREE_RSS:
+            snprintf(buffer, buffer_size, "%llu", row->tree_rss);
+            break;
+        case COL_TREE_NLWP:
+            snprintf(buffer, buffer_size, "%ld", row->tree_threads);
+            break;
+        case COL_SHR:
+            snprintf(buffer, buffer_size, "%lu", row->shared);
+            break;
+        case COL_PSS:
+        case COL_SWAP: {
+            long value = column == COL_PSS ? row->pss : row->swap;
+            if(value < 0) { // Not readable
+                snprintf(buffer, buffer_size, "-");
+            }
+            else {
+                snprintf(buffer, buffer_size, "%ld", value);
+            }
+            break;
+        }
+        case COL_LWP:
+            snprintf(buffer, buffer_size, "%d", row->tid);
+            break;
+    }
+}
+
+// Print the header of the columns of the query
+void print_header()
+{
+    int i;
+    for(i = 0; i < query.column_count; i++) {
+        const struct column_def* def = &column_defs[query.columns[i]];
+        if(i == query.column_count - 1) {
+            printf("%s\n", def->header);
+        }
+        else {
+            printf("%-*s ", def->width, def->header);
+        }
+    }
+}
+
+// Print the columns of the query of a row, the command is indented by the level of the row in the tree
+void print_row(const struct proc_row* row, const struct scan_clock* clock)
+{
+    int i;
+    for(i = 0; i < query.column_count; i++) {
+        char value[128];
+        int width = column_defs[query.columns[i]].width;
+        int indent = query.columns[i] == COL_CMD || query.columns[i] == COL_COMM ? 2 * row->depth : 0;
+        format_column(row, query.columns[i], clock, value, sizeof(value));
+        if(i == query.column_count - 1) {
+            printf("%*s%s\n", indent, "", value);
+        }
+        else {
+            printf("%*s%-*s ", indent, "", width > indent ? width - indent : 0, value);
+        }
+    }
+}
+
+// Return the length of the valid UTF-8 sequence at str(a byte >= 0x80 starts it), 0 if it is not valid:
+// overlong forms, surrogates and code points above U+10FFFF are not valid
+static size_t utf8_length(const unsigned char* str)
+{
+    unsigned char c = str[0];
+    size_t len;
+    unsigned char low = 0x80;// Range of the second byte
+    unsigned char high = 0xbf;
+    if(c >= 0xc2 && c <= 0xdf) {
+        len = 2;
+    }
+    else if(c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        low = c == 0xe0 ? 0xa0 : 0x80;
+        high = c == 0xed ? 0x9f : 0xbf;
+    }
+    else if(c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        low = c == 0xf0 ? 0x90 : 0x80;
+        high = c == 0xf4 ? 0x8f : 0xbf;
+    }
+    else {
+        return 0;
+    }
+    if(str[1] < low || str[1] > high) {
+        return 0;
+    }
+    size_t i;
+    for(i = 2; i < len; i++) {
+        if(str[i] < 0x80 || str[i] > 0xbf) { // Also stops at the terminating NUL
+            return 0;
+        }
+    }
+    return len;
+}
+
+// Print a string as a JSON string, bytes which are not UTF-8 are replaced by U+FFFD
+static void print_json_string(const char* str)
+{
+    putchar('"');
+    while(*str) {
+        unsigned char c = *str;
+        size_t len = c < 0x80 ? 1 : utf8_length((const unsigned char*)str);
+        if(c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        }
+        else if(c < 0x20) {
+            printf("\\u%04x", c);
+        }
+        else if(len == 0) { // Not UTF-8(any user can set the command line of a process), the byte is replaced
+            fputs("\\ufffd", stdout);
+            len = 1;
+        }
+        else {
+            fwrite(str, 1, len, stdout);
+        }
+        str += len;
+    }
+    putchar('"');
+}
+
+// Print the columns of the query of a row as a JSON object on a line, sample is the number of the sample in
+// a stream(live mode or snapshots read back), 0 for a single listing
+void print_json_row(const struct proc_row* row, const struct scan_clock* clock, long sample)
+{
+    int i;
+    putchar('{');
+    for(i = 0; i < query.column_count; i++) {
+        int column = query.columns[i];
+        printf("%s\"%s\":", i ? "," : "", column_defs[column].name);
+        switch(column) {
+            case COL_USER:
+                print_json_string(row->uname);
+                break;
+            case COL_UID:
+                printf("%u", (unsigned int)row->euid);
+                break;
+            case COL_PID:
+                printf("%d", row->snap.pid);
+                break;
+            case COL_PPID:
+                printf("%d", row->snap.ppid);
+                break;
+            case COL_C:
+                printf("%d", row->cpu_util);
+                break;
+            case COL_PCPU:
+                printf("%.1f", row->cpu_percent);
+                break;
+            case COL_STIME: // Seconds since the UNIX epoch
+                printf("%.2f", clock->boot_time + (double)row->snap.start_jiffies / clock->jiffies_per_sec);
+                break;
+            case COL_TTY:
+                print_json_string(row->tty);
+                break;
+            case COL_TIME: // Seconds
+                printf("%.2f", (double)(row->snap.utime + row->snap.stime) / clock->jiffies_per_sec);
+                break;
+            case COL_STATE:
+                printf("\"%c\"", row->snap.state);
+                break;
+            case COL_NLWP:
+                printf("%ld", row->snap.num_threads);
+                break;
+            case COL_COMM:
+                print_json_string(row->snap.comm);
+                break;
+            case COL_CMD:
+                print_json_string(row->full_cmd ? row->full_cmd : row->cmd);
+                break;
+            case COL_RSS:
+                printf("%lu", row->snap.rss);
+                break;
+            case COL_VSZ:
+                printf("%lu", row->snap.vsz);
+                break;
+            case COL_TREE_TIME: // Seconds
+                printf("%.2f", (double)row->tree_time / clock->jiffies_per_sec);
+                break;
+            case COL_TREE_RSS:
+                printf("%llu", row->tree_rss);
+                break;
+            case COL_TREE_NLWP:
+                printf("%ld", row->tree_threads);
+                break;
+            case COL_SHR:
+                printf("%lu", row->shared);
+                break;
+            case COL_PSS:
+            case COL_SWAP: {
+                long value = column == COL_PSS ? row->pss : row->swap;
+                if(value < 0) { // Not readable
+                    fputs("null", stdout);
+                }
+                else {
+                    printf("%ld", value);
+                }
+                break;
+            }
+            case COL_LWP:
+                printf("%d", row->tid);
+                break;
+        }
+    }
+    if(query.tree) {
+        printf(",\"depth\":%d", row->depth);
+    }
+    if(sample) {
+        printf(",\"sample\":%ld", sample);
+    }
+    fputs("}\n", stdout);
+}
+
+// String table of a snapshot, equal strings are stored once
+struct string_table {
+    char* data;
+    size_t len;
+    size_t capacity;
+    uint32_t* slots;// Offsets + 1 of the strings by their hash, 0 for a free slot
+    size_t slot_mask;
+};
+
+// Add a string to a string table, return its offset
+static uint32_t string_table_add(struct string_table* table, const char* str)
+{
+    if(!*str) {
+        return 0;// The empty string at offset 0
+    }
+    unsigned long h = 0xcbf29ce484222325UL;// FNV-1a
+    const char* p;
+    for(p = str; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 0x100000001b3UL;
+    }
+    size_t slot = h & table->slot_mask;
+    while(table->slots[slot]) {
+        if(strcmp(table->data + table->slots[slot] - 1, str) == 0) {
+            return table->slots[slot] - 1;
+        }
+        slot = (slot + 1) & table->slot_mask;
+    }
+    size_t len = p - str + 1;
+    if(table->len + len > table->capacity) {
+        size_t capacity = table->capacity * 2;
+        while(capacity < table->len + len) {
+            capacity *= 2;
+        }
+        char* data = realloc(table->data, capacity);
+        if(!data) { // ERROR
+            perror("string_table_add()");
+            exit(-1);
+        }
+        table->data = data;
+        table->capacity = capacity;
+    }
+    uint32_t offset = table->len;
+    memcpy(table->data + offset, str, len);
+    table->len += len;
+    table->slots[slot] = offset + 1;
+    return offset;
+}
+
+// Write the rows of a sample to stdout as a binary snapshot by one write()
+void write_snapshot(const struct proc_row* const* rows, size_t count, const struct scan_clock* clock)
+{
+    struct string_table table;
+    table.capacity = 4096;
+    table.len = 1;
+    table.data = malloc(table.capacity);
+    table.slot_mask = 1;
+    while(table.slot_mask < 8 * count + 16) { // At most 4 strings per record, at most half of the slots used
+        table.slot_mask <<= 1;
+    }
+    table.slots = calloc(table.slot_mask, sizeof(uint32_t));
+    table.slot_mask--;
+    struct snapshot_record* records = calloc(count ? count : 1, sizeof(struct snapshot_record));
+    if(!table.data || !table.slots || !records) { // ERROR
+        perror("write_snapshot()");
+        exit(-1);
+    }
+    table.data[0] = '\0';
+    size_t i;
+    for(i = 0; i < count; i++) {
+        const struct proc_row* row = rows[i];
+        struct snapshot_record* record = &records[i];
+        record->pid = row->snap.pid;
+        record->ppid = row->snap.ppid;
+        record->euid = row->euid;
+        record->tty_nr = row->snap.tty_nr;
+        record->utime = row->snap.utime;
+        record->stime = row->snap.stime;
+        record->start_jiffies = row->snap.start_jiffies;
+        record->num_threads = row->snap.num_threads;
+        record->cpu_percent = row->cpu_percent;
+        record->cpu_util = row->cpu_util;
+        record->state = (unsigned char)row->snap.state;
+        record->user = string_table_add(&table, row->uname);
+        record->tty = string_table_add(&table, row->tty);
+        record->comm = string_table_add(&table, row->snap.comm);
+        record->cmd = string_table_add(&table, row->full_cmd ? row->full_cmd : row->cmd);
+        record->vsz = row->snap.vsz;
+        record->rss = row->snap.rss;
+        record->tree_time = row->tree_time;
+        record->tree_rss = row->tree_rss;
+        record->tree_threads = row->tree_threads;
+        record->depth = row->depth;
+        record->tid = row->tid;
+        record->shared = row->shared;
+        record->pss = row->pss;
+        record->swap = row->swap;
+    }
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.record_size = sizeof(struct snapshot_record);
+    header.record_count = count;
+    header.string_table_size = table.len;
+    header.boot_time = clock->boot_time;
+    header.sample_time = clock->current_time;
+    header.jiffies_per_sec = clock->jiffies_per_sec;
+    header.column_count = query.column_count;
+    int column;
+    for(column = 0; column < query.column_count; column++) {
+        header.columns[column] = query.columns[column];
+    }
+    // Header, records and strings go out together
+    size_t records_size = count * sizeof(struct snapshot_record);
+    size_t size = sizeof(header) + records_size + table.len;
+    char* buffer = malloc(size);
+    if(!buffer) { // ERROR
+        perror("write_snapshot()");
+        exit(-1);
+    }
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), records, records_size);
+    memcpy(buffer + sizeof(header) + records_size, table.data, table.len);
+    size_t off = 0;
+    while(off < size) {
+        ssize_t ret = write(STDOUT_FILENO, buffer + off, size - off);
+        if(ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if(ret == -1) { // ERROR
+            perror("write_snapshot(): Cannot write the snapshot");
+            exit(-1);
+        }
+        off += ret;
+    }
+    free(buffer);
+    free(records);
+    free(table.slots);
+    free(table.data);
+}
+
+// Print the rows of a sample in the format of the query(sample as print_json_row())
+void print_rows(const struct proc_row* const* rows, size_t count, const struct scan_clock* clock, long sample)
+{
+    size_t i;
+    switch(query.format) {
+        case FORMAT_TEXT:
+            print_header();
+            for(i = 0; i < count; i++) {
+                print_row(rows[i], clock);
+            }
+            break;
+        case FORMAT_JSONL:
+            for(i = 0; i < count; i++) {
+                print_json_row(rows[i], clock, sample);
+            }
+            break;
+        case FORMAT_BINARY:
+            write_snapshot(rows, count, clock);
+            break;
+    }
+}
+
+// Return a string of the string table of a snapshot, the empty string if the offset is damaged
+static const char* snapshot_string(const char* table, size_t table_size, uint32_t offset)
+{
+    return offset < table_size ? table + offset : "";
+}
+
+// Read a stream of binary snapshots(- for stdin) and print them in the text or JSON lines format
+// The columns stored in the snapshots are shown if use_stored_columns is not 0, otherwise the columns of the query
+// Return 0 if succeed, otherwise return -1
+#define SNAPSHOT_READ_CHUNK (1 << 20)// A stream is read in chunks of this size, its buffer grows with the data
+
+// Read size bytes of a snapshot into a new buffer with one more byte, the buffer only grows with the data read,
+// so a damaged size read from a pipe can not allocate more than the pipe holds
+// Return the buffer, or NULL if the stream ends first
+static char* read_snapshot_data(FILE* stream, size_t size)
+{
+    char* data = NULL;
+    size_t capacity = 0;
+    size_t len = 0;
+    do {
+        size_t chunk = size - len < SNAPSHOT_READ_CHUNK ? size - len : SNAPSHOT_READ_CHUNK;
+        if(len + chunk + 1 > capacity) {
+            capacity = capacity > (size + 1) / 2 ? size + 1 : capacity * 2;
+            if(capacity < len + chunk + 1) {
+                capacity = len + chunk + 1;
+            }
+            char* grown = realloc(data, capacity);
+            if(!grown) { // ERROR
+                perror("read_snapshots()");
+                exit(-1);
+            }
+            data = grown;
+        }
+        if(fread(data + len, 1, chunk, stream) != chunk) {
+            free(data);
+            return NULL;
+        }
+        len += chunk;
+    } while(len < size);
+    return data;
+}
+
+int read_snapshots(const char* file, int use_stored_columns)
+{
+    FILE* stream = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    if(!stream) {
+        perror(file);
+        return -1;
+    }
+    struct stat stream_stat;// The sizes of a regular file are checked against its length before they are read
+    int regular = fstat(fileno(stream), &stream_stat) == 0 && S_ISREG(stream_stat.st_mode);
+    struct snapshot_header header;
+    long sample = 0;
+    int ret = 0;
+    size_t header_bytes;
+    while(ret == 0 && (header_bytes = fread(&header, 1, sizeof(header), stream)) > 0) {
+        if(header_bytes < sizeof(header)) { // The stream ends inside a header
+            printf("%s: Truncated snapshot\n", file);
+            ret = -1;
+            break;
+        }
+        if(memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION
+            || header.record_size == 0 || header.column_count > SNAPSHOT_MAX_COLUMNS) {
+            printf("%s: Not a showproc snapshot of version %d\n", file, SNAPSHOT_VERSION);
+            ret = -1;
+            break;
+        }
+        // A damaged count or size must not overflow the sizes of the buffers
+        if(header.record_count > SIZE_MAX / header.record_size
+            || header.record_count > SIZE_MAX / sizeof(struct proc_row)
+            || header.string_table_size >= SIZE_MAX - header.record_count * header.record_size) {
+            printf("%s: Damaged snapshot\n", file);
+            ret = -1;
+            break;
+        }
+        size_t records_size = header.record_count * header.record_size;
+        off_t position = regular ? ftello(stream) : -1;
+        if(position != -1 && records_size + header.string_table_size > (uint64_t)(stream_stat.st_size - position)) {
+            printf("%s: Damaged or truncated snapshot\n", file);// More data than the rest of the file
+            ret = -1;
+            break;
+        }
+        // The rows are allocated once the data has arrived, their number is then bounded by the data
+        char* data = read_snapshot_data(stream, records_size + header.string_table_size);
+        if(!data) {
+            printf("%s: Truncated snapshot\n", file);
+            ret = -1;
+            break;
+        }
+        struct proc_row* rows = calloc(header.record_count ? header.record_count : 1, sizeof(struct proc_row));
+        const struct proc_row** order = malloc((header.record_count ? header.record_count : 1) * sizeof(struct proc_row*));
+        if(!rows || !order) { // ERROR
+            perror("read_snapshots()");
+            exit(-1);
+        }
+        const char* table = data + records_size;
+        data[records_size + header.string_table_size] = '\0';// Ends a damaged last string
+        size_t i;
+        for(i = 0; ret == 0 && i < header.record_count; i++) {
+            struct snapshot_record record;
+            memset(&record, 0, sizeof(record));
+            memcpy(&record, data + i * header.record_size, header.record_size < sizeof(record) ? header.record_size
+                : sizeof(record));// Fields appended by a later writer are skipped
+            struct proc_row* row = &rows[i];
+            row->snap.pid = record.pid;
+            row->snap.ppid = record.ppid;
+            row->euid = record.euid;
+            row->snap.tty_nr = record.tty_nr;
+            row->snap.utime = record.utime;
+            row->snap.stime = record.stime;
+            row->snap.start_jiffies = record.start_jiffies;
+            row->snap.num_threads = record.num_threads;
+            row->snap.state = record.state;
+            row->cpu_percent = record.cpu_percent;
+            row->cpu_util = record.cpu_util;
+            snprintf(row->uname, sizeof(row->uname), "%s", snapshot_string(table, header.string_table_size, record.user));
+            snprintf(row->tty, sizeof(row->tty), "%s", snapshot_string(table, header.string_table_size, record.tty));
+            snprintf(row->snap.comm, sizeof(row->snap.comm), "%s",
+                snapshot_string(table, header.string_table_size, record.comm));
+            row->full_cmd = (char*)snapshot_string(table, header.string_table_size, record.cmd);
+            snprintf(row->cmd, sizeof(row->cmd), "%.*s", CMD_WIDTH, row->full_cmd);
+            row->snap.vsz = record.vsz;
+            row->snap.rss = record.rss;
+            row->tree_time = record.tree_time;
+            row->tree_rss = record.tree_rss;
+            row->tree_threads = record.tree_threads;
+            row->depth = record.depth;
+            row->tid = record.tid ? record.tid : record.pid;// Not stored before -L
+            row->shared = record.shared;
+            row->pss = record.pss;
+            row->swap = record.swap;
+            query.tree |= row->depth > 0;// A snapshot of --tree
+            order[i] = row;
+        }
+        if(ret == 0 && use_stored_columns) {
+            query.column_count = 0;
+            for(i = 0; i < header.column_count; i++) {
+                if(header.columns[i] < COLUMN_COUNT) { // Columns of a later writer are skipped
+                    query.columns[query.column_count++] = header.columns[i];
+                }
+            }
+        }
+        if(ret == 0) {
+            struct scan_clock clock;
+            clock.boot_time = header.boot_time;
+            clock.current_time = header.sample_time;
+            clock.uptime = 0;
+            clock.jiffies_per_sec = header.jiffies_per_sec ? header.jiffies_per_sec : 100;
+            sample++;
+            if(query.format == FORMAT_TEXT && sample > 1) {
+                printf("\n");
+            }
+            print_rows(order, header.record_count, &clock, sample);
+        }
+        free(order);
+        free(rows);
+        free(data);
+    }
+    if(ferror(stream)) {
+        perror(file);
+        ret = -1;
+    }
+    if(stream != stdin) {
+        fclose(stream);
+    }
+    return ret;
+}
+
+// Find a column by its name, return -1 if unknown
+int find_column(const char* name)
+{
+    int i;
+    for(i = 0; i < COLUMN_COUNT; i++) {
+        if(strcmp(column_defs[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parse a comma separated list of columns into the query, return 0 if succeed, otherwise return -1
+int parse_columns(const char* list)
+{
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", list);
+    char* saveptr;
+    char* name;
+    query.column_count = 0;
+    for(name = strtok_r(buffer, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+        int column = find_column(name);
+        if(column == -1 || query.column_count == SNAPSHOT_MAX_COLUMNS) {
+            return -1;
+        }
+        query.columns[query.column_count++] = column;
+    }
+    return query.column_count > 0 ? 0 : -1;
+}
+
+// Parse a comma separated list of PIDs into the query, return 0 if succeed, otherwise return -1
+int parse_pids(const char* list)
+{
+    const char* p = list;
+    while(*p) {
+        char* end;
+        long pid = strtol(p, &end, 10);
+        if(end == p || pid <= 0 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        int* pids = realloc(query.pids, (query.pid_count + 1) * sizeof(int));
+        if(!pids) { // ERROR
+            perror("parse_pids()");
+            exit(-1);
+        }
+        query.pids = pids;
+        query.pids[query.pid_count++] = pid;
+        p = *end ? end + 1 : end;
+    }
+    qsort(query.pids, query.pid_count, sizeof(int), compare_int);
+    return query.pid_count > 0 ? 0 : -1;
+}
+
+// Parse a comma separated list of usernames or UIDs into the query, return 0 if succeed, otherwise return -1
+int parse_users(const char* list)
+{
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%s", list);
+    char* saveptr;
+    char* name;
+    for(name = strtok_r(buffer, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+        char* end;
+        uid_t uid = strtoul(name, &end, 10);
+        if(end == name || *end != '\0') {
+            struct passwd* pw = getpwnam(name);
+            if(!pw) {
+                printf("Unknown user %s\n", name);
+                return -1;
+            }
+            uid = pw->pw_uid;
+        }
+        uid_t* uids = realloc(query.uids, (query.uid_count + 1) * sizeof(uid_t));
+        if(!uids) { // ERROR
+            perror("parse_users()");
+            exit(-1);
+        }
+        query.uids = uids;
+        query.uids[query.uid_count++] = uid;
+    }
+    return query.uid_count > 0 ? 0 : -1;
+}
+
+// Parse a sort key "[+|-]column" into the query, return 0 if succeed, otherwise return -1
+int parse_sort(const char* key)
+{
+    query.sort_descending = key[0] == '-';
+    if(key[0] == '-' || key[0] == '+') {
+        key++;
+    }
+    query.sort_column = find_column(key);
+    return query.sort_column == -1 ? -1 : 0;
+}
+
+// Keep a row collected by a scan thread(only the first rows by the sort if --top is given)
+static void scan_keep(struct scan_worker* worker, struct proc_row* row)
+{
+    if(query.top) {
+        heap_offer(worker->rows, &worker->count, row);
+        return;
+    }
+    if(worker->count == worker->capacity) {
+        size_t capacity = worker->capacity ? worker->capacity * 2 : SCAN_BATCH;
+        struct proc_row* rows = realloc(worker->rows, capacity * sizeof(struct proc_row));
+        if(!rows) { // ERROR
+            perror("scan_keep()");
+            exit(-1);
+        }
+        worker->rows = rows;
+        worker->capacity = capacity;
+    }
+    worker->rows[worker->count++] = *row;
+}
+
+// Keep a row per thread of a collected process(-L) from /proc/pid/task/tid/stat, the other fields are the
+// ones of the process, which is released
+static void scan_threads(struct scan_worker* worker, struct proc_row* row)
+{
+    char task_path[64];
+    snprintf(task_path, sizeof(task_path), "/proc/%d/task", row->snap.pid);
+    DIR* task_dir = opendir(task_path);
+    if(!task_dir) { // The process has exited
+        free_row(row);
+        return;
+    }
+    struct dirent* entry;
+    while((entry = readdir(task_dir)) != NULL) {
+        if(is_process(entry->d_name) == 0) {
+            continue;
+        }
+        char thread_dir[64];
+        snprintf(thread_dir, sizeof(thread_dir), "%d/task/%d", row->snap.pid, atoi(entry->d_name));
+        struct proc_row thread = *row;
+        __atomic_fetch_add(&files_read[0], 1, __ATOMIC_RELAXED);
+        if(read_proc_snapshot(thread_dir, &thread.snap) == 0) { // The thread has exited
+            continue;
+        }
+        thread.tid = thread.snap.pid;
+        thread.snap.pid = row->snap.pid;
+        const struct scan_clock* clock = worker->clock;
+        thread.cpu_util = get_cpu_util(&thread.snap, clock->uptime, clock->jiffies_per_sec);
+        double elapsed_time = get_elapsed_time(&thread.snap, clock->uptime, clock->jiffies_per_sec);
+        thread.cpu_percent = elapsed_time >= 1 ? 100.0 * (thread.snap.utime + thread.snap.stime) / elapsed_time : 0;
+        if(row->full_cmd && !(thread.full_cmd = strdup(row->full_cmd))) { // ERROR
+            perror("scan_threads()");
+            exit(-1);
+        }
+        scan_keep(worker, &thread);
+    }
+    closedir(task_dir);
+    free_row(row);
+}
+
+// Add a batch of PIDs to the queue(NULL to mark the end of the listing)
+static void scan_queue_push(struct scan_queue* queue, struct pid_batch* batch)
+{
+    pthread_mutex_lock(&queue->lock);
+    if(!batch) {
+        queue->done = 1;
+    }
+    else if(queue->tail) {
+        queue->tail->next = batch;
+        queue->tail = batch;
+    }
+    else {
+        queue->head = queue->tail = batch;
+    }
+    pthread_cond_broadcast(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take a batch of PIDs from the queue, wait until one is listed, return NULL after the end of the listing
+static struct pid_batch* scan_queue_pop(struct scan_queue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while(!queue->head && !queue->done) {
+        pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+    struct pid_batch* batch = queue->head;
+    if(batch) {
+        queue->head = batch->next;
+        if(!queue->head) {
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return batch;
+}
+
+// Scan thread: collect the processes of the batches into the rows of the thread
+static void* scan_thread(void* arg)
+{
+    struct scan_worker* worker = arg;
+    struct pid_batch* batch;
+    while((batch = scan_queue_pop(worker->queue)) != NULL) {
+        int i;
+        for(i = 0; i < batch->count; i++) {
+            struct proc_row row;
+            if(collect_proc(batch->pids[i], worker->clock, &row) != 1) {
+                continue;
+            }
+            if(query.list_threads) {
+                scan_threads(worker, &row);
+            }
+            else {
+                scan_keep(worker, &row);
+            }
+        }
+        free(batch);
+    }
+    return NULL;
+}
+
+// List the PIDs of /proc by getdents64() in batches while threads threads collect them
+// Return the rows of the processes kept by the query in its order(*count is set), the caller should free it
+struct proc_row* scan_processes(int threads, const struct scan_clock* clock, size_t* count)
+{
+    int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY);
+    if(proc_fd == -1) { // ERROR
+        perror("scan_processes(): Cannot open /proc");
+        exit(-1);
+    }
+    struct scan_queue queue;
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+    struct scan_worker workers[SCAN_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    int i;
+    for(i = 0; i < threads; i++) {
+        workers[i].queue = &queue;
+        workers[i].clock = clock;
+        if(query.top && !(workers[i].rows = malloc(query.top * sizeof(struct proc_row)))) { // ERROR
+            perror("scan_processes()");
+            exit(-1);
+        }
+        workers[i].capacity = query.top;
+        if(pthread_create(&workers[i].thread, NULL, scan_thread, &workers[i]) != 0) { // ERROR
+            printf("scan_processes(): Cannot create a scan thread\n");
+            exit(-1);
+        }
+    }
+    char* buffer = malloc(SCAN_DIRENT_BUFFER);
+    struct pid_batch* batch = NULL;
+    long len;
+    if(!buffer) { // ERROR
+        perror("scan_processes()");
+        exit(-1);
+    }
+    while((len = syscall(SYS_getdents64, proc_fd, buffer, SCAN_DIRENT_BUFFER)) > 0) {
+        long off;
+        for(off = 0; off < len; off += ((struct linux_dirent64*)(buffer + off))->d_reclen) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + off);
+            if(entry->d_type != DT_DIR || entry->d_name[0] < '0' || entry->d_name[0] > '9'
+                || is_process(entry->d_name) == 0) {
+                continue;
+            }
+            if(!batch && !(batch = calloc(1, sizeof(struct pid_batch)))) { // ERROR
+                perror("scan_processes()");
+                exit(-1);
+            }
+            batch->pids[batch->count++] = atoi(entry->d_name);
+            if(batch->count == SCAN_BATCH) {
+                scan_queue_push(&queue, batch);
+                batch = NULL;
+            }
+        }
+    }
+    if(len == -1) { // ERROR
+        perror("scan_processes(): Cannot read /proc");
+        exit(-1);
+    }
+    if(batch) {
+        scan_queue_push(&queue, batch);
+    }
+    scan_queue_push(&queue, NULL);
+    free(buffer);
+    close(proc_fd);
+    // Merge the rows of the threads
+    size_t total = 0;
+    for(i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+    }
+    struct proc_row* rows = malloc((total ? total : 1) * sizeof(struct proc_row));
+    if(!rows) { // ERROR
+        perror("scan_processes()");
+        exit(-1);
+    }
+    size_t merged = 0;
+    for(i = 0; i < threads; i++) {
+        memcpy(rows + merged, workers[i].rows, workers[i].count * sizeof(struct proc_row));
+        merged += workers[i].count;
+        free(workers[i].rows);
+    }
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.ready);
+    qsort(rows, total, sizeof(struct proc_row), compare_rows_qsort);
+    if(query.top && total > (size_t)query.top) { // The first rows of every thread, keep the first ones of all
+        size_t j;
+        for(j = query.top; j < total; j++) {
+            free_row(&rows[j]);
+        }
+        total = query.top;
+    }
+    *count = total;
+    return rows;
+}
+
+// List the processes once
+void print_processes(int threads, const struct scan_clock* clock)
+{
+    size_t count;
+    struct proc_row* rows = scan_processes(threads, clock, &count);
+    const struct proc_row** order = calloc(count ? count : 1, sizeof(struct proc_row*));
+    if(!order) { // ERROR
+        perror("print_processes()");
+        exit(-1);
+    }
+    size_t i;
+    for(i = 0; i < count; i++) {
+        order[i] = &rows[i];
+    }
+    print_rows(order, count, clock, 0);
+    for(i = 0; i < count; i++) {
+        free_row(&rows[i]);
+    }
+    free(order);
+    free(rows);
+}
+
+// Rows of a scan linked to their parents(--tree), children[first_child[i] .. first_child[i + 1]] are the
+// children of rows[i] in the order of the rows
+struct proc_tree {
+    struct proc_row* rows;
+    size_t count;
+    size_t* parent;// Index of the parent row, count for a root
+    size_t* first_child;// count + 1 entries
+    struct proc_row** children;
+    struct proc_row** roots;
+    size_t root_count;
+};
+
+// qsort() comparator of row pointers
+static int compare_row_pointers(const void* a, const void* b)
+{
+    return compare_rows(*(const struct proc_row* const*)a, *(const struct proc_row* const*)b);
+}
+
+// Index the rows of a scan by their parents in one pass: a hash table of the PIDs finds the row of every PPID,
+// then the children are counted and placed by the running sums of the counts
+// A process whose parent is not listed(PPID 0 or filtered out) is a root
+static void tree_build(struct proc_tree* tree, struct proc_row* rows, size_t count)
+{
+    size_t mask = 1;
+    while(mask < 2 * count) { // At most half of the slots used
+        mask <<= 1;
+    }
+    size_t* slots = calloc(mask, sizeof(size_t));// Row index + 1, 0 for an empty slot
+    size_t* next = malloc((count ? count : 1) * sizeof(size_t));
+    tree->rows = rows;
+    tree->count = count;
+    tree->parent = malloc((count ? count : 1) * sizeof(size_t));
+    tree->first_child = calloc(count + 1, sizeof(size_t));
+    tree->children = malloc((count ? count : 1) * sizeof(struct proc_row*));
+    tree->roots = malloc((count ? count : 1) * sizeof(struct proc_row*));
+    tree->root_count = 0;
+    if(!slots || !next || !tree->parent || !tree->first_child || !tree->children || !tree->roots) { // ERROR
+        perror("tree_build()");
+        exit(-1);
+    }
+    mask--;
+    size_t i;
+    for(i = 0; i < count; i++) {
+        size_t slot = ((unsigned int)rows[i].snap.pid * 2654435761u) & mask;
+        while(slots[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = i + 1;
+    }
+    for(i = 0; i < count; i++) {
+        size_t slot = ((unsigned int)rows[i].snap.ppid * 2654435761u) & mask;
+        tree->parent[i] = count;
+        while(slots[slot] && rows[slots[slot] - 1].snap.pid != rows[i].snap.ppid) {
+            slot = (slot + 1) & mask;
+        }
+        if(slots[slot] && rows[i].snap.ppid != rows[i].snap.pid) {
+            tree->parent[i] = slots[slot] - 1;
+            tree->first_child[tree->parent[i] + 1]++;
+        }
+        else {
+            tree->roots[tree->root_count++] = &rows[i];
+        }
+        rows[i].depth = -1;// Not walked yet
+        rows[i].tree_time = 0;
+        rows[i].tree_rss = 0;
+        rows[i].tree_threads = 0;
+    }
+    for(i = 0; i < count; i++) {
+        tree->first_child[i + 1] += tree->first_child[i];
+        next[i] = tree->first_child[i];
+    }
+    for(i = 0; i < count; i++) {
+        if(tree->parent[i] != count) {
+            tree->children[next[tree->parent[i]]++] = &rows[i];
+        }
+    }
+    free(next);
+    free(slots);
+}
+
+// Walk the subtrees of the roots in pre-order into order and set the level and the parent of every row
+// walked, rows not reached from a root(a loop of PPIDs raced by the scan) become roots if adopt is not 0
+// Every row should have depth -1 before, return the rows walked
+static size_t tree_walk(struct proc_tree* tree, const struct proc_row** order, int adopt)
+{
+    struct proc_row** stack = malloc((tree->count ? tree->count : 1) * sizeof(struct proc_row*));
+    if(!stack) { // ERROR
+        perror("tree_walk()");
+        exit(-1);
+    }
+    size_t walked = 0;
+    size_t height = 0;
+    size_t root = 0;
+    size_t i = 0;
+    while(1) {
+        if(height == 0) {
+            while(adopt && root == tree->root_count && i < tree->count) { // Every row is walked once
+                if(tree->rows[i].depth == -1) {
+                    tree->roots[tree->root_count++] = &tree->rows[i];
+                }
+                i++;
+            }
+            if(root == tree->root_count) {
+                break;
+            }
+            stack[height++] = tree->roots[root];
+            tree->roots[root++]->depth = 0;
+            tree->parent[stack[0] - tree->rows] = tree->count;
+        }
+        struct proc_row* row = stack[--height];
+        size_t index = row - tree->rows;
+        order[walked++] = row;
+        size_t child;
+        for(child = tree->first_child[index + 1]; child-- > tree->first_child[index];) { // The first child on top
+            if(tree->children[child]->depth == -1) {
+                tree->children[child]->depth = row->depth + 1;
+                tree->parent[tree->children[child] - tree->rows] = index;
+                stack[height++] = tree->children[child];
+            }
+        }
+    }
+    free(stack);
+    return walked;
+}
+
+// List the processes once as a tree, every process with the CPU time, the resident set size and the threads
+// of its subtree, the children of a process and the roots are in the order of the query(--top keeps roots)
+void print_tree(int threads, const struct scan_clock* clock)
+{
+    long top = query.top;
+    query.top = 0;// The descendants of the first processes are kept too
+    size_t count;
+    struct proc_row* rows = scan_processes(threads, clock, &count);
+    query.top = top;
+    struct proc_tree tree;
+    tree_build(&tree, rows, count);
+    const struct proc_row** order = malloc((count ? count : 1) * sizeof(struct proc_row*));
+    if(!order) { // ERROR
+        perror("print_tree()");
+        exit(-1);
+    }
+    size_t walked = tree_walk(&tree, order, 1);
+    size_t i;
+    for(i = walked; i-- > 0;) { // The descendants of a row come after it in pre-order, so they are summed first
+        struct proc_row* row = (struct proc_row*)order[i];
+        size_t parent = tree.parent[row - rows];
+        row->tree_time += row->snap.utime + row->snap.stime;
+        row->tree_rss += row->snap.rss;
+        row->tree_threads += row->snap.num_threads;
+        if(parent != count) {
+            rows[parent].tree_time += row->tree_time;
+            rows[parent].tree_rss += row->tree_rss;
+            rows[parent].tree_threads += row->tree_threads;
+        }
+    }
+    int sort_subtrees = query.sort_column == COL_TREE_TIME || query.sort_column == COL_TREE_RSS
+        || query.sort_column == COL_TREE_NLWP;
+    if(sort_subtrees || (query.top && tree.root_count > (size_t)query.top)) { // Walk the tree again in its new order
+        for(i = 0; i < count; i++) {
+            if(sort_subtrees) {
+                qsort(tree.children + tree.first_child[i], tree.first_child[i + 1] - tree.first_child[i],
+                    sizeof(struct proc_row*), compare_row_pointers);
+            }
+            rows[i].depth = -1;
+        }
+        if(sort_subtrees) {
+            qsort(tree.roots, tree.root_count, sizeof(struct proc_row*), compare_row_pointers);
+        }
+        if(query.top && tree.root_count > (size_t)query.top) {
+            tree.root_count = query.top;
+        }
+        walked = tree_walk(&tree, order, 0);
+    }
+    print_rows(order, walked, clock, 0);
+    for(i = 0; i < count; i++) {
+        free_row(&rows[i]);
+    }
+    free(tree.parent);
+    free(tree.first_child);
+    free(tree.children);
+    free(tree.roots);
+    free(order);
+    free(rows);
+}
+
+#define LIVE_SCREEN_LINES 2// Lines of a live screen above the rows
+
+// A process followed by the live mode, its stat file stays open between the samples
+struct proc_track {
+    struct proc_row row;
+    int stat_fd;// -1 if out of descriptors, the file is then opened at every sample
+    unsigned long last_cpu;// utime + stime at the previous sample(measured in jiffies)
+    int dropped;// Dropped by the filters, only its start time is read again to notice a reused PID(unless -p drops it)
+};
+
+// State of the live mode
+struct live_state {
+    int proc_fd;// /proc, listed again at every sample
+    struct scan_clock clock;
+    double interval;// Seconds between two samples
+    struct proc_track* tracks;// Processes of the previous sample sorted by PID
+    size_t count;
+    int* pids;// PIDs listed by the current sample
+    size_t pid_count;
+    size_t pid_capacity;
+    double last_uptime;// Time of the previous sample, 0 before the first one
+    unsigned long long refresh_ns;// Total time of the samples
+    unsigned long long refresh_procs;// Processes sampled in total
+    long samples;// Samples shown
+};
+
+// List the PIDs of /proc again into live->pids sorted
+static void live_list_pids(struct live_state* live)
+{
+    char buffer[SCAN_DIRENT_BUFFER];
+    long len;
+    int sorted = 1;
+    live->pid_count = 0;
+    if(lseek(live->proc_fd, 0, SEEK_SET) == -1) { // ERROR
+        perror("live_list_pids(): Cannot rewind /proc");
+        exit(-1);
+    }
+    while((len = syscall(SYS_getdents64, live->proc_fd, buffer, sizeof(buffer))) > 0) {
+        long off;
+        for(off = 0; off < len; off += ((struct linux_dirent64*)(buffer + off))->d_reclen) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + off);
+            if(entry->d_type != DT_DIR || entry->d_name[0] < '0' || entry->d_name[0] > '9'
+                || is_process(entry->d_name) == 0) {
+                continue;
+            }
+            if(live->pid_count == live->pid_capacity) {
+                size_t capacity = live->pid_capacity ? live->pid_capacity * 2 : SCAN_BATCH;
+                int* pids = realloc(live->pids, capacity * sizeof(int));
+                if(!pids) { // ERROR
+                    perror("live_list_pids()");
+                    exit(-1);
+                }
+                live->pids = pids;
+                live->pid_capacity = capacity;
+            }
+            int pid = atoi(entry->d_name);
+            if(live->pid_count > 0 && pid < live->pids[live->pid_count - 1]) {
+                sorted = 0;
+            }
+            live->pids[live->pid_count++] = pid;
+        }
+    }
+    if(len == -1) { // ERROR
+        perror("live_list_pids(): Cannot read /proc");
+        exit(-1);
+    }
+    if(!sorted) { // /proc lists the processes by PID, so this is rarely needed
+        qsort(live->pids, live->pid_count, sizeof(int), compare_int);
+    }
+}
+
+// Start following a new process, return 1 if succeed, otherwise return 0(the process has exited)
+// A process dropped by the filters is followed by its start time only
+static int live_track_new(struct live_state* live, int pid, double seconds, struct proc_track* track)
+{
+    int ret = collect_proc(pid, &live->clock, &track->row);
+    char proc_dir[16];
+    snprintf(proc_dir, sizeof(proc_dir), "%d", pid);
+    track->stat_fd = -1;
+    track->dropped = ret == -1;
+    if(track->dropped) { // The filters may have run before stat was read, a PID not selected by -p needs no stat
+        return pid_selected(pid) ? read_proc_snapshot(proc_dir, &track->row.snap) : 1;
+    }
+    if(ret != 1) {
+        return 0;
+    }
+    track->stat_fd = open_proc_stat(proc_dir);
+    if(track->stat_fd == -1 && errno != EMFILE && errno != ENFILE) {
+        free_row(&track->row);
+        return 0;
+    }
+    track->last_cpu = track->row.snap.utime + track->row.snap.stime;
+    // A process started after the previous sample spent all its CPU time within the interval
+    double window = get_elapsed_time(&track->row.snap, live->clock.uptime, live->clock.jiffies_per_sec);
+    if(seconds * live->clock.jiffies_per_sec < window) {
+        window = seconds * live->clock.jiffies_per_sec;
+    }
+    track->row.cpu_percent = live->last_uptime > 0 && window >= 1 ? 100.0 * track->last_cpu / window : 0;
+    return 1;
+}
+
+// Sample a followed process again, return 1 if succeed, otherwise return 0(the process has exited, or its PID
+// has been reused by a process which is collected again)
+static int live_track_update(struct live_state* live, double seconds, struct proc_track* track)
+{
+    if(track->dropped && !pid_selected(track->row.snap.pid)) { // Never shown, whichever process has the PID
+        return 1;
+    }
+    struct proc_snapshot snap;
+    char proc_dir[16];
+    snprintf(proc_dir, sizeof(proc_dir), "%d", track->row.snap.pid);
+    int ret = track->stat_fd != -1 ? pread_proc_snapshot(track->stat_fd, proc_dir, &snap)
+        : read_proc_snapshot(proc_dir, &snap);
+    if(ret == 0 || snap.start_jiffies != track->row.snap.start_jiffies) { // Exited, or the PID has been reused
+        return 0;
+    }
+    if(track->dropped) {
+        return 1;
+    }
+    if(collect_memory(proc_dir, &track->row) == 0) {
+        return 0;
+    }
+    unsigned long cpu = snap.utime + snap.stime;
+    track->row.cpu_percent = 100.0 * (cpu - track->last_cpu) / (seconds * live->clock.jiffies_per_sec);
+    track->last_cpu = cpu;
+    track->row.snap = snap;
+    return 1;
+}
+
+// Stop following a process
+static void live_track_close(struct proc_track* track)
+{
+    if(track->stat_fd != -1) {
+        close(track->stat_fd);
+    }
+    free_row(&track->row);
+}
+
+// Take a sample: list /proc, then merge the sorted PIDs with the processes of the previous sample
+// A process still running is read again by pread(), only new processes are collected from scratch
+static void live_refresh(struct live_state* live)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    live->clock.current_time = time(NULL);
+    live->clock.uptime = get_uptime();
+    double seconds = live->clock.uptime - live->last_uptime;
+    live_list_pids(live);
+    struct proc_track* tracks = malloc((live->pid_count ? live->pid_count : 1) * sizeof(struct proc_track));
+    if(!tracks) { // ERROR
+        perror("live_refresh()");
+        exit(-1);
+    }
+    size_t count = 0;
+    size_t old = 0;
+    size_t i;
+    for(i = 0; i < live->pid_count; i++) {
+        int pid = live->pids[i];
+        while(old < live->count && live->tracks[old].row.snap.pid < pid) { // Exited
+            live_track_close(&live->tracks[old++]);
+        }
+        struct proc_track* track = &tracks[count];
+        if(old < live->count && live->tracks[old].row.snap.pid == pid) {
+            *track = live->tracks[old++];
+            if(live_track_update(live, seconds, track) == 1) {
+                count++;
+                continue;
+            }
+            live_track_close(track);
+        }
+        if(live_track_new(live, pid, seconds, track) == 1) {
+            count++;
+        }
+    }
+    while(old < live->count) {
+        live_track_close(&live->tracks[old++]);
+    }
+    free(live->tracks);
+    live->tracks = tracks;
+    live->count = count;
+    live->last_uptime = live->clock.uptime;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    live->refresh_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    live->refresh_procs += live->pid_count;
+}
+
+// Compare two followed processes by the sort of the query
+static int compare_tracks(const void* a, const void* b)
+{
+    return compare_rows(&(*(const struct proc_track* const*)a)->row, &(*(const struct proc_track* const*)b)->row);
+}
+
+// Show the processes of a sample in the order of the query(as many as fit into the terminal)
+static void live_print(struct live_state* live)
+{
+    struct proc_track** order = malloc((live->count ? live->count : 1) * sizeof(struct proc_track*));
+    if(!order) { // ERROR
+        perror("live_print()");
+        exit(-1);
+    }
+    size_t shown = 0;
+    size_t i;
+    for(i = 0; i < live->count; i++) {
+        if(!live->tracks[i].dropped) {
+            order[shown++] = &live->tracks[i];
+        }
+    }
+    size_t limit = shown;
+    int screen = query.format == FORMAT_TEXT && isatty(STDOUT_FILENO);
+    struct winsize window;
+    if(screen && ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_row > LIVE_SCREEN_LINES) {
+        size_t rows = window.ws_row - LIVE_SCREEN_LINES - 1;// Rows left below the screen lines
+        if(rows < limit) {
+            limit = rows;
+        }
+    }
+    if(query.top && (size_t)query.top < limit) {
+        limit = query.top;
+    }
+    qsort(order, shown, sizeof(struct proc_track*), compare_tracks);
+    live->samples++;
+    if(query.format != FORMAT_TEXT) { // A stream of samples
+        const struct proc_row** rows = malloc((limit ? limit : 1) * sizeof(struct proc_row*));
+        if(!rows) { // ERROR
+            perror("live_print()");
+            exit(-1);
+        }
+        for(i = 0; i < limit; i++) {
+            rows[i] = &order[i]->row;
+        }
+        print_rows(rows, limit, &live->clock, live->samples);
+        fflush(stdout);
+        free(rows);
+        free(order);
+        return;
+    }
+    if(screen) {
+        printf("\033[H\033[2J");// Clear the terminal
+    }
+    else {
+        printf("\n");
+    }
+    printf("showproc - %zu processes, every %.1fs\n", shown, live->interval);
+    print_header();
+    for(i = 0; i < limit; i++) {
+        print_row(&order[i]->row, &live->clock);
+    }
+    fflush(stdout);
+    free(order);
+}
+
+// Show the processes every interval seconds by CPU utilization since the previous sample, iterations times
+// (0 for no end)
+void live_mode(double interval, long iterations, const struct scan_clock* clock, int debug)
+{
+    struct live_state live;
+    memset(&live, 0, sizeof(live));
+    live.clock = *clock;
+    live.interval = interval;
+    live.proc_fd = open("/proc", O_RDONLY | O_DIRECTORY);
+    if(live.proc_fd == -1) { // ERROR
+        perror("live_mode(): Cannot open /proc");
+        exit(-1);
+    }
+    // Every followed process holds a descriptor
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    live_refresh(&live);// The first sample is the base of the CPU utilization of the first screen
+    live.refresh_ns = 0;// It collects every process from scratch, only the later samples are measured
+    live.refresh_procs = 0;
+    long done;
+    for(done = 0; iterations == 0 || done < iterations; done++) {
+        long long ns = next.tv_nsec + (long long)(interval * 1e9);
+        next.tv_sec += ns / 1000000000LL;
+        next.tv_nsec = ns % 1000000000LL;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+        live_refresh(&live);
+        live_print(&live);
+    }
+    if(debug) {
+        double samples = done ? done : 1;
+        fprintf(stderr, "live: %.3f ms per sample, %.3f ms per 1000 processes\n", live.refresh_ns / samples / 1e6,
+            live.refresh_procs ? live.refresh_ns / 1e3 / live.refresh_procs : 0.0);
+    }
+    size_t i;
+    for(i = 0; i < live.count; i++) {
+        live_track_close(&live.tracks[i]);
+    }
+    free(live.tracks);
+    free(live.pids);
+    close(live.proc_fd);
+}
+
+int main(int argc, char* argv[])
+{
+    int debug = 0;// Print the statistics of the caches to stderr
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);// Scan threads
+    double interval = 0;// Seconds between the samples of the live mode, 0 to list the processes once
+    const char* columns = NULL;// Columns shown, NULL for the default ones
+    const char* sort_key = NULL;// Sort key, NULL for the default one
+    const char* cmd_pattern = NULL;// Regular expression of the startup commands kept, NULL for all
+    const char* read_path = NULL;// Binary snapshots shown instead of /proc, NULL to show /proc
+    int invalid = 0;
+    long iterations = 0;// Samples shown by the live mode, 0 for no end
+    static struct option long_options[] = {
+        {"debug", no_argument, NULL, 'D'},
+        {"threads", required_argument, NULL, 'j'},
+        {"delay", required_argument, NULL, 'd'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"columns", required_argument, NULL, 'o'},
+        {"user", required_argument, NULL, 'u'},
+        {"pid", required_argument, NULL, 'p'},
+        {"cmd", required_argument, NULL, 'R'},
+        {"sort", required_argument, NULL, 'S'},
+        {"top", required_argument, NULL, 'T'},
+        {"tree", no_argument, NULL, 't'},
+        {"format", required_argument, NULL, 'F'},
+        {"read", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "Dj:d:n:o:u:p:L", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'D':
+                debug = 1;
+                break;
+            case 'j': {
+                char* end;
+                threads = strtol(optarg, &end, 10);
+                if(end == optarg || *end != '\0') {
+                    threads = 0;// Invalid
+                }
+                break;
+            }
+            case 'd': {
+                char* end;
+                interval = strtod(optarg, &end);
+                if(end == optarg || *end != '\0' || !(interval > 0)) {
+                    interval = -1;// Invalid
+                }
+                break;
+            }
+            case 'n': {
+                char* end;
+                iterations = strtol(optarg, &end, 10);
+                if(end == optarg || *end != '\0') {
+                    iterations = -1;// Invalid
+                }
+                break;
+            }
+            case 'o':
+                columns = optarg;
+                break;
+            case 'u':
+                invalid |= parse_users(optarg);
+                break;
+            case 'p':
+                invalid |= parse_pids(optarg);
+                break;
+            case 'R':
+                cmd_pattern = optarg;
+                break;
+            case 'S':
+                sort_key = optarg;
+                break;
+            case 'F':
+                if(strcmp(optarg, "text") == 0) {
+                    query.format = FORMAT_TEXT;
+                }
+                else if(strcmp(optarg, "jsonl") == 0) {
+                    query.format = FORMAT_JSONL;
+                }
+                else if(strcmp(optarg, "binary") == 0) {
+                    query.format = FORMAT_BINARY;
+                }
+                else {
+                    invalid = -1;
+                }
+                break;
+            case 'r':
+                read_path = optarg;
+                break;
+            case 't':
+                query.tree = 1;
+                break;
+            case 'L':
+                query.list_threads = 1;
+                break;
+            case 'T': {
+                char* end;
+                query.top = strtol(optarg, &end, 10);
+                if(end == optarg || *end != '\0' || query.top < 1) {
+                    invalid = -1;
+                }
+                break;
+            }
+            default:
+                printf("Use showproc by: ./showproc [-D|--debug] [-j threads] [-d interval [-n iterations]] [-o columns] [-u users] [-p pids] [--cmd=regex] [--sort=[-]column] [--top=n] [--tree] [-L] [--format=text|jsonl|binary] [--read=file]\n");
+                return -1;// ERROR
+        }
+    }
+    // The live mode shows the CPU utilization since the previous sample, the busiest first
+    // The tree shows the resources of every subtree
+    if(parse_columns(columns ? columns : interval > 0 ? "user,pid,ppid,pcpu,stime,tty,time,cmd"
+        : query.tree ? "user,pid,ppid,time,rss,nlwp,tree_time,tree_rss,tree_nlwp,cmd"
+        : query.list_threads ? "user,pid,ppid,lwp,c,nlwp,stime,tty,time,cmd"
+        : "user,pid,ppid,c,stime,tty,time,cmd") == -1 || parse_sort(sort_key ? sort_key : interval > 0 ? "-pcpu" : "pid") == -1) {
+        invalid = -1;
+    }
+    int i;
+    for(i = 0; !query.tree && !read_path && i <= query.column_count; i++) { // Subtrees are only summed by --tree
+        int column = i < query.column_count ? query.columns[i] : query.sort_column;
+        if(column == COL_TREE_TIME || column == COL_TREE_RSS || column == COL_TREE_NLWP) {
+            invalid = -1;
+        }
+    }
+    if(query.tree && (interval > 0 || read_path)) { // The tree lists the processes once
+        invalid = -1;
+    }
+    if(query.list_threads && (interval > 0 || read_path || query.tree)) { // The threads are listed once and flat
+        invalid = -1;
+    }
+    if(cmd_pattern && regcomp(&query.cmd_regex, cmd_pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        printf("Invalid regular expression %s\n", cmd_pattern);
+        invalid = -1;
+    }
+    query.match_cmd = cmd_pattern != NULL;
+    if(read_path && query.format == FORMAT_BINARY) { // A snapshot is shown as text or JSON lines
+        invalid = -1;
+    }
+    if(argc != optind || threads < 1 || interval < 0 || iterations < 0 || invalid) {
+        printf("Use showproc by: ./showproc [-D|--debug] [-j threads] [-d interval [-n iterations]] [-o columns] [-u users] [-p pids] [--cmd=regex] [--sort=[-]column] [--top=n] [--tree] [-L] [--format=text|jsonl|binary] [--read=file]\n");
+        return -1;// ERROR
+    }
+    if(threads > SCAN_MAX_THREADS) {
+        threads = SCAN_MAX_THREADS;
+    }
+    if(query.format == FORMAT_JSONL) {
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    }
+    if(read_path) {
+        exit(read_snapshots(read_path, columns == NULL) == 0 ? 0 : -1);
+    }
+    // Read only what the columns, the sort key and the filters need
+    for(i = 0; i < query.column_count; i++) {
+        query.needs |= column_defs[query.columns[i]].needs;
+    }
+    query.needs |= column_defs[query.sort_column].needs;
+    if(query.uids) {
+        query.needs |= NEED_STATUS;
+    }
+    if(query.match_cmd) {
+        query.needs |= NEED_CMDLINE;
+    }
+    for(i = 0; query.format != FORMAT_TEXT && i < query.column_count; i++) { // Structured formats keep it whole
+        query.full_cmd |= query.columns[i] == COL_CMD;
+    }
+    if(interval > 0 || query.tree || query.list_threads) { // CPU times of the samples, PPIDs of the tree, stat of the threads
+        query.needs |= NEED_STAT;
+    }
+    struct scan_clock clock;
+    clock.boot_time = get_boot_time();// System boot time
+    clock.current_time = time(NULL);// Current_time
+    clock.uptime = get_uptime();
+    clock.jiffies_per_sec = sysconf(_SC_CLK_TCK);// Get number of jiffies in per second
+    page_kib = sysconf(_SC_PAGESIZE) / 1024;
+    if(query.needs & NEED_TTY) {
+        tty_map_build();// Names of the terminals
+    }
+    if(interval > 0) {
+        live_mode(interval, iterations, &clock, debug);
+    }
+    else if(query.tree) {
+        print_tree(threads, &clock);
+    }
+    else {
+        print_processes(threads, &clock);
+    }
+    if(debug) {
+        fprintf(stderr, "uid cache: %lu lookups, %lu hits(%.1f%%), %lu users\n", uid_lookups, uid_hits,
+            uid_lookups ? 100.0 * uid_hits / uid_lookups : 0.0, uid_entries);
+        fprintf(stderr, "files read: %lu stat, %lu status, %lu cmdline, %lu statm, %lu smaps_rollup\n", files_read[0],
+            files_read[1], files_read[2], files_read[3], files_read[4]);
+    }
+    exit(0);
+}
@@ -0,0 +1,65 @@
+// Binary snapshot of showproc(--format=binary): a header, fixed-size records and a string table
+// A stream may hold several snapshots one after another(one per sample of the live mode)
+// Integers are stored in the byte order of the writer(little endian on x86 and ARM), a reader with the other
+// byte order does not find SNAPSHOT_MAGIC
+// Author: Noah Lin
+#ifndef SHOWPROC_SNAPSHOT_H
+#define SHOWPROC_SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "SHOWPROC"// First 8 bytes of every snapshot
+#define SNAPSHOT_VERSION 1// Changed when a field changes its meaning, new fields are appended to the records
+#define SNAPSHOT_MAX_COLUMNS 32
+
+// Columns of a listing, the numbers are stored in the snapshots so new columns are only appended
+enum column_id {
+    COL_USER, COL_UID, COL_PID, COL_PPID, COL_C, COL_PCPU, COL_STIME, COL_TTY, COL_TIME, COL_STATE, COL_NLWP,
+    COL_COMM, COL_CMD, COL_RSS, COL_VSZ, COL_TREE_TIME, COL_TREE_RSS, COL_TREE_NLWP,
+    COL_SHR, COL_PSS, COL_SWAP, COL_LWP, COLUMN_COUNT
+};
+
+// Header of a snapshot, followed by record_count records of record_size bytes and string_table_size bytes of strings
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;// sizeof(struct snapshot_record) of the writer, a reader skips fields it does not know
+    uint64_t record_count;
+    uint64_t string_table_size;
+    int64_t boot_time;// System boot time(seconds since the UNIX epoch)
+    int64_t sample_time;// Time of the sample(seconds since the UNIX epoch)
+    uint32_t jiffies_per_sec;
+    uint32_t column_count;
+    uint8_t columns[SNAPSHOT_MAX_COLUMNS];// enum column_id of the columns shown, only their fields are valid
+};
+
+// A process, the strings are offsets into the string table(NUL-terminated, offset 0 is the empty string)
+struct snapshot_record {
+    int32_t pid;
+    int32_t ppid;
+    uint32_t euid;
+    int32_t tty_nr;
+    uint64_t utime;// Measured in jiffies
+    uint64_t stime;
+    uint64_t start_jiffies;// Process start time after boot(measured in jiffies)
+    int64_t num_threads;
+    double cpu_percent;// Over the lifetime, or since the previous sample of the live mode
+    int32_t cpu_util;// C column
+    uint32_t state;// State letter
+    uint32_t user;
+    uint32_t tty;
+    uint32_t comm;
+    uint32_t cmd;// Whole startup command
+    uint64_t vsz;// Measured in KiB
+    uint64_t rss;// Measured in KiB
+    uint64_t tree_time;// Of the process and its descendants(--tree), measured in jiffies
+    uint64_t tree_rss;// Of the process and its descendants(--tree), measured in KiB
+    int64_t tree_threads;// Of the process and its descendants(--tree)
+    int32_t depth;// Level in the process tree(--tree), records of a tree are stored in pre-order
+    int32_t tid;// Thread ID(-L), the PID for a process
+    uint64_t shared;// Measured in KiB
+    int64_t pss;// Measured in KiB, -1 if it was not readable
+    int64_t swap;// Measured in KiB, -1 if it was not readable
+};
+
+#endif
@@ -0,0 +1,237 @@
+// A bounded pool of worker processes with work-stealing deques in shared memory
+// Every worker owns a deque: it pushes new work and pops it at the bottom(depth first, good locality),
+// an idle worker steals from the top of another deque(the oldest and usually the largest subtrees),
+// so both wide and deep trees keep every worker busy while the process count stays bounded
+// Author: Noah Lin
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
+#include "work_pool.h"
+
+#define ARENA_MAX_SIZE (1UL << 36)// Reserve 64 GiB of address space for the arena, pages are only used when touched
+#define ARENA_MIN_SIZE (1UL << 28)
+
+// Round a size up to a multiple of 64 bytes
+static size_t align_up(size_t size)
+{
+    return (size + 63) & ~(size_t)63;
+}
+
+// Create a pool of workers worker processes, return NULL if the shared memory can not be mapped
+struct work_pool* work_pool_create(int workers, unsigned long capacity)
+{
+    size_t head_size = align_up(sizeof(struct work_pool)) + align_up(sizeof(struct work_deque) * workers);
+    size_t deque_size = align_up(sizeof(struct work_item) * capacity);
+    size_t fixed_size = head_size + deque_size * workers;
+    size_t arena_size = ARENA_MAX_SIZE;
+    void* map = MAP_FAILED;
+    // The mapping is created before fork, so every pointer into it is valid in all workers
+    while(arena_size >= ARENA_MIN_SIZE) {
+        map = mmap(NULL, fixed_size + arena_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(map != MAP_FAILED) {
+            break;
+        }
+        arena_size /= 2;// Overcommit is limited, try a smaller reservation
+    }
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+    struct work_pool* pool = map;
+    pool->workers = workers;
+    pool->capacity = capacity;
+    pool->deques = (struct work_deque*)((char*)map + align_up(sizeof(struct work_pool)));
+    pool->map_size = fixed_size + arena_size;
+    pool->arena = (char*)map + fixed_size;
+    pool->arena_size = arena_size;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    int i;
+    for(i = 0; i < workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, &attr);
+        pool->deques[i].items = (struct work_item*)((char*)map + head_size + deque_size * i);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return pool;
+}
+
+// Allocate zeroed memory visible to every worker(never freed until the pool is destroyed), exit if the arena is full
+void* work_pool_alloc(struct work_pool* pool, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    size_t offset = __atomic_fetch_add(&pool->arena_used, size, __ATOMIC_RELAXED);
+    if(offset + size > pool->arena_size) { // ERROR
+        printf("work_pool_alloc(): Shared arena is full\n");
+        exit(-1);
+    }
+    return pool->arena + offset;// Anonymous pages are zero filled
+}
+
+// Copy a string into the shared arena
+char* work_pool_strdup(struct work_pool* pool, const char* str)
+{
+    size_t len = strlen(str);
+    char* copy = work_pool_alloc(pool, len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+// Push a work item to the deque of a worker, return 1 if succeed, return 0 if the deque is full
+int work_pool_push(struct work_pool* pool, int worker, const struct work_item* item)
+{
+    struct work_deque* deque = &pool->deques[worker];
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom - deque->top == pool->capacity) { // Full
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    // Count the item before it can be taken, so pending never drops to 0 while work is left
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    deque->items[deque->bottom % pool->capacity] = *item;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+// Pop the newest item of the own deque, return 1 if succeed, return 0 if the deque is empty
+static int pop_bottom(struct work_pool* pool, int worker, struct work_item* item)
+{
+    struct work_deque* deque = &pool->deques[worker];
+    int ret = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom != deque->top) {
+        deque->bottom--;
+        *item = deque->items[deque->bottom % pool->capacity];
+        ret = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+// Steal the oldest item of another deque, return 1 if succeed, return 0 if the deque is empty
+static int steal_top(struct work_pool* pool, int victim, struct work_item* item)
+{
+    struct work_deque* deque = &pool->deques[victim];
+    int ret = 0;
+    if(deque->bottom == deque->top) { // Unlocked peek, skip empty deques cheaply
+        return 0;
+    }
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom != deque->top) {
+        *item = deque->items[deque->top % pool->capacity];
+        deque->top++;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+// Main loop of a worker process
+static void worker_loop(struct work_pool* pool, int worker, work_handler handler, void* arg)
+{
+    struct work_item item;
+    long idle_ns = 0;// Backoff of an idle worker
+    unsigned int seed = worker * 2654435761U + 1;
+    while(!pool->abort) {
+        int found = pop_bottom(pool, worker, &item);
+        int i;
+        // Try to steal from the other workers, start at a random victim to spread contention
+        int start = rand_r(&seed) % pool->workers;
+        for(i = 0; !found && i < pool->workers; i++) {
+            int victim = (start + i) % pool->workers;
+            if(victim != worker) {
+                found = steal_top(pool, victim, &item);
+            }
+        }
+        if(found) {
+            idle_ns = 0;
+            handler(pool, worker, &item, arg);
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        handler(pool, worker, NULL, arg);// Let the worker finish its work in flight before it waits or exits
+        if(__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) { // All work is done
+            break;
+        }
+        // Another worker is still producing work, back off before trying again
+        idle_ns = idle_ns ? (idle_ns * 2 > 1000000 ? 1000000 : idle_ns * 2) : 20000;
+        struct timespec ts = {0, idle_ns};
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Let the parent process call monitor every interval_ms milliseconds while the workers run
+void work_pool_set_monitor(struct work_pool* pool, work_monitor monitor, void* arg, int interval_ms)
+{
+    pool->monitor = monitor;
+    pool->monitor_arg = arg;
+    pool->monitor_interval_ms = interval_ms;
+}
+
+// Fork the workers and let them handle all work items until no item is left
+// Return 0 if every worker succeeded, otherwise return -1
+int work_pool_run(struct work_pool* pool, work_handler handler, void* arg)
+{
+    int i;
+    int ret = 0;
+    sigset_t child_set;
+    sigset_t old_set;
+    sigemptyset(&child_set);
+    sigaddset(&child_set, SIGCHLD);
+    if(pool->monitor) { // A blocked SIGCHLD stays pending, so the parent can wait for it with a timeout
+        sigprocmask(SIG_BLOCK, &child_set, &old_set);
+    }
+    fflush(stdout);// Do not let the workers print buffered output again
+    for(i = 0; i < pool->workers; i++) {
+        pid_t pid = fork();
+        if(pid == 0) { // Worker process
+            if(pool->monitor) {
+                sigprocmask(SIG_SETMASK, &old_set, NULL);
+            }
+            setvbuf(stdout, NULL, _IOLBF, 0);// Whole lines, so the reports of the workers do not interleave
+            worker_loop(pool, i, handler, arg);
+            fflush(stdout);
+            _exit(pool->abort ? -1 : 0);
+        }
+        else if(pid < 0) { // ERROR
+            printf("Cannot fork a process\n");
+            perror("fork");
+            pool->abort = 1;
+            ret = -1;
+            break;
+        }
+    }
+    // Wait for worker processes, the monitor is called whenever no worker exited during an interval
+    int status;
+    pid_t pid;
+    while((pid = waitpid(-1, &status, pool->monitor ? WNOHANG : 0)) != -1) {
+        if(pid == 0) {
+            pool->monitor(pool, pool->monitor_arg);
+            struct timespec timeout = {pool->monitor_interval_ms / 1000, (pool->monitor_interval_ms % 1000) * 1000000L};
+            sigtimedwait(&child_set, NULL, &timeout);
+        }
+        else if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) { // A worker failed, stop the others
+            pool->abort = 1;
+            ret = -1;
+        }
+    }
+    if(pool->monitor) {
+        sigprocmask(SIG_SETMASK, &old_set, NULL);
+    }
+    return ret;
+}
+
+// Unmap the shared memory of a pool
+void work_pool_destroy(struct work_pool* pool)
+{
+    munmap(pool, pool->map_size);
+}
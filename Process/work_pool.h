@@ -0,0 +1,82 @@
+// A bounded pool of worker processes with work-stealing deques in shared memory
+// Author: Noah Lin
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+// Types of work items
+enum work_type {
+    WORK_DIR = 1,// Copy a directory(read it and push its entries)
+    WORK_FILE,// Copy a file
+    WORK_CHUNK// Copy a range of a large file
+};
+
+// A work item, path points into the shared arena of the pool so it is valid in every worker
+struct work_item {
+    int type;
+    int flags;
+    char* path;// Path relative to the source and target roots
+    const char* parent;// Path of the parent directory item(its address identifies the directory), NULL for the root
+    const char* name;// Last component of path
+    off_t offset;// Range of a WORK_CHUNK item
+    off_t length;
+    void* file;// State shared by the ranges of a split file(in the shared arena), NULL if none
+};
+
+// A deque owned by one worker, the owner pushes and pops at the bottom, other workers steal from the top
+struct work_deque {
+    pthread_mutex_t lock;// Process-shared mutex
+    unsigned long top;
+    unsigned long bottom;
+    struct work_item* items;// Ring buffer of capacity items
+};
+
+struct work_pool;
+// Handle a work item taken by a worker
+// It is called with a NULL item when the worker runs out of work, so work which is still in flight can be finished
+typedef void (*work_handler)(struct work_pool* pool, int worker, struct work_item* item, void* arg);
+
+// Called periodically by the parent process while the workers run(e.g. to report progress)
+typedef void (*work_monitor)(struct work_pool* pool, void* arg);
+
+struct work_pool {
+    int workers;// Number of worker processes
+    unsigned long capacity;// Capacity of every deque
+    struct work_deque* deques;
+    volatile long pending;// Work items pushed but not finished yet
+    volatile int abort;// Set if a worker failed, the others stop as soon as possible
+    char* arena;// Shared bump allocator for paths and shared tables
+    size_t arena_size;
+    volatile size_t arena_used;
+    size_t map_size;// Size of the whole shared mapping
+    work_monitor monitor;// Used by the parent process only, NULL if there is no monitor
+    void* monitor_arg;
+    int monitor_interval_ms;
+};
+
+// Create a pool of workers worker processes, return NULL if the shared memory can not be mapped
+struct work_pool* work_pool_create(int workers, unsigned long capacity);
+
+// Allocate zeroed memory visible to every worker(never freed until the pool is destroyed), exit if the arena is full
+void* work_pool_alloc(struct work_pool* pool, size_t size);
+
+// Copy a string into the shared arena
+char* work_pool_strdup(struct work_pool* pool, const char* str);
+
+// Push a work item to the deque of a worker, return 1 if succeed, return 0 if the deque is full
+// (the caller should then handle the item itself)
+int work_pool_push(struct work_pool* pool, int worker, const struct work_item* item);
+
+// Let the parent process call monitor every interval_ms milliseconds while the workers run
+void work_pool_set_monitor(struct work_pool* pool, work_monitor monitor, void* arg, int interval_ms);
+
+// Fork the workers and let them handle all work items until no item is left
+// Return 0 if every worker succeeded, otherwise return -1
+int work_pool_run(struct work_pool* pool, work_handler handler, void* arg);
+
+// Unmap the shared memory of a pool
+void work_pool_destroy(struct work_pool* pool);
+
+#endif